@@ -0,0 +1,552 @@
+//! Benchmarks of the per-frame hot paths over synthetic frames, so no camera is needed.
+//!
+//! Setting `ARDUCAM_TOF_STAGE_REPORT=1` also prints a per-stage throughput report in pixels/s
+//! and frames/s after the usual criterion output, and writes it to
+//! `target/criterion/stage_report.csv` for tracking across releases:
+//!
+//! ```text
+//! ARDUCAM_TOF_STAGE_REPORT=1 cargo bench --bench pipeline
+//! ```
+
+use std::hint::black_box;
+use std::io::Write;
+use std::time::{Duration, Instant};
+
+use arducam_tof::binning::{BinFactor, BinMode, BinnedFrame};
+use arducam_tof::export::{CloudFormat, PointCloudExporter};
+use arducam_tof::mask::ThresholdFilter;
+use arducam_tof::outlier::FlyingPixelFilter;
+use arducam_tof::phase::{PhaseDecoder, PHASES};
+use arducam_tof::projection::{HORIZONTAL_FOV, VERTICAL_FOV};
+use arducam_tof::simd::Kernel;
+use arducam_tof::spatial::{BilateralFilter, MedianFilter, MedianSize};
+use arducam_tof::synthetic::{render_frame, render_raw_phase, SYNTHETIC_RANGE};
+use arducam_tof::temporal::TemporalFilter;
+use arducam_tof::voxel::VoxelGrid;
+use arducam_tof::wire::FrameEncoder;
+use arducam_tof::{
+    ArducamFrameFormat, DensePoints, FrameData, FramePool, FrameType, PointCloudProjector,
+    ProjectedPoints, ValidityMask,
+};
+use bincode::Options;
+use criterion::{criterion_group, BenchmarkId, Criterion, Throughput};
+use serde::Serialize;
+
+/// The sensor's native resolution and the VGA resolution of larger modules
+const RESOLUTIONS: [(u16, u16); 2] = [(240, 180), (640, 480)];
+
+const MIN_CONFIDENCE: f32 = 30.0;
+const MIN_DEPTH: f32 = 0.2;
+const MAX_DEPTH: f32 = 4.0;
+/// The resolution our mapping backend works at, in metres
+const VOXEL_SIZE: f32 = 0.02;
+
+/// The point type the point_cloud_client example used to send
+#[derive(Serialize)]
+struct MyPoint {
+    x: f32,
+    y: f32,
+    z: f32,
+    confidence: f32,
+}
+
+/// A synthetic frame plus every buffer the stages write into, allocated up front
+struct Fixture {
+    width: u16,
+    height: u16,
+    depth: Vec<f32>,
+    confidence: Vec<f32>,
+    pool: FramePool,
+    projector: PointCloudProjector,
+    aos: Vec<[f32; 3]>,
+    soa: ProjectedPoints,
+    filtered: Vec<[f32; 4]>,
+    points: Vec<MyPoint>,
+    bytes: Vec<u8>,
+    encoder: FrameEncoder,
+    raw: [Vec<i16>; PHASES],
+    phase_decoder: PhaseDecoder,
+    decoded_depth: Vec<f32>,
+    amplitude: Vec<f32>,
+    temporal: TemporalFilter,
+    median: MedianFilter,
+    bilateral: BilateralFilter,
+    denoised: Vec<f32>,
+    outlier_filter: FlyingPixelFilter,
+    mask: ValidityMask,
+    threshold_filter: ThresholdFilter,
+    threshold_mask: ValidityMask,
+    compact: Vec<[f32; 3]>,
+    dense: DensePoints,
+    voxel_grid: VoxelGrid,
+    voxels: Vec<[f32; 3]>,
+    binned: BinnedFrame,
+    exporter: PointCloudExporter,
+}
+
+impl Fixture {
+    fn new(width: u16, height: u16) -> Self {
+        let pixels = width as usize * height as usize;
+        let mut depth = vec![0.0; pixels];
+        let mut confidence = vec![0.0; pixels];
+        render_frame(17, width, height, &mut depth, &mut confidence);
+
+        let projector = PointCloudProjector::from_fov(width, height, HORIZONTAL_FOV, VERTICAL_FOV);
+        let mut aos = vec![[0.0; 3]; pixels];
+        let mut soa = ProjectedPoints::new();
+        let threshold_filter = ThresholdFilter::new()
+            .with_depth_range(MIN_DEPTH, MAX_DEPTH)
+            .with_min_confidence(MIN_CONFIDENCE);
+        let mut threshold_mask = ValidityMask::default();
+        let mut dense = DensePoints::new();
+        {
+            let depth = FrameData::new(width, height, &depth);
+            let confidence = FrameData::new(width, height, &confidence);
+            projector.project(&depth, &mut aos).unwrap();
+            projector
+                .project_soa(&depth, &confidence, MIN_CONFIDENCE, &mut soa)
+                .unwrap();
+            threshold_filter
+                .apply(&depth, &confidence, &mut threshold_mask)
+                .unwrap();
+            projector
+                .project_dense(&depth, &confidence, &threshold_filter, &mut dense)
+                .unwrap();
+        }
+
+        let points = aos
+            .iter()
+            .zip(&confidence)
+            .map(|(&[x, y, z], &confidence)| MyPoint {
+                x,
+                y,
+                z,
+                confidence,
+            })
+            .collect();
+
+        let raw = std::array::from_fn(|phase| {
+            let mut raw = vec![0; pixels];
+            render_raw_phase(&depth, &confidence, phase, SYNTHETIC_RANGE, &mut raw);
+            raw
+        });
+
+        Self {
+            width,
+            height,
+            depth,
+            confidence,
+            pool: FramePool::new(1, width, height),
+            projector,
+            aos,
+            soa,
+            filtered: Vec::with_capacity(pixels),
+            points,
+            bytes: Vec::with_capacity(pixels * 16 + 16),
+            encoder: FrameEncoder::new(),
+            raw,
+            phase_decoder: PhaseDecoder::new(width, height, SYNTHETIC_RANGE),
+            decoded_depth: vec![0.0; pixels],
+            amplitude: vec![0.0; pixels],
+            temporal: TemporalFilter::new(width, height),
+            median: MedianFilter::new(width, height, MedianSize::Three),
+            bilateral: BilateralFilter::new(width, height, 2, 1.5, 0.05),
+            denoised: vec![0.0; pixels],
+            outlier_filter: FlyingPixelFilter::new(),
+            mask: ValidityMask::new(width, height),
+            threshold_filter,
+            threshold_mask,
+            compact: Vec::with_capacity(pixels),
+            dense,
+            voxel_grid: VoxelGrid::new(VOXEL_SIZE, pixels),
+            voxels: Vec::with_capacity(pixels),
+            binned: BinnedFrame::new(),
+            exporter: PointCloudExporter::new(CloudFormat::Ply).with_skip_invalid(true),
+        }
+    }
+
+    fn pixels(&self) -> usize {
+        self.depth.len()
+    }
+
+    /// Reconstructing depth and amplitude from four raw phase frames
+    fn phase_decode(&mut self) {
+        let raw = self
+            .raw
+            .each_ref()
+            .map(|raw| FrameData::new(self.width, self.height, raw));
+        self.phase_decoder
+            .decode_frames(raw.each_ref(), &mut self.decoded_depth, &mut self.amplitude)
+            .unwrap();
+        black_box(&self.decoded_depth);
+    }
+
+    /// Copying a frame out of the SDK's buffer into a pooled [arducam_tof::OwnedFrame]
+    fn copy_out(&mut self) {
+        let format = ArducamFrameFormat {
+            width: self.width,
+            height: self.height,
+            frame_type: FrameType::DepthFrame,
+            timestamp: 0,
+        };
+        let frame = self
+            .pool
+            .copy_frame(
+                format,
+                &FrameData::new(self.width, self.height, &self.depth),
+                &FrameData::new(self.width, self.height, &self.confidence),
+            )
+            .unwrap();
+        black_box(&frame);
+    }
+
+    /// Blending a frame into the temporally smoothed depth
+    fn temporal(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        let smoothed = self.temporal.apply(&depth, &confidence).unwrap();
+        black_box(smoothed.as_slice());
+    }
+
+    fn median(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        self.median.apply(&depth, &mut self.denoised).unwrap();
+        black_box(&self.denoised);
+    }
+
+    fn bilateral(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        self.bilateral.apply(&depth, &mut self.denoised).unwrap();
+        black_box(&self.denoised);
+    }
+
+    fn flying_pixels(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        self.outlier_filter
+            .apply(&depth, &confidence, &mut self.mask)
+            .unwrap();
+        black_box(&self.mask);
+    }
+
+    fn threshold(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        self.threshold_filter
+            .apply(&depth, &confidence, &mut self.threshold_mask)
+            .unwrap();
+        black_box(&self.threshold_mask);
+    }
+
+    /// The projection the examples did before [PointCloudProjector] existed
+    fn project_naive(&mut self) {
+        let width = self.width as usize;
+        let fx = self.width as f32 / (2.0 * f32::tan(0.5 * HORIZONTAL_FOV.to_radians()));
+        let fy = self.height as f32 / (2.0 * f32::tan(0.5 * VERTICAL_FOV.to_radians()));
+
+        for (i, (point, &z)) in self.aos.iter_mut().zip(&self.depth).enumerate() {
+            let (row, column) = (i / width, i % width);
+            let x = (((self.width / 2) as f32 - column as f32) / fx) * z;
+            let y = (((self.height / 2) as f32 - row as f32) / fy) * z;
+            *point = [x, y, z];
+        }
+        black_box(&self.aos);
+    }
+
+    fn project_lut(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        self.projector.project(&depth, &mut self.aos).unwrap();
+        black_box(&self.aos);
+    }
+
+    fn project_soa(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        self.projector
+            .project_soa(&depth, &confidence, MIN_CONFIDENCE, &mut self.soa)
+            .unwrap();
+        black_box(&self.soa);
+    }
+
+    /// Projecting just the points that passed [Fixture::threshold]
+    fn project_compact(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        self.projector
+            .project_compact(&depth, &self.threshold_mask, &mut self.compact)
+            .unwrap();
+        black_box(&self.compact);
+    }
+
+    /// Thresholding, projecting and packing the valid points in one pass
+    fn project_dense(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        self.projector
+            .project_dense(&depth, &confidence, &self.threshold_filter, &mut self.dense)
+            .unwrap();
+        black_box(&self.dense);
+    }
+
+    /// Binning 2x2 pixels into one, weighted by confidence
+    fn bin(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        depth
+            .bin_into(
+                &confidence,
+                BinFactor::Two,
+                BinMode::WeightedMean,
+                &mut self.binned,
+            )
+            .unwrap();
+        black_box(&self.binned);
+    }
+
+    /// Reducing the valid points to one per voxel
+    fn voxel_downsample(&mut self) {
+        self.voxel_grid
+            .downsample_dense(&self.dense, &mut self.voxels);
+        black_box(&self.voxels);
+    }
+
+    /// Dropping out of range and low confidence points one at a time, as the
+    /// point_cloud_server example does on its render thread
+    fn filter_naive(&mut self) {
+        self.filtered.clear();
+        for (&[x, y, z], &confidence) in self.aos.iter().zip(&self.confidence) {
+            if z < MIN_DEPTH || z > MAX_DEPTH || confidence < MIN_CONFIDENCE {
+                continue;
+            }
+            self.filtered.push([x, y, z, confidence]);
+        }
+        black_box(&self.filtered);
+    }
+
+    /// Gathering the points marked valid by [PointCloudProjector::project_soa]
+    fn filter_mask(&mut self) {
+        self.filtered.clear();
+        for (word_index, &word) in self.soa.valid.iter().enumerate() {
+            let mut bits = word;
+            while bits != 0 {
+                let i = word_index * 64 + bits.trailing_zeros() as usize;
+                bits &= bits - 1;
+                let z = self.soa.z[i];
+                if z <= MAX_DEPTH && z >= MIN_DEPTH {
+                    self.filtered
+                        .push([self.soa.x[i], self.soa.y[i], z, self.confidence[i]]);
+                }
+            }
+        }
+        black_box(&self.filtered);
+    }
+
+    /// The bincode serialisation the point_cloud_client example used to do
+    fn serialise_bincode(&mut self) {
+        self.bytes.clear();
+        let options = bincode::DefaultOptions::new().allow_trailing_bytes();
+        let mut serializer = bincode::Serializer::new(&mut self.bytes, options);
+        self.points.serialize(&mut serializer).unwrap();
+        black_box(&self.bytes);
+    }
+
+    /// Quantising the depth and confidence planes for the wire protocol
+    fn serialise_wire(&mut self) {
+        let format = ArducamFrameFormat {
+            width: self.width,
+            height: self.height,
+            frame_type: FrameType::DepthFrame,
+            timestamp: 0,
+        };
+        let bytes = self.encoder.encode(
+            &format,
+            &FrameData::new(self.width, self.height, &self.depth),
+            &FrameData::new(self.width, self.height, &self.confidence),
+        );
+        black_box(bytes);
+    }
+
+    /// Quantising just the pixels that passed [Fixture::threshold] for the wire protocol
+    fn serialise_wire_masked(&mut self) {
+        let format = ArducamFrameFormat {
+            width: self.width,
+            height: self.height,
+            frame_type: FrameType::DepthFrame,
+            timestamp: 0,
+        };
+        let bytes = self.encoder.encode_masked(
+            &format,
+            &FrameData::new(self.width, self.height, &self.depth),
+            &FrameData::new(self.width, self.height, &self.confidence),
+            &self.threshold_mask,
+        );
+        black_box(bytes);
+    }
+
+    /// Projecting and writing the points that passed [Fixture::threshold] as binary PLY
+    fn export_ply(&mut self) {
+        let depth = FrameData::new(self.width, self.height, &self.depth);
+        let confidence = FrameData::new(self.width, self.height, &self.confidence);
+        self.exporter
+            .write_frame(
+                &mut std::io::sink(),
+                &self.projector,
+                &depth,
+                &confidence,
+                Some(&self.threshold_mask),
+            )
+            .unwrap();
+    }
+}
+
+/// Every stage in the report, in pipeline order
+const STAGES: &[(&str, fn(&mut Fixture))] = &[
+    ("phase/decode", Fixture::phase_decode),
+    ("copy_out", Fixture::copy_out),
+    ("temporal", Fixture::temporal),
+    ("spatial/median3", Fixture::median),
+    ("spatial/bilateral", Fixture::bilateral),
+    ("outlier/flying", Fixture::flying_pixels),
+    ("mask/threshold", Fixture::threshold),
+    ("bin/2x2", Fixture::bin),
+    ("project/naive", Fixture::project_naive),
+    ("project/lut", Fixture::project_lut),
+    ("project/soa", Fixture::project_soa),
+    ("project/compact", Fixture::project_compact),
+    ("project/dense", Fixture::project_dense),
+    ("voxel/downsample", Fixture::voxel_downsample),
+    ("filter/naive", Fixture::filter_naive),
+    ("filter/mask", Fixture::filter_mask),
+    ("serialise/bincode", Fixture::serialise_bincode),
+    ("serialise/wire", Fixture::serialise_wire),
+    ("serialise/wire_masked", Fixture::serialise_wire_masked),
+    ("export/ply", Fixture::export_ply),
+];
+
+fn bench_stages(c: &mut Criterion) {
+    for (width, height) in RESOLUTIONS {
+        let mut fixture = Fixture::new(width, height);
+        let mut group = c.benchmark_group(format!("{width}x{height}"));
+        group.throughput(Throughput::Elements(fixture.pixels() as u64));
+
+        for &(name, stage) in STAGES {
+            group.bench_function(name, |b| b.iter(|| stage(&mut fixture)));
+        }
+
+        group.finish();
+    }
+}
+
+fn bench_kernels(c: &mut Criterion) {
+    for (width, height) in RESOLUTIONS {
+        let mut fixture = Fixture::new(width, height);
+        let mut group = c.benchmark_group(format!("{width}x{height}/kernels"));
+        group.throughput(Throughput::Elements(fixture.pixels() as u64));
+
+        for kernel in Kernel::supported() {
+            fixture.projector =
+                PointCloudProjector::from_fov(width, height, HORIZONTAL_FOV, VERTICAL_FOV)
+                    .with_kernel(kernel);
+            group.bench_with_input(
+                BenchmarkId::new("project_soa", format!("{kernel:?}")),
+                &kernel,
+                |b, _| b.iter(|| fixture.project_soa()),
+            );
+            group.bench_with_input(
+                BenchmarkId::new("project_dense", format!("{kernel:?}")),
+                &kernel,
+                |b, _| b.iter(|| fixture.project_dense()),
+            );
+
+            fixture.phase_decoder =
+                PhaseDecoder::new(width, height, SYNTHETIC_RANGE).with_kernel(kernel);
+            group.bench_with_input(
+                BenchmarkId::new("phase_decode", format!("{kernel:?}")),
+                &kernel,
+                |b, _| b.iter(|| fixture.phase_decode()),
+            );
+
+            fixture.threshold_filter = ThresholdFilter::new()
+                .with_depth_range(MIN_DEPTH, MAX_DEPTH)
+                .with_min_confidence(MIN_CONFIDENCE)
+                .with_kernel(kernel);
+            group.bench_with_input(
+                BenchmarkId::new("threshold", format!("{kernel:?}")),
+                &kernel,
+                |b, _| b.iter(|| fixture.threshold()),
+            );
+
+            fixture.temporal = TemporalFilter::new(width, height).with_kernel(kernel);
+            group.bench_with_input(
+                BenchmarkId::new("temporal", format!("{kernel:?}")),
+                &kernel,
+                |b, _| b.iter(|| fixture.temporal()),
+            );
+        }
+
+        group.finish();
+    }
+}
+
+/// Set to 1 to run [stage_report] after the benchmarks
+const STAGE_REPORT_VAR: &str = "ARDUCAM_TOF_STAGE_REPORT";
+
+/// Time each stage for about a second and report its throughput
+fn stage_report() {
+    const RUN_TIME: Duration = Duration::from_secs(1);
+
+    let mut report = String::from("resolution,stage,ns_per_frame,pixels_per_sec,frames_per_sec\n");
+    println!(
+        "\n{:<10} {:<22} {:>12} {:>16} {:>12}",
+        "resolution", "stage", "ns/frame", "pixels/s", "frames/s"
+    );
+
+    for (width, height) in RESOLUTIONS {
+        let mut fixture = Fixture::new(width, height);
+        for &(name, stage) in STAGES {
+            let start = Instant::now();
+            let mut frames = 0u64;
+            while start.elapsed() < RUN_TIME {
+                stage(&mut fixture);
+                frames += 1;
+            }
+
+            let seconds = start.elapsed().as_secs_f64();
+            let ns_per_frame = seconds * 1e9 / frames as f64;
+            let frames_per_sec = frames as f64 / seconds;
+            let pixels_per_sec = frames_per_sec * fixture.pixels() as f64;
+
+            let resolution = format!("{width}x{height}");
+            println!(
+                "{resolution:<10} {name:<22} {ns_per_frame:>12.0} {pixels_per_sec:>16.3e} {frames_per_sec:>12.1}"
+            );
+            report.push_str(&format!(
+                "{resolution},{name},{ns_per_frame:.0},{pixels_per_sec:.0},{frames_per_sec:.1}\n"
+            ));
+        }
+    }
+
+    let path = std::path::Path::new(
+        &std::env::var("CARGO_TARGET_DIR").unwrap_or_else(|_| "target".into()),
+    )
+    .join("criterion/stage_report.csv");
+    let written = std::fs::create_dir_all(path.parent().unwrap())
+        .and_then(|_| std::fs::File::create(&path))
+        .and_then(|mut file| file.write_all(report.as_bytes()));
+    match written {
+        Ok(()) => println!("\nStage report written to {}", path.display()),
+        Err(e) => println!("\nFailed to write stage report to {}: {e}", path.display()),
+    }
+}
+
+criterion_group!(benches, bench_stages, bench_kernels);
+
+fn main() {
+    benches();
+    Criterion::default().configure_from_args().final_summary();
+
+    // Opt in, as the report times every stage whatever criterion was asked to filter or list
+    let quick = std::env::args().any(|arg| arg == "--test" || arg == "--list");
+    if !quick && std::env::var_os(STAGE_REPORT_VAR).is_some_and(|value| value == "1") {
+        stage_report();
+    }
+}
@@ -0,0 +1,98 @@
+//! The spatial filters against their OpenCV equivalents, over synthetic frames.
+//!
+//! OpenCV's filters treat invalid pixels as a depth of 0 and blend them into their neighbours,
+//! so they do a little less work per pixel than ours, but they are what we used before.
+
+use std::hint::black_box;
+
+use arducam_tof::spatial::{BilateralFilter, MedianFilter, MedianSize};
+use arducam_tof::synthetic::render_frame;
+use arducam_tof::FrameData;
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use opencv::core::{Mat, BORDER_DEFAULT};
+use opencv::imgproc;
+
+/// The sensor's native resolution and the VGA resolution of larger modules
+const RESOLUTIONS: [(u16, u16); 2] = [(240, 180), (640, 480)];
+
+const BILATERAL_RADIUS: usize = 2;
+const SIGMA_SPACE: f32 = 1.5;
+const SIGMA_DEPTH: f32 = 0.05;
+
+fn bench_spatial(c: &mut Criterion) {
+    let cores = std::thread::available_parallelism().map_or(1, |cores| cores.get());
+
+    for (width, height) in RESOLUTIONS {
+        let pixels = width as usize * height as usize;
+        let mut depth = vec![0.0; pixels];
+        let mut confidence = vec![0.0; pixels];
+        render_frame(17, width, height, &mut depth, &mut confidence);
+        let frame = FrameData::new(width, height, &depth);
+        let mut out = vec![0.0; pixels];
+        let mut mat_out = Mat::default();
+
+        let mut group = c.benchmark_group(format!("{width}x{height}/spatial"));
+        group.throughput(Throughput::Elements(pixels as u64));
+
+        for (name, size, aperture) in [
+            ("median3", MedianSize::Three, 3),
+            ("median5", MedianSize::Five, 5),
+        ] {
+            for threads in [1, cores] {
+                let filter = MedianFilter::new(width, height, size).with_threads(threads);
+                group.bench_function(BenchmarkId::new(name, format!("{threads} threads")), |b| {
+                    b.iter(|| {
+                        filter.apply(&frame, &mut out).unwrap();
+                        black_box(&out);
+                    })
+                });
+            }
+
+            group.bench_function(BenchmarkId::new(name, "opencv"), |b| {
+                b.iter(|| {
+                    let mat =
+                        Mat::new_rows_cols_with_data(height as i32, width as i32, &depth).unwrap();
+                    imgproc::median_blur(&mat, &mut mat_out, aperture).unwrap();
+                    black_box(&mat_out);
+                })
+            });
+        }
+
+        for threads in [1, cores] {
+            let filter =
+                BilateralFilter::new(width, height, BILATERAL_RADIUS, SIGMA_SPACE, SIGMA_DEPTH)
+                    .with_threads(threads);
+            group.bench_function(
+                BenchmarkId::new("bilateral", format!("{threads} threads")),
+                |b| {
+                    b.iter(|| {
+                        filter.apply(&frame, &mut out).unwrap();
+                        black_box(&out);
+                    })
+                },
+            );
+        }
+
+        group.bench_function(BenchmarkId::new("bilateral", "opencv"), |b| {
+            b.iter(|| {
+                let mat =
+                    Mat::new_rows_cols_with_data(height as i32, width as i32, &depth).unwrap();
+                imgproc::bilateral_filter(
+                    &mat,
+                    &mut mat_out,
+                    2 * BILATERAL_RADIUS as i32 + 1,
+                    SIGMA_DEPTH as f64,
+                    SIGMA_SPACE as f64,
+                    BORDER_DEFAULT,
+                )
+                .unwrap();
+                black_box(&mat_out);
+            })
+        });
+
+        group.finish();
+    }
+}
+
+criterion_group!(benches, bench_spatial);
+criterion_main!(benches);
@@ -0,0 +1,63 @@
+use std::fs::File;
+use std::path::PathBuf;
+
+use arducam_tof::export::{CloudFormat, PointCloudExporter};
+use arducam_tof::mask::ThresholdFilter;
+use arducam_tof::projection::{HORIZONTAL_FOV, VERTICAL_FOV};
+use arducam_tof::recording::{Pacing, ReplayBackend};
+use arducam_tof::{ArducamDepthCamera, FrameType, PointCloudProjector, ValidityMask};
+
+/// Pixels below this confidence are too noisy to be worth exporting
+const MIN_CONFIDENCE: f32 = 30.0;
+
+/// Export every frame of a recording made with the record example as a point cloud file, for
+/// offline analysis.
+///
+/// Usage: export_cloud <RECORDING> <DIRECTORY> [ply|pcd]
+fn main() {
+    let recording = std::env::args().nth(1).unwrap();
+    let directory = PathBuf::from(std::env::args().nth(2).unwrap());
+    let (format, extension) = match std::env::args().nth(3).as_deref() {
+        None | Some("ply") => (CloudFormat::Ply, "ply"),
+        Some("pcd") => (CloudFormat::Pcd, "pcd"),
+        Some(other) => panic!("Unknown format {other}, expected ply or pcd"),
+    };
+
+    let backend = ReplayBackend::from_file(&recording, Pacing::Unpaced).unwrap();
+    let frames = backend.frame_count();
+    let mut cam = ArducamDepthCamera::with_backend(backend);
+    cam.open(arducam_tof::Connection::CSI, 0).unwrap();
+    cam.start(FrameType::DepthFrame).unwrap();
+
+    std::fs::create_dir_all(&directory).unwrap();
+    let mut exporter = PointCloudExporter::new(format).with_skip_invalid(true);
+    let thresholds = ThresholdFilter::new().with_min_confidence(MIN_CONFIDENCE);
+    let mut mask = ValidityMask::default();
+    let mut projector: Option<PointCloudProjector> = None;
+
+    for index in 0..frames {
+        let frame = cam.request_frame(None).unwrap();
+        let depth = frame.get_depth_data();
+        let confidence = frame.get_confidence_data();
+
+        let size = (depth.width(), depth.height());
+        let projector = match &mut projector {
+            Some(projector) if (projector.width(), projector.height()) == size => projector,
+            projector => projector.insert(PointCloudProjector::from_fov(
+                size.0,
+                size.1,
+                HORIZONTAL_FOV,
+                VERTICAL_FOV,
+            )),
+        };
+
+        thresholds.apply(&depth, &confidence, &mut mask).unwrap();
+        // The exporter buffers its writes itself
+        let mut file = File::create(directory.join(format!("{index:05}.{extension}"))).unwrap();
+        exporter
+            .write_frame(&mut file, projector, &depth, &confidence, Some(&mask))
+            .unwrap();
+    }
+
+    println!("Exported {frames} frames to {}", directory.display());
+}
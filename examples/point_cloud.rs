@@ -1,9 +1,10 @@
 extern crate kiss3d;
 extern crate nalgebra as na;
 
-use std::time::Duration;
-
-use arducam_tof::ArducamDepthCamera;
+use arducam_tof::capture::CaptureEngine;
+use arducam_tof::outlier::FlyingPixelFilter;
+use arducam_tof::projection::{HORIZONTAL_FOV, VERTICAL_FOV};
+use arducam_tof::{Intrinsics, PointCloudProjector, ValidityMask};
 use kiss3d::camera::Camera;
 use kiss3d::context::Context;
 use kiss3d::planar_camera::PlanarCamera;
@@ -26,7 +27,13 @@ use na::{Matrix4, Point2, Point3, Vector3};
 
 struct AppState {
     point_cloud_renderer: PointCloudRenderer,
-    cam: ArducamDepthCamera,
+    capture: CaptureEngine,
+    last_sequence: Option<u64>,
+    intrinsics: Option<Intrinsics>,
+    projector: Option<PointCloudProjector>,
+    points: Vec<[f32; 3]>,
+    outlier_filter: FlyingPixelFilter,
+    mask: ValidityMask,
 }
 
 impl State for AppState {
@@ -44,31 +51,48 @@ impl State for AppState {
     }
 
     fn step(&mut self, window: &mut Window) {
-        let frame = self
-            .cam
-            .request_frame(Some(Duration::from_millis(100)))
-            .unwrap();
-        let depth = frame.get_depth_data();
-
-        self.point_cloud_renderer.clear();
-
-        let pixels = depth
-            .as_slice()
-            .iter()
-            .enumerate()
-            .map(|(i, d)| (i % depth.width() as usize, i / depth.width() as usize, d));
-
-        let fx = depth.width() as f32 / (2.0 * f32::tan(0.5 * std::f32::consts::PI * 64.3 / 180.0)); // 640 / 2 / tan(0.5*64.3)
-        let fy =
-            depth.height() as f32 / (2.0 * f32::tan(0.5 * std::f32::consts::PI * 50.4 / 180.0)); // 480 / 2 / tan(0.5*50.4)
-
-        for (row, column, d) in pixels {
-            let zz = *d;
-            let xx = (((depth.width() / 2) as f32 - column as f32) / fx) * zz;
-            let yy = (((depth.height() / 2) as f32 - row as f32) / fy) * zz;
-
-            self.point_cloud_renderer
-                .push(Point3::new(xx, yy, zz), Point3::new(1.0, 1.0, 1.0));
+        // Keep showing the previous cloud until the capture thread has a new frame
+        if let Some(frame) = self
+            .capture
+            .latest()
+            .filter(|frame| Some(frame.sequence()) != self.last_sequence)
+        {
+            self.last_sequence = Some(frame.sequence());
+            let depth = frame.get_depth_data();
+
+            // The ray table only needs rebuilding if the frame size changes
+            let size = (depth.width(), depth.height());
+            if self
+                .projector
+                .as_ref()
+                .map(|projector| (projector.width(), projector.height()))
+                != Some(size)
+            {
+                self.projector = Some(build_projector(self.intrinsics.as_ref(), size.0, size.1));
+                self.points.resize(depth.as_slice().len(), [0.0; 3]);
+            }
+
+            self.projector
+                .as_ref()
+                .unwrap()
+                .project(&depth, &mut self.points)
+                .unwrap();
+
+            // Leave out the fringe of flying pixels around objects and weak measurements
+            self.outlier_filter
+                .apply(&depth, &frame.get_confidence_data(), &mut self.mask)
+                .unwrap();
+
+            self.point_cloud_renderer.clear();
+            let valid_points = self
+                .points
+                .iter()
+                .enumerate()
+                .filter(|&(i, _)| self.mask.is_valid(i));
+            for (_, &[x, y, z]) in valid_points {
+                self.point_cloud_renderer
+                    .push(Point3::new(x, y, z), Point3::new(1.0, 1.0, 1.0));
+            }
         }
 
         let num_points_text = format!(
@@ -86,6 +110,11 @@ impl State for AppState {
 }
 
 fn main() {
+    // Optionally load a calibration, without which straight edges look bowed
+    let intrinsics = std::env::args()
+        .nth(1)
+        .map(|path| Intrinsics::load(path).unwrap());
+
     let mut cam = arducam_tof::ArducamDepthCamera::new().unwrap();
     cam.open(arducam_tof::Connection::CSI, 0).unwrap();
     cam.start(arducam_tof::FrameType::DepthFrame).unwrap();
@@ -93,12 +122,31 @@ fn main() {
     let window = Window::new("Kiss3d: persistent_point_cloud");
     let app = AppState {
         point_cloud_renderer: PointCloudRenderer::new(4.0),
-        cam,
+        capture: CaptureEngine::spawn(cam, 3),
+        last_sequence: None,
+        intrinsics,
+        projector: None,
+        points: Vec::new(),
+        outlier_filter: FlyingPixelFilter::new(),
+        mask: ValidityMask::default(),
     };
 
     window.render_loop(app)
 }
 
+/// A projector for `width`x`height` frames, from the calibration if there is one or else from
+/// the nominal field of view
+fn build_projector(
+    intrinsics: Option<&Intrinsics>,
+    width: u16,
+    height: u16,
+) -> PointCloudProjector {
+    match intrinsics {
+        Some(intrinsics) => PointCloudProjector::from_intrinsics(width, height, intrinsics),
+        None => PointCloudProjector::from_fov(width, height, HORIZONTAL_FOV, VERTICAL_FOV),
+    }
+}
+
 /// Structure which manages the display of long-living points.
 struct PointCloudRenderer {
     shader: Effect,
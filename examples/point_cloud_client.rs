@@ -1,83 +1,164 @@
+use std::net::TcpStream;
+use std::sync::mpsc::TryRecvError;
 use std::time::Duration;
 
-use bincode::Options;
-use serde::Serialize;
+use arducam_tof::binning::{BinFactor, BinMode, BinnedFrame};
+use arducam_tof::mailbox::{mailbox, MailboxSender};
+use arducam_tof::mask::ThresholdFilter;
+use arducam_tof::wire::FrameEncoder;
+use arducam_tof::{ArducamDepthCamera, FramePool, FrameType, OwnedFrame, ValidityMask};
 
-#[derive(Serialize)]
-struct MyPoint {
-    x: f32,
-    y: f32,
-    z: f32,
-    confidence: f32,
-}
+/// Frames that can be held at once: one being copied out, one kept for reuse by the capture
+/// thread, one waiting in the mailbox, one recycled by the main thread and one being sent
+const POOL_SIZE: usize = 5;
+
+/// Pixels below this confidence are too noisy to be worth sending
+const MIN_CONFIDENCE: f32 = 30.0;
 
 fn main() {
-    let mut cam = arducam_tof::ArducamDepthCamera::new().unwrap();
+    let mut cam = ArducamDepthCamera::new().unwrap();
     cam.open(arducam_tof::Connection::CSI, 0).unwrap();
-    cam.start(arducam_tof::FrameType::DepthFrame).unwrap();
+    cam.start(FrameType::DepthFrame).unwrap();
 
     let addr = std::env::args().nth(1).unwrap();
+    // Optionally send frames binned 2x2 or 4x4, for when full resolution isn't needed
+    let bin_factor = std::env::args()
+        .nth(2)
+        .map(|size| BinFactor::from_size(size.parse().unwrap()).expect("Bin size must be 2 or 4"));
 
-    let stream = std::net::TcpStream::connect((addr, 8080)).unwrap();
-
-    opencv::highgui::named_window("depth", opencv::highgui::WINDOW_NORMAL).unwrap();
-
-    let mut points = Vec::new();
-
-    let options = bincode::DefaultOptions::new().allow_trailing_bytes();
-
-    let mut stream = bincode::Serializer::new(stream, options);
-    loop {
-        let frame = cam.request_frame(Some(Duration::from_millis(200))).unwrap();
+    let mut stream = TcpStream::connect((addr, 8080)).unwrap();
 
-        let depth = frame.get_depth_data();
+    // With the metrics feature, serve the capture counters for Prometheus to scrape
+    #[cfg(feature = "metrics")]
+    let _metrics = arducam_tof::metrics::MetricsServer::serve_tcp("127.0.0.1:9464").unwrap();
 
-        let confidence = frame.get_confidence_data();
+    // Capture on its own thread so a stalled connection drops frames instead of stalling the
+    // sensor, and the newest frame is always the next one sent
+    let (frame_sender, frames) = mailbox();
+    std::thread::spawn(move || capture_thread(cam, frame_sender));
 
-        assert!(depth.width() == confidence.width());
-        assert!(depth.height() == confidence.height());
-
-        let pixels = depth
-            .as_slice()
-            .iter()
-            .enumerate()
-            .zip(confidence.as_slice())
-            .map(|((i, d), c)| (i % depth.width() as usize, i / depth.width() as usize, d, c));
+    opencv::highgui::named_window("depth", opencv::highgui::WINDOW_NORMAL).unwrap();
 
-        let fx = depth.width() as f32 / (2.0 * f32::tan(0.5 * std::f32::consts::PI * 64.3 / 180.0)); // 640 / 2 / tan(0.5*64.3)
-        let fy =
-            depth.height() as f32 / (2.0 * f32::tan(0.5 * std::f32::consts::PI * 50.4 / 180.0)); // 480 / 2 / tan(0.5*50.4)
+    // The server reprojects the depth itself, so only the quantised planes are sent, and only
+    // for the pixels that pass the thresholds
+    let mut encoder = FrameEncoder::new();
+    let thresholds = ThresholdFilter::new().with_min_confidence(MIN_CONFIDENCE);
+    let mut mask = ValidityMask::default();
+    let mut binned = BinnedFrame::new();
 
-        points.clear();
+    loop {
+        let frame = match frames.try_recv() {
+            Ok(frame) => Some(frame),
+            Err(TryRecvError::Empty) => None,
+            Err(TryRecvError::Disconnected) => break,
+        };
+
+        if let Some(frame) = frame {
+            match bin_factor {
+                Some(factor) => {
+                    frame
+                        .get_depth_data()
+                        .bin_into(
+                            &frame.get_confidence_data(),
+                            factor,
+                            BinMode::WeightedMean,
+                            &mut binned,
+                        )
+                        .unwrap();
+                    thresholds
+                        .apply(&binned.depth(), &binned.confidence(), &mut mask)
+                        .unwrap();
+                    encoder
+                        .write_frame_binned(&mut stream, &frame.format(), &binned, Some(&mask))
+                        .unwrap();
+                }
+                None => {
+                    thresholds
+                        .apply(
+                            &frame.get_depth_data(),
+                            &frame.get_confidence_data(),
+                            &mut mask,
+                        )
+                        .unwrap();
+                    encoder
+                        .write_frame_masked(
+                            &mut stream,
+                            &frame.format(),
+                            &frame.get_depth_data(),
+                            &frame.get_confidence_data(),
+                            &mask,
+                        )
+                        .unwrap();
+                }
+            }
+            show(&frame);
+            frames.recycle(frame);
+        }
 
-        for (row, column, d, c) in pixels {
-            let z = *d;
-            let x = (((depth.width() / 2) as f32 - column as f32) / fx) * z;
-            let y = (((depth.height() / 2) as f32 - row as f32) / fy) * z;
+        let key = opencv::highgui::wait_key(10).unwrap();
 
-            points.push(MyPoint {
-                x,
-                y,
-                z,
-                confidence: *c,
-            });
+        if key == b'q' as i32 {
+            break;
         }
+        // With the instrument feature, l prints where the time goes
+        #[cfg(feature = "instrument")]
+        if key == b'l' as i32 {
+            print_latencies();
+        }
+    }
+}
+
+#[cfg(feature = "instrument")]
+fn print_latencies() {
+    for (stage, latency) in arducam_tof::instrument::snapshot().iter() {
+        println!(
+            "{:>14}: p50 {:>9.2?} p99 {:>9.2?} p99.9 {:>9.2?} max {:>9.2?} ({} samples)",
+            stage.name(),
+            latency.p50,
+            latency.p99,
+            latency.p999,
+            latency.max,
+            latency.count
+        );
+    }
+}
 
-        points.serialize(&mut stream).unwrap();
+fn show(frame: &OwnedFrame) {
+    let depth = frame.get_depth_data();
 
-        let depth_mat = opencv::core::Mat::new_rows_cols_with_data(
-            depth.height() as i32,
-            depth.width() as i32,
-            depth.as_slice(),
-        )
-        .unwrap();
+    let depth_mat = opencv::core::Mat::new_rows_cols_with_data(
+        depth.height() as i32,
+        depth.width() as i32,
+        depth.as_slice(),
+    )
+    .unwrap();
 
-        opencv::highgui::imshow("depth", &depth_mat).unwrap();
+    opencv::highgui::imshow("depth", &depth_mat).unwrap();
+}
 
-        let key = opencv::highgui::wait_key(10).unwrap();
+fn capture_thread(mut cam: ArducamDepthCamera, frames: MailboxSender<OwnedFrame>) {
+    let mut pool = None;
+    let mut spare = None;
 
-        if key == b'q' as i32 {
-            break;
+    loop {
+        let frame = cam.request_frame(Some(Duration::from_millis(200))).unwrap();
+        let format = frame.get_format(FrameType::DepthFrame);
+        let pool =
+            pool.get_or_insert_with(|| FramePool::new(POOL_SIZE, format.width, format.height));
+        let owned = frame.into_owned(pool).unwrap();
+
+        // Reuse the allocation of a frame that came back rather than boxing every frame
+        let boxed = match spare.take().or_else(|| frames.recycled()) {
+            Some(mut boxed) => {
+                *boxed = owned;
+                boxed
+            }
+            None => Box::new(owned),
+        };
+
+        match frames.send(boxed) {
+            Ok(replaced) => spare = replaced,
+            Err(_) => return,
         }
     }
 }
@@ -5,7 +5,11 @@ use std::io::{BufRead, BufReader, Write};
 use std::ops::RangeInclusive;
 use std::sync::mpsc::{Receiver, Sender, TryRecvError};
 
-use bincode::{DefaultOptions, Options};
+use arducam_tof::mailbox::{mailbox, MailboxReceiver, MailboxSender};
+use arducam_tof::mask::ThresholdFilter;
+use arducam_tof::projection::{HORIZONTAL_FOV, VERTICAL_FOV};
+use arducam_tof::wire::{DecodedFrame, FrameDecoder};
+use arducam_tof::{DensePoints, Intrinsics, PointCloudProjector};
 use kiss3d::camera::Camera;
 use kiss3d::context::Context;
 use kiss3d::planar_camera::PlanarCamera;
@@ -17,7 +21,6 @@ use kiss3d::resource::{
 use kiss3d::text::Font;
 use kiss3d::window::{State, Window};
 use na::{Matrix4, Point2, Point3};
-use serde::Deserialize;
 
 // Custom renderers are used to allow rendering objects that are not necessarily
 // represented as meshes. In this example, we will render a large, growing, point cloud
@@ -27,17 +30,13 @@ use serde::Deserialize;
 // handled by the `State` trait instead of a `while window.render()`
 // like other examples.
 
-#[derive(Deserialize)]
-struct MyPoint {
-    x: f32,
-    y: f32,
-    z: f32,
-    confidence: f32,
-}
-
 struct AppState {
     point_cloud_renderer: PointCloudRenderer,
-    point_receiver: Receiver<Vec<MyPoint>>,
+    frames: MailboxReceiver<DecodedFrame>,
+    frame: Option<Box<DecodedFrame>>,
+    intrinsics: Option<Intrinsics>,
+    projector: Option<PointCloudProjector>,
+    points: DensePoints,
     command_receiver: Receiver<Command>,
     max_depth: Option<f32>,
     min_depth: Option<f32>,
@@ -59,47 +58,85 @@ impl State for AppState {
     }
 
     fn step(&mut self, window: &mut Window) {
-        match self.command_receiver.try_recv() {
-            Ok(Command::SetMaxDepth(max_depth)) => self.max_depth = max_depth,
-            Ok(Command::SetMinDepth(min_depth)) => self.min_depth = min_depth,
-            Ok(Command::SetConfidenceRange(confidence_range)) => {
-                self.confidence_range = confidence_range
+        loop {
+            match self.command_receiver.try_recv() {
+                Ok(Command::SetMaxDepth(max_depth)) => self.max_depth = max_depth,
+                Ok(Command::SetMinDepth(min_depth)) => self.min_depth = min_depth,
+                Ok(Command::SetConfidenceRange(confidence_range)) => {
+                    self.confidence_range = confidence_range
+                }
+                Err(TryRecvError::Empty) => break,
+                Err(TryRecvError::Disconnected) => std::process::exit(2),
             }
-            Err(TryRecvError::Empty) => (),
-            Err(TryRecvError::Disconnected) => std::process::exit(2),
         }
 
-        match self.point_receiver.try_recv() {
-            Ok(points) => {
-                self.point_cloud_renderer.clear();
-                for point in points {
-                    if self.max_depth.is_some_and(|max_depth| point.z > max_depth)
-                        || self.min_depth.is_some_and(|min_depth| point.z < min_depth)
-                    {
-                        continue;
-                    }
+        match self.frames.try_recv() {
+            Ok(frame) => {
+                // Hand the previous frame back to the TCP thread to decode into
+                if let Some(previous) = self.frame.replace(frame) {
+                    self.frames.recycle(previous);
+                }
+                let frame = self.frame.as_ref().unwrap();
+                let depth = frame.get_depth_data();
+                let confidence = frame.get_confidence_data();
+
+                // The ray table only needs rebuilding if the frame size changes. Binned frames
+                // need the rays through the centres of the bins of the full frame.
+                let size = (depth.width(), depth.height());
+                if self
+                    .projector
+                    .as_ref()
+                    .map(|projector| (projector.width(), projector.height()))
+                    != Some(size)
+                {
+                    let intrinsics = self.intrinsics.as_ref();
+                    self.projector = Some(match frame.header().bin_factor {
+                        Some(factor) => build_projector(
+                            intrinsics,
+                            size.0 * factor.size(),
+                            size.1 * factor.size(),
+                        )
+                        .binned(factor),
+                        None => build_projector(intrinsics, size.0, size.1),
+                    });
+                }
 
+                // Only project the points within the depth limits
+                let thresholds = ThresholdFilter::new().with_depth_range(
+                    self.min_depth.unwrap_or(0.0),
+                    self.max_depth.unwrap_or(f32::INFINITY),
+                );
+                self.projector
+                    .as_ref()
+                    .unwrap()
+                    .project_dense(&depth, &confidence, &thresholds, &mut self.points)
+                    .unwrap();
+
+                self.point_cloud_renderer.clear();
+                let points = &self.points;
+                let coordinates = points.x().iter().zip(points.y()).zip(points.z());
+                for (((&x, &y), &z), &confidence) in coordinates.zip(points.confidence()) {
                     let colour = match &self.confidence_range {
                         Some(range) => {
                             let low = *range.start();
                             let high = *range.end();
 
                             if low < high {
-                                if point.confidence < low {
+                                if confidence < low {
                                     Point3::new(1.0, 0.0, 0.0)
-                                } else if point.confidence > high {
+                                } else if confidence > high {
                                     Point3::new(0.0, 1.0, 0.0)
                                 } else {
-                                    let confidence = (point.confidence - low) / (high - low);
+                                    let confidence = (confidence - low) / (high - low);
                                     Point3::new(1.0 - confidence, confidence, 0.0)
                                 }
                             } else {
-                                if point.confidence > low {
+                                if confidence > low {
                                     Point3::new(1.0, 0.0, 0.0)
-                                } else if point.confidence < high {
+                                } else if confidence < high {
                                     Point3::new(0.0, 1.0, 0.0)
                                 } else {
-                                    let confidence = (point.confidence - low) / (high - low);
+                                    let confidence = (confidence - low) / (high - low);
                                     Point3::new(1.0 - confidence, confidence, 0.0)
                                 }
                             }
@@ -107,8 +144,7 @@ impl State for AppState {
                         None => Point3::new(1.0, 1.0, 1.0),
                     };
 
-                    self.point_cloud_renderer
-                        .push(Point3::new(point.x, point.y, point.z), colour);
+                    self.point_cloud_renderer.push(Point3::new(x, y, z), colour);
                 }
             }
             Err(TryRecvError::Empty) => (),
@@ -116,8 +152,9 @@ impl State for AppState {
         }
 
         let num_points_text = format!(
-            "Number of points: {}",
-            self.point_cloud_renderer.num_points()
+            "Number of points: {}, frames dropped: {}",
+            self.point_cloud_renderer.num_points(),
+            self.frames.stats().dropped
         );
         window.draw_text(
             &num_points_text,
@@ -130,9 +167,14 @@ impl State for AppState {
 }
 
 fn main() {
-    let (point_sender, point_receiver) = std::sync::mpsc::channel::<Vec<MyPoint>>();
+    // Optionally load a calibration of the client's camera at full resolution, without which
+    // straight edges look bowed
+    let intrinsics = std::env::args()
+        .nth(1)
+        .map(|path| Intrinsics::load(path).unwrap());
 
-    std::thread::spawn(move || tcp_thread(point_sender));
+    let (frame_sender, frames) = mailbox();
+    std::thread::spawn(move || tcp_thread(frame_sender));
 
     let (command_sender, command_receiver) = std::sync::mpsc::channel::<Command>();
 
@@ -141,7 +183,11 @@ fn main() {
     let window = Window::new("Kiss3d: persistent_point_cloud");
     let app = AppState {
         point_cloud_renderer: PointCloudRenderer::new(4.0),
-        point_receiver,
+        frames,
+        frame: None,
+        intrinsics,
+        projector: None,
+        points: DensePoints::new(),
         command_receiver,
         max_depth: None,
         min_depth: None,
@@ -151,6 +197,19 @@ fn main() {
     window.render_loop(app)
 }
 
+/// A projector for `width`x`height` frames, from the calibration if there is one or else from
+/// the nominal field of view
+fn build_projector(
+    intrinsics: Option<&Intrinsics>,
+    width: u16,
+    height: u16,
+) -> PointCloudProjector {
+    match intrinsics {
+        Some(intrinsics) => PointCloudProjector::from_intrinsics(width, height, intrinsics),
+        None => PointCloudProjector::from_fov(width, height, HORIZONTAL_FOV, VERTICAL_FOV),
+    }
+}
+
 /// Structure which manages the display of long-living points.
 struct PointCloudRenderer {
     shader: Effect,
@@ -246,19 +305,25 @@ const FRAGMENT_SHADER_SRC: &str = "#version 100
         gl_FragColor = vec4(Color, 1.0);
     }";
 
-fn tcp_thread(sender: Sender<Vec<MyPoint>>) {
+fn tcp_thread(frames: MailboxSender<DecodedFrame>) {
     let listener = std::net::TcpListener::bind("0.0.0.0:8080").unwrap();
-    let stream = listener.accept().unwrap().0;
+    let mut stream = listener.accept().unwrap().0;
 
-    let mut stream = bincode::de::Deserializer::with_reader(
-        stream,
-        DefaultOptions::new().allow_trailing_bytes(),
-    );
+    let mut decoder = FrameDecoder::new();
+    let mut frame = Box::new(DecodedFrame::new());
 
     loop {
-        sender
-            .send(Vec::<MyPoint>::deserialize(&mut stream).unwrap())
-            .unwrap();
+        decoder.read_frame(&mut stream, &mut frame).unwrap();
+
+        // Decode the next frame into whichever buffer comes back first: the one this frame
+        // replaced if the render thread fell behind, or one the render thread has finished with.
+        // Only the first few frames need a new buffer.
+        let Ok(replaced) = frames.send(frame) else {
+            return;
+        };
+        frame = replaced
+            .or_else(|| frames.recycled())
+            .unwrap_or_else(|| Box::new(DecodedFrame::new()));
     }
 }
 
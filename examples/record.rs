@@ -0,0 +1,28 @@
+use std::time::Duration;
+
+use arducam_tof::recording::Recorder;
+
+/// Record frames from the camera to a file, for replaying with
+/// [ReplayBackend](arducam_tof::recording::ReplayBackend).
+///
+/// Usage: record <PATH> [FRAMES]
+fn main() {
+    let path = std::env::args().nth(1).unwrap();
+    let frames = std::env::args()
+        .nth(2)
+        .map_or(300, |frames| frames.parse::<usize>().unwrap());
+
+    let mut cam = arducam_tof::ArducamDepthCamera::new().unwrap();
+    cam.open(arducam_tof::Connection::CSI, 0).unwrap();
+    cam.start(arducam_tof::FrameType::DepthFrame).unwrap();
+
+    let mut recorder = Recorder::create(&path).unwrap();
+
+    while recorder.frame_count() < frames {
+        let frame = cam.request_frame(Some(Duration::from_millis(200))).unwrap();
+        recorder.record(&frame).unwrap();
+    }
+
+    recorder.finish().unwrap();
+    println!("Recorded {frames} frames to {path}");
+}
@@ -0,0 +1,64 @@
+use std::time::Duration;
+
+use arducam_tof::shm::{ShmError, ShmPublisher, ShmSubscriber};
+use arducam_tof::{FrameData, FrameType};
+
+/// The name of the frame ring the two halves of this example share
+const RING_NAME: &str = "/arducam_tof_frames";
+/// Frames a subscriber can fall behind by before its frame is reused
+const RING_SLOTS: usize = 4;
+
+/// Share frames from the camera with any number of processes on this host.
+///
+/// Usage: shm publish, then in as many other terminals as you like: shm subscribe
+fn main() {
+    match std::env::args().nth(1).as_deref() {
+        Some("publish") => publish(),
+        Some("subscribe") => subscribe(),
+        _ => eprintln!("Usage: shm publish|subscribe"),
+    }
+}
+
+fn publish() {
+    let mut cam = arducam_tof::ArducamDepthCamera::new().unwrap();
+    cam.open(arducam_tof::Connection::CSI, 0).unwrap();
+    cam.start(FrameType::DepthFrame).unwrap();
+
+    let mut publisher = None;
+    loop {
+        let frame = cam.request_frame(Some(Duration::from_millis(200))).unwrap();
+        let format = frame.get_format(FrameType::DepthFrame);
+        let publisher = publisher.get_or_insert_with(|| {
+            ShmPublisher::create(RING_NAME, format.width, format.height, RING_SLOTS).unwrap()
+        });
+        publisher.publish_frame(&frame).unwrap();
+    }
+}
+
+fn subscribe() {
+    let mut subscriber = ShmSubscriber::open(RING_NAME).unwrap();
+    let (width, height) = (subscriber.width(), subscriber.height());
+    let mut buffer = vec![0.0; width as usize * height as usize];
+
+    loop {
+        let frame = match subscriber.wait_next(Some(Duration::from_secs(1))) {
+            Ok(frame) => frame,
+            Err(ShmError::Timeout) => continue,
+            Err(ShmError::Closed) => break,
+            Err(error) => panic!("{error}"),
+        };
+
+        frame.copy_depth_into(&mut buffer);
+        let depth = FrameData::new(width, height, &buffer);
+        let centre = depth.get(width / 2, height / 2).unwrap();
+        // Only trust what was read if the publisher didn't reuse the slot meanwhile
+        if frame.is_intact() {
+            println!("Frame {}: {centre:.3} m at the centre", frame.sequence());
+        }
+    }
+
+    println!(
+        "Publisher closed, missed {} frames",
+        subscriber.missed_frames()
+    );
+}
@@ -0,0 +1,66 @@
+//! Fixed-size heap buffers aligned to a cache line, for per-pixel state kept between frames.
+
+use std::{
+    alloc::Layout,
+    ops::{Deref, DerefMut},
+    ptr::NonNull,
+};
+
+use crate::pool::BUFFER_ALIGN;
+
+/// A heap-allocated slice of `len` values starting on a [BUFFER_ALIGN] boundary
+pub(crate) struct AlignedBuffer<T: Copy> {
+    ptr: NonNull<T>,
+    len: usize,
+}
+
+// The buffer is uniquely owned, like a Box<[T]>
+unsafe impl<T: Copy + Send> Send for AlignedBuffer<T> {}
+unsafe impl<T: Copy + Sync> Sync for AlignedBuffer<T> {}
+
+impl<T: Copy> AlignedBuffer<T> {
+    /// Allocate `len` copies of `value`
+    pub fn new(len: usize, value: T) -> Self {
+        let layout = Self::layout(len);
+        let ptr = if layout.size() == 0 {
+            NonNull::dangling()
+        } else {
+            let ptr = unsafe { std::alloc::alloc(layout) } as *mut T;
+            NonNull::new(ptr).unwrap_or_else(|| std::alloc::handle_alloc_error(layout))
+        };
+
+        for i in 0..len {
+            unsafe { ptr.as_ptr().add(i).write(value) };
+        }
+        Self { ptr, len }
+    }
+
+    fn layout(len: usize) -> Layout {
+        Layout::array::<T>(len)
+            .and_then(|layout| layout.align_to(BUFFER_ALIGN))
+            .expect("Aligned buffer too large")
+    }
+}
+
+impl<T: Copy> Deref for AlignedBuffer<T> {
+    type Target = [T];
+
+    fn deref(&self) -> &[T] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl<T: Copy> DerefMut for AlignedBuffer<T> {
+    fn deref_mut(&mut self) -> &mut [T] {
+        unsafe { std::slice::from_raw_parts_mut(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl<T: Copy> Drop for AlignedBuffer<T> {
+    fn drop(&mut self) {
+        let layout = Self::layout(self.len);
+        if layout.size() != 0 {
+            unsafe { std::alloc::dealloc(self.ptr.as_ptr() as *mut u8, layout) };
+        }
+    }
+}
@@ -0,0 +1,411 @@
+//! Capturing from several cameras at once and matching their frames up by timestamp.
+//!
+//! [CameraArray] gives every device its own capture thread, optionally pinned to a CPU core so
+//! the threads don't contend with each other or with the consumer. Each thread copies its
+//! frames into a per-device [FramePool] and queues them; [CameraArray::next_set] then groups
+//! queued frames whose timestamps lie within a tolerance of each other into a [FrameSet],
+//! discarding frames that can no longer be matched.
+
+use std::{
+    collections::VecDeque,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc, Condvar, Mutex, MutexGuard,
+    },
+    thread::JoinHandle,
+    time::{Duration, Instant},
+};
+
+use thiserror::Error;
+
+use crate::{
+    backend::CameraBackend, ArducamDepthCamera, Connection, FramePool, FrameType, InitError,
+    OpenError, OwnedFrame, OwnedFrameError, SdkBackend, StartError,
+};
+
+/// How long each capture thread waits on its camera before checking whether it should stop
+const POLL_TIMEOUT: Duration = Duration::from_millis(200);
+
+#[derive(Debug, Error)]
+pub enum CameraArrayError {
+    #[error("Failed to init device {0}")]
+    Init(usize, #[source] InitError),
+    #[error("Failed to open device {0}: {1}")]
+    Open(usize, #[source] OpenError),
+    #[error("Failed to start device {0}: {1}")]
+    Start(usize, #[source] StartError),
+}
+
+/// One device of a [CameraArray]
+#[derive(Debug, Clone, Copy)]
+pub struct DeviceConfig {
+    pub connection: Connection,
+    /// The index passed to [ArducamDepthCamera::open]
+    pub index: i32,
+    /// The CPU core to pin the device's capture thread to, or `None` to leave it to the
+    /// scheduler. Pinning is only supported on Linux.
+    pub core: Option<usize>,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct ArrayOptions {
+    /// The largest difference between the timestamps of the frames in one [FrameSet], in the
+    /// units of [ArducamFrameFormat::timestamp](crate::ArducamFrameFormat::timestamp)
+    pub tolerance: u64,
+    /// Frames queued per device while waiting to be matched. Beyond this the oldest is dropped.
+    pub queue_depth: usize,
+    /// The number of [FrameSet]s the consumer will hold at once, used to size the frame pools
+    pub held_sets: usize,
+}
+
+pub struct CameraArray<B: CameraBackend + Send + 'static = SdkBackend> {
+    shared: Arc<Shared>,
+    tolerance: u64,
+    threads: Vec<JoinHandle<ArducamDepthCamera<B>>>,
+}
+
+struct Shared {
+    /// One queue of unmatched frames per device, oldest first
+    queues: Mutex<Vec<VecDeque<QueuedFrame>>>,
+    /// Notified whenever a frame is queued
+    queued: Condvar,
+    stop: AtomicBool,
+    counters: Box<[DeviceCounters]>,
+}
+
+struct QueuedFrame {
+    frame: OwnedFrame,
+    received: Instant,
+}
+
+impl QueuedFrame {
+    fn timestamp(&self) -> u64 {
+        self.frame.format().timestamp
+    }
+}
+
+#[derive(Default)]
+struct DeviceCounters {
+    captured: AtomicU64,
+    dropped: AtomicU64,
+    unmatched: AtomicU64,
+    errors: AtomicU64,
+    matched: AtomicU64,
+    total_latency_ns: AtomicU64,
+    max_latency_ns: AtomicU64,
+    pinned: AtomicBool,
+}
+
+/// Counters for one device of a [CameraArray]
+#[derive(Debug, Clone, Copy)]
+pub struct DeviceStats {
+    /// Frames queued for matching
+    pub captured: u64,
+    /// Frames discarded because the device's queue was full or its frame pool was exhausted
+    pub dropped: u64,
+    /// Frames discarded because no other device had a frame close enough in time to match
+    pub unmatched: u64,
+    /// Failed calls to [ArducamDepthCamera::request_frame], including timeouts
+    pub errors: u64,
+    /// Frames delivered in a [FrameSet]
+    pub matched: u64,
+    /// Mean time from a frame being received to it being delivered in a [FrameSet]
+    pub mean_latency: Duration,
+    /// Longest time from a frame being received to it being delivered in a [FrameSet]
+    pub max_latency: Duration,
+    /// Whether the capture thread was pinned to the requested core
+    pub pinned: bool,
+}
+
+/// Frames from every device of a [CameraArray], captured at about the same time
+pub struct FrameSet {
+    frames: Vec<OwnedFrame>,
+}
+
+impl FrameSet {
+    /// One frame per device, in the order the devices were given
+    pub fn frames(&self) -> &[OwnedFrame] {
+        &self.frames
+    }
+
+    pub fn into_frames(self) -> Vec<OwnedFrame> {
+        self.frames
+    }
+
+    /// The difference between the newest and oldest timestamps in the set
+    pub fn spread(&self) -> u64 {
+        let timestamps = self.frames.iter().map(|frame| frame.format().timestamp);
+        timestamps.clone().max().unwrap_or(0) - timestamps.min().unwrap_or(0)
+    }
+}
+
+impl<B: CameraBackend + Send + 'static> CameraArray<B> {
+    /// Create, open and start every device in `devices` in [FrameType::DepthFrame] mode, and
+    /// start capturing from them.
+    pub fn open(devices: &[DeviceConfig], options: ArrayOptions) -> Result<Self, CameraArrayError> {
+        let mut cameras = Vec::with_capacity(devices.len());
+        for (device, config) in devices.iter().enumerate() {
+            let backend = B::create().map_err(|e| CameraArrayError::Init(device, e))?;
+            let mut camera = ArducamDepthCamera::with_backend(backend);
+            camera
+                .open(config.connection, config.index)
+                .map_err(|e| CameraArrayError::Open(device, e))?;
+            camera
+                .start(FrameType::DepthFrame)
+                .map_err(|e| CameraArrayError::Start(device, e))?;
+            cameras.push((camera, config.core));
+        }
+
+        Ok(Self::from_cameras(cameras, options))
+    }
+
+    /// Start capturing from cameras that are already opened and started in
+    /// [FrameType::DepthFrame] mode, each paired with the core to pin its thread to.
+    pub fn from_cameras(
+        cameras: Vec<(ArducamDepthCamera<B>, Option<usize>)>,
+        options: ArrayOptions,
+    ) -> Self {
+        assert!(!cameras.is_empty(), "Camera array needs at least 1 camera");
+        assert!(
+            options.queue_depth >= 1,
+            "Device queues need at least 1 entry"
+        );
+
+        let shared = Arc::new(Shared {
+            queues: Mutex::new(
+                (0..cameras.len())
+                    .map(|_| VecDeque::with_capacity(options.queue_depth))
+                    .collect(),
+            ),
+            queued: Condvar::new(),
+            stop: AtomicBool::new(false),
+            counters: (0..cameras.len()).map(|_| Default::default()).collect(),
+        });
+
+        // Each buffer is either being copied into, queued, or held by the consumer
+        let pool_size = options.queue_depth + options.held_sets + 1;
+
+        let threads = cameras
+            .into_iter()
+            .enumerate()
+            .map(|(device, (mut camera, core))| {
+                let shared = shared.clone();
+                std::thread::Builder::new()
+                    .name(format!("arducam-array-{device}"))
+                    .spawn(move || {
+                        if let Some(core) = core {
+                            let pinned = pin_to_core(core);
+                            shared.counters[device]
+                                .pinned
+                                .store(pinned, Ordering::Relaxed);
+                        }
+                        capture_loop(&mut camera, device, pool_size, options.queue_depth, &shared);
+                        camera
+                    })
+                    .expect("Failed to spawn capture thread")
+            })
+            .collect();
+
+        Self {
+            shared,
+            tolerance: options.tolerance,
+            threads,
+        }
+    }
+
+    /// The number of devices in the array
+    pub fn device_count(&self) -> usize {
+        self.threads.len()
+    }
+
+    /// Wait for the next set of frames whose timestamps all lie within the tolerance, up to
+    /// `timeout` or forever if `None`. Returns `None` on timeout.
+    pub fn next_set(&self, timeout: Option<Duration>) -> Option<FrameSet> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        let mut queues = self.shared.queues.lock().unwrap();
+
+        loop {
+            if let Some(set) = self.match_set(&mut queues) {
+                return Some(set);
+            }
+
+            queues = match deadline {
+                Some(deadline) => {
+                    let remaining = deadline.checked_duration_since(Instant::now())?;
+                    self.shared
+                        .queued
+                        .wait_timeout(queues, remaining)
+                        .unwrap()
+                        .0
+                }
+                None => self.shared.queued.wait(queues).unwrap(),
+            };
+        }
+    }
+
+    /// Take a matched set from the heads of the queues if there is one, discarding any frames
+    /// too old to be matched with the newest frame at the head of another queue
+    fn match_set(&self, queues: &mut MutexGuard<Vec<VecDeque<QueuedFrame>>>) -> Option<FrameSet> {
+        loop {
+            let mut oldest = u64::MAX;
+            let mut newest = 0;
+            for queue in queues.iter() {
+                let timestamp = queue.front()?.timestamp();
+                oldest = oldest.min(timestamp);
+                newest = newest.max(timestamp);
+            }
+
+            if newest - oldest <= self.tolerance {
+                let frames = queues
+                    .iter_mut()
+                    .zip(self.shared.counters.iter())
+                    .map(|(queue, counters)| {
+                        let queued = queue.pop_front().unwrap();
+                        let latency = queued.received.elapsed().as_nanos() as u64;
+                        counters.matched.fetch_add(1, Ordering::Relaxed);
+                        counters
+                            .total_latency_ns
+                            .fetch_add(latency, Ordering::Relaxed);
+                        counters
+                            .max_latency_ns
+                            .fetch_max(latency, Ordering::Relaxed);
+                        queued.frame
+                    })
+                    .collect();
+                return Some(FrameSet { frames });
+            }
+
+            // Later frames from the other devices are only newer, so these will never match.
+            // Subtracting from the newest can't overflow, unlike adding the tolerance.
+            for (queue, counters) in queues.iter_mut().zip(self.shared.counters.iter()) {
+                if newest - queue.front().unwrap().timestamp() > self.tolerance {
+                    queue.pop_front();
+                    counters.unmatched.fetch_add(1, Ordering::Relaxed);
+                }
+            }
+        }
+    }
+
+    /// Counters for each device, in the order the devices were given
+    pub fn stats(&self) -> Vec<DeviceStats> {
+        self.shared
+            .counters
+            .iter()
+            .map(|counters| {
+                let matched = counters.matched.load(Ordering::Relaxed);
+                let total_latency = counters.total_latency_ns.load(Ordering::Relaxed);
+                DeviceStats {
+                    captured: counters.captured.load(Ordering::Relaxed),
+                    dropped: counters.dropped.load(Ordering::Relaxed),
+                    unmatched: counters.unmatched.load(Ordering::Relaxed),
+                    errors: counters.errors.load(Ordering::Relaxed),
+                    matched,
+                    mean_latency: Duration::from_nanos(
+                        total_latency.checked_div(matched).unwrap_or(0),
+                    ),
+                    max_latency: Duration::from_nanos(
+                        counters.max_latency_ns.load(Ordering::Relaxed),
+                    ),
+                    pinned: counters.pinned.load(Ordering::Relaxed),
+                }
+            })
+            .collect()
+    }
+
+    /// Stop every capture thread and get the cameras back, in the order they were given.
+    pub fn stop(mut self) -> Vec<ArducamDepthCamera<B>> {
+        self.join()
+    }
+
+    fn join(&mut self) -> Vec<ArducamDepthCamera<B>> {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        self.threads
+            .drain(..)
+            .map(|thread| thread.join().expect("Capture thread panicked"))
+            .collect()
+    }
+}
+
+impl<B: CameraBackend + Send + 'static> Drop for CameraArray<B> {
+    fn drop(&mut self) {
+        self.join();
+    }
+}
+
+impl Shared {
+    /// Queue a frame from `device`, dropping its oldest queued frame if its queue is full
+    fn push(&self, device: usize, queued: QueuedFrame, queue_depth: usize) {
+        let counters = &self.counters[device];
+        let mut queues = self.queues.lock().unwrap();
+        let queue = &mut queues[device];
+        let oldest = if queue.len() >= queue_depth {
+            counters.dropped.fetch_add(1, Ordering::Relaxed);
+            queue.pop_front()
+        } else {
+            None
+        };
+        queue.push_back(queued);
+        counters.captured.fetch_add(1, Ordering::Relaxed);
+        drop(queues);
+
+        // Return the dropped frame's buffer to the pool outside the lock
+        drop(oldest);
+        self.queued.notify_one();
+    }
+}
+
+fn capture_loop<B: CameraBackend>(
+    camera: &mut ArducamDepthCamera<B>,
+    device: usize,
+    pool_size: usize,
+    queue_depth: usize,
+    shared: &Shared,
+) {
+    let counters = &shared.counters[device];
+    // Sized from the first frame, as the resolution depends on the sensor
+    let mut pool: Option<FramePool> = None;
+
+    while !shared.stop.load(Ordering::Relaxed) {
+        let frame = match camera.request_frame(Some(POLL_TIMEOUT)) {
+            Ok(frame) => frame,
+            Err(_) => {
+                counters.errors.fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+        };
+        let received = Instant::now();
+
+        let format = frame.get_format(FrameType::DepthFrame);
+        let pool =
+            pool.get_or_insert_with(|| FramePool::new(pool_size, format.width, format.height));
+
+        match frame.into_owned(pool) {
+            Ok(frame) => shared.push(device, QueuedFrame { frame, received }, queue_depth),
+            Err(OwnedFrameError::PoolExhausted) => {
+                counters.dropped.fetch_add(1, Ordering::Relaxed);
+            }
+            Err(_) => {
+                counters.errors.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+}
+
+/// Restrict the calling thread to `core`, returning whether that succeeded
+#[cfg(target_os = "linux")]
+fn pin_to_core(core: usize) -> bool {
+    if core >= libc::CPU_SETSIZE as usize {
+        return false;
+    }
+
+    unsafe {
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(core, &mut set);
+        libc::sched_setaffinity(0, size_of::<libc::cpu_set_t>(), &set) == 0
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin_to_core(_core: usize) -> bool {
+    false
+}
@@ -0,0 +1,187 @@
+use std::{num::NonZero, ptr::NonNull, time::Duration};
+
+use crate::{
+    raw, ArducamFrameFormat, CloseError, Connection, FrameData, FrameType, InitError, OpenError,
+    ReleaseFrameError, RequestFrameError, StartError, StopError,
+};
+
+/// The set of operations [ArducamDepthCamera](crate::ArducamDepthCamera) needs from a camera.
+///
+/// [SdkBackend] talks to real hardware through libArducamDepthCamera2c, while
+/// [SyntheticBackend](crate::synthetic::SyntheticBackend) generates frames in-process so that
+/// everything above the camera can be exercised without a sensor attached.
+pub trait CameraBackend {
+    /// The backend's handle to a frame obtained from [CameraBackend::request_frame].
+    type Frame;
+
+    fn create() -> Result<Self, InitError>
+    where
+        Self: Sized;
+
+    fn open(&mut self, conn: Connection, index: i32) -> Result<(), OpenError>;
+
+    fn close(&mut self) -> Result<(), CloseError>;
+
+    fn start(&mut self, frame_type: FrameType) -> Result<(), StartError>;
+
+    fn stop(&mut self) -> Result<(), StopError>;
+
+    fn request_frame(
+        &mut self,
+        timeout: Option<Duration>,
+    ) -> Result<Self::Frame, RequestFrameError>;
+
+    /// Hand a frame back to the backend. Every frame returned by
+    /// [CameraBackend::request_frame] must be released exactly once.
+    fn release_frame(&self, frame: Self::Frame) -> Result<(), ReleaseFrameError>;
+
+    fn get_format(&self, frame: &Self::Frame, frame_type: FrameType) -> ArducamFrameFormat;
+
+    fn get_depth_data<'a>(&'a self, frame: &'a Self::Frame) -> FrameData<'a, f32>;
+
+    fn get_confidence_data<'a>(&'a self, frame: &'a Self::Frame) -> FrameData<'a, f32>;
+
+    /// The single phase measurement a frame holds when the camera was started in
+    /// [FrameType::RawFrame] mode
+    fn get_raw_data<'a>(&'a self, frame: &'a Self::Frame) -> FrameData<'a, i16>;
+}
+
+/// The libArducamDepthCamera2c backend
+pub struct SdkBackend {
+    inner: NonNull<std::ffi::c_void>,
+}
+
+// The SDK camera handle is not tied to the thread that created it, so it can be handed to a
+// capture thread. Frames are not Send as they must be released through the same handle.
+unsafe impl Send for SdkBackend {}
+
+/// A frame buffer handed out by libArducamDepthCamera2c
+pub struct SdkFrame {
+    inner: NonNull<std::ffi::c_void>,
+}
+
+impl SdkFrame {
+    fn get_plane<T>(
+        &self,
+        data: *mut std::ffi::c_void,
+        format: ArducamFrameFormat,
+    ) -> FrameData<'_, T> {
+        FrameData {
+            width: format.width,
+            height: format.height,
+            data: unsafe {
+                std::slice::from_raw_parts(
+                    data as *mut T,
+                    format.width as usize * format.height as usize,
+                )
+            },
+        }
+    }
+}
+
+impl CameraBackend for SdkBackend {
+    type Frame = SdkFrame;
+
+    fn create() -> Result<Self, InitError> {
+        let inner = unsafe { raw::createArducamDepthCamera() };
+        let inner = NonNull::<std::ffi::c_void>::new(inner).ok_or(InitError)?;
+        Ok(Self { inner })
+    }
+
+    fn open(&mut self, conn: Connection, index: i32) -> Result<(), OpenError> {
+        let status =
+            unsafe { raw::arducamCameraOpen(self.inner.as_ptr(), conn.into(), index as _) };
+        match NonZero::new(status) {
+            Some(error) => Err(OpenError(error)),
+            None => Ok(()),
+        }
+    }
+
+    fn close(&mut self) -> Result<(), CloseError> {
+        let status = unsafe {
+            raw::arducamCameraClose(todo!(
+                "blocked by https://github.com/ArduCAM/Arducam_tof_camera/issues/78"
+            ))
+        };
+        match NonZero::new(status) {
+            Some(error) => Err(CloseError(error)),
+            None => Ok(()),
+        }
+    }
+
+    fn start(&mut self, frame_type: FrameType) -> Result<(), StartError> {
+        let status = unsafe { raw::arducamCameraStart(self.inner.as_ptr(), frame_type.into()) };
+        match NonZero::new(status) {
+            Some(error) => Err(StartError(error)),
+            None => Ok(()),
+        }
+    }
+
+    fn stop(&mut self) -> Result<(), StopError> {
+        let status = unsafe { raw::arducamCameraStop(self.inner.as_ptr()) };
+        match NonZero::new(status) {
+            Some(error) => Err(StopError(error)),
+            None => Ok(()),
+        }
+    }
+
+    fn request_frame(&mut self, timeout: Option<Duration>) -> Result<SdkFrame, RequestFrameError> {
+        let timeout = match timeout {
+            Some(timeout) => timeout.as_millis() as std::ffi::c_int,
+            None => -1,
+        };
+        let inner = unsafe { raw::arducamCameraRequestFrame(self.inner.as_ptr(), timeout) };
+        let inner = NonNull::<std::ffi::c_void>::new(inner).ok_or(RequestFrameError)?;
+        Ok(SdkFrame { inner })
+    }
+
+    fn release_frame(&self, frame: SdkFrame) -> Result<(), ReleaseFrameError> {
+        let status =
+            unsafe { raw::arducamCameraReleaseFrame(self.inner.as_ptr(), frame.inner.as_ptr()) };
+        match NonZero::new(status) {
+            Some(error) => Err(ReleaseFrameError(error)),
+            None => Ok(()),
+        }
+    }
+
+    fn get_format(&self, frame: &SdkFrame, frame_type: FrameType) -> ArducamFrameFormat {
+        let format =
+            unsafe { raw::arducamCameraGetFormat(frame.inner.as_ptr(), frame_type.into()) };
+        ArducamFrameFormat {
+            width: format.width,
+            height: format.height,
+            frame_type: format.type_.try_into().unwrap(),
+            timestamp: format.timestamp,
+        }
+    }
+
+    fn get_depth_data<'a>(&'a self, frame: &'a SdkFrame) -> FrameData<'a, f32> {
+        let data = unsafe { raw::arducamCameraGetDepthData(frame.inner.as_ptr()) };
+
+        if data.is_null() {
+            panic!("Got null pointer from arducamCameraGetDepthData");
+        }
+
+        frame.get_plane(data, self.get_format(frame, FrameType::DepthFrame))
+    }
+
+    fn get_confidence_data<'a>(&'a self, frame: &'a SdkFrame) -> FrameData<'a, f32> {
+        let data = unsafe { raw::arducamCameraGetAmplitudeData(frame.inner.as_ptr()) }; // 0.1.3 called confidence amplitude
+
+        if data.is_null() {
+            panic!("Got null pointer from arducamCameraGetAmplitudeData");
+        }
+
+        frame.get_plane(data, self.get_format(frame, FrameType::ConfidenceFrame))
+    }
+
+    fn get_raw_data<'a>(&'a self, frame: &'a SdkFrame) -> FrameData<'a, i16> {
+        let data = unsafe { raw::arducamCameraGetRawData(frame.inner.as_ptr()) };
+
+        if data.is_null() {
+            panic!("Got null pointer from arducamCameraGetRawData");
+        }
+
+        frame.get_plane(data, self.get_format(frame, FrameType::RawFrame))
+    }
+}
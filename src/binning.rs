@@ -0,0 +1,186 @@
+//! Reducing frames to a lower resolution by combining square bins of pixels.
+//!
+//! When full resolution is not needed, e.g. for long-range obstacle detection, binning a frame
+//! with [FrameData::bin] before anything else cuts the work of every later stage and the bytes
+//! sent by [FrameEncoder::encode_binned](crate::wire::FrameEncoder::encode_binned) by 4x or 16x.
+//! [PointCloudProjector::binned](crate::PointCloudProjector::binned) builds the matching ray
+//! table.
+
+use crate::{projection::FrameSizeMismatch, FrameData};
+
+/// Number of pixels along each side of a bin
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BinFactor {
+    /// 2x2 pixels per bin
+    Two,
+    /// 4x4 pixels per bin
+    Four,
+}
+
+impl BinFactor {
+    /// The number of pixels along each side of a bin
+    pub fn size(self) -> u16 {
+        match self {
+            BinFactor::Two => 2,
+            BinFactor::Four => 4,
+        }
+    }
+
+    /// The factor with `size` pixels along each side of a bin, if there is one
+    pub fn from_size(size: u16) -> Option<Self> {
+        match size {
+            2 => Some(BinFactor::Two),
+            4 => Some(BinFactor::Four),
+            _ => None,
+        }
+    }
+}
+
+/// How the depths of the valid pixels in a bin are combined
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BinMode {
+    /// The nearest depth, so no obstacle is reported farther away than it is
+    Min,
+    /// The median depth, ignoring outliers such as flying pixels
+    Median,
+    /// The mean depth weighted by confidence, the least noisy on flat surfaces
+    WeightedMean,
+}
+
+/// A frame reduced by [FrameData::bin], owning its depth and confidence planes
+#[derive(Debug, Clone, Default)]
+pub struct BinnedFrame {
+    width: u16,
+    height: u16,
+    factor: Option<BinFactor>,
+    depth: Vec<f32>,
+    confidence: Vec<f32>,
+}
+
+impl BinnedFrame {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    /// The factor the frame was binned by
+    pub fn factor(&self) -> BinFactor {
+        self.factor.expect("No frame binned yet")
+    }
+
+    pub fn depth(&self) -> FrameData<'_, f32> {
+        FrameData::new(self.width, self.height, &self.depth)
+    }
+
+    pub fn confidence(&self) -> FrameData<'_, f32> {
+        FrameData::new(self.width, self.height, &self.confidence)
+    }
+}
+
+impl FrameData<'_, f32> {
+    /// Combine each `factor`x`factor` bin of pixels of this depth frame into one pixel of a new
+    /// frame, along with the matching `confidence` frame.
+    ///
+    /// Only pixels with a valid depth count towards a bin, and the binned confidence is their
+    /// mean confidence. Bins with no valid pixels get a depth and confidence of 0. Rows and
+    /// columns left over when the frame size is not a multiple of `factor` are dropped.
+    pub fn bin(
+        &self,
+        confidence: &FrameData<f32>,
+        factor: BinFactor,
+        mode: BinMode,
+    ) -> Result<BinnedFrame, FrameSizeMismatch> {
+        let mut out = BinnedFrame::new();
+        self.bin_into(confidence, factor, mode, &mut out)?;
+        Ok(out)
+    }
+
+    /// Like [FrameData::bin], reusing the buffers of `out`. This only allocates when growing
+    /// beyond the largest size so far.
+    pub fn bin_into(
+        &self,
+        confidence: &FrameData<f32>,
+        factor: BinFactor,
+        mode: BinMode,
+        out: &mut BinnedFrame,
+    ) -> Result<(), FrameSizeMismatch> {
+        if confidence.width() != self.width() || confidence.height() != self.height() {
+            return Err(FrameSizeMismatch {
+                width: confidence.width(),
+                height: confidence.height(),
+                expected_width: self.width(),
+                expected_height: self.height(),
+            });
+        }
+
+        let size = factor.size() as usize;
+        out.width = self.width() / factor.size();
+        out.height = self.height() / factor.size();
+        out.factor = Some(factor);
+        let (width, height) = (out.width as usize, out.height as usize);
+        out.depth.resize(width * height, 0.0);
+        out.confidence.resize(width * height, 0.0);
+
+        let input_width = self.width() as usize;
+        let (depth, confidence) = (self.as_slice(), confidence.as_slice());
+        let rows = out.depth.chunks_mut(width.max(1));
+        let confidence_rows = out.confidence.chunks_mut(width.max(1));
+        for (row, (depth_out, confidence_out)) in rows.zip(confidence_rows).enumerate() {
+            for (column, (depth_out, confidence_out)) in
+                depth_out.iter_mut().zip(confidence_out).enumerate()
+            {
+                // The valid depths in the bin and their confidences
+                let mut depths = [0.0; 16];
+                let mut confidences = [0.0; 16];
+                let mut count = 0;
+                for y in row * size..(row + 1) * size {
+                    let start = y * input_width + column * size;
+                    for x in start..start + size {
+                        if depth[x] > 0.0 {
+                            depths[count] = depth[x];
+                            confidences[count] = confidence[x];
+                            count += 1;
+                        }
+                    }
+                }
+
+                if count == 0 {
+                    *depth_out = 0.0;
+                    *confidence_out = 0.0;
+                    continue;
+                }
+
+                let (depths, confidences) = (&mut depths[..count], &confidences[..count]);
+                *confidence_out = confidences.iter().sum::<f32>() / count as f32;
+                *depth_out = match mode {
+                    BinMode::Min => depths.iter().copied().fold(f32::INFINITY, f32::min),
+                    BinMode::Median => *depths.select_nth_unstable_by(count / 2, f32::total_cmp).1,
+                    BinMode::WeightedMean => {
+                        let mut total = 0.0;
+                        let mut total_weight = 0.0;
+                        for (&depth, &confidence) in depths.iter().zip(confidences) {
+                            let weight = confidence.max(0.0);
+                            total += depth * weight;
+                            total_weight += weight;
+                        }
+                        // With no confidence to go on every depth counts the same
+                        if total_weight > 0.0 {
+                            total / total_weight
+                        } else {
+                            depths.iter().sum::<f32>() / count as f32
+                        }
+                    }
+                };
+            }
+        }
+
+        Ok(())
+    }
+}
@@ -0,0 +1,263 @@
+//! Capturing frames on a dedicated thread.
+//!
+//! [CaptureEngine] takes ownership of a started [ArducamDepthCamera] and keeps requesting frames
+//! on its own thread, so that consumers never wait on the sensor. Captured frames are copied into
+//! a small ring of slots and the newest one can be borrowed without blocking or copying via
+//! [CaptureEngine::latest].
+
+use std::{
+    cell::UnsafeCell,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Arc,
+    },
+    thread::JoinHandle,
+    time::Duration,
+};
+
+use crate::{
+    backend::CameraBackend, ArducamDepthCamera, ArducamFrameFormat, FrameData, FrameType,
+    SdkBackend,
+};
+
+/// How long the capture thread waits on the camera before checking whether it should stop
+const POLL_TIMEOUT: Duration = Duration::from_millis(200);
+
+/// Set in [Slot::state] while the capture thread is writing into the slot. The remaining bits
+/// count the readers currently borrowing it.
+const WRITING: usize = 1 << (usize::BITS - 1);
+
+pub struct CaptureEngine<B: CameraBackend + Send + 'static = SdkBackend> {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<ArducamDepthCamera<B>>>,
+}
+
+struct Shared {
+    slots: Box<[Slot]>,
+    /// Index + 1 of the slot holding the newest frame, or 0 before the first frame
+    latest: AtomicUsize,
+    stop: AtomicBool,
+    captured: AtomicU64,
+    dropped: AtomicU64,
+    errors: AtomicU64,
+}
+
+struct Slot {
+    state: AtomicUsize,
+    frame: UnsafeCell<SlotFrame>,
+}
+
+// The contents of `frame` are only written by the capture thread while it holds the WRITING bit,
+// and only read while a reader holds a count, and the two are mutually exclusive.
+unsafe impl Sync for Slot {}
+
+#[derive(Default)]
+struct SlotFrame {
+    sequence: u64,
+    format: Option<ArducamFrameFormat>,
+    depth: Vec<f32>,
+    confidence: Vec<f32>,
+}
+
+/// Counters maintained by the capture thread
+#[derive(Debug, Clone, Copy)]
+pub struct CaptureStats {
+    /// Frames published to the ring
+    pub captured: u64,
+    /// Frames discarded because every slot was borrowed by a reader
+    pub dropped: u64,
+    /// Failed calls to [ArducamDepthCamera::request_frame], including timeouts
+    pub errors: u64,
+}
+
+impl<B: CameraBackend + Send + 'static> CaptureEngine<B> {
+    /// Start capturing from `camera`, which should already be opened and started in
+    /// [FrameType::DepthFrame] mode, into a ring of `ring_size` slots.
+    ///
+    /// Each slot a reader holds onto via [CaptureEngine::latest] is unavailable to the capture
+    /// thread, so `ring_size` should be at least two more than the number of frames consumers
+    /// will hold at once. Frames that arrive while no slot is free are dropped.
+    pub fn spawn(mut camera: ArducamDepthCamera<B>, ring_size: usize) -> Self {
+        assert!(ring_size >= 2, "Capture ring needs at least 2 slots");
+
+        let shared = Arc::new(Shared {
+            slots: (0..ring_size)
+                .map(|_| Slot {
+                    state: AtomicUsize::new(0),
+                    frame: UnsafeCell::new(SlotFrame::default()),
+                })
+                .collect(),
+            latest: AtomicUsize::new(0),
+            stop: AtomicBool::new(false),
+            captured: AtomicU64::new(0),
+            dropped: AtomicU64::new(0),
+            errors: AtomicU64::new(0),
+        });
+
+        let thread_shared = shared.clone();
+        let thread = std::thread::Builder::new()
+            .name("arducam-capture".into())
+            .spawn(move || {
+                capture_loop(&mut camera, &thread_shared);
+                camera
+            })
+            .expect("Failed to spawn capture thread");
+
+        Self {
+            shared,
+            thread: Some(thread),
+        }
+    }
+
+    /// Borrow the newest captured frame, or None if nothing has been captured yet.
+    ///
+    /// This never blocks on the capture thread. The returned frame stays valid, and is not
+    /// overwritten, until it is dropped.
+    pub fn latest(&self) -> Option<CapturedFrame<'_>> {
+        loop {
+            let latest = self.shared.latest.load(Ordering::Acquire);
+            let slot = self.shared.slots.get(latest.checked_sub(1)?)?;
+
+            let state = slot.state.load(Ordering::Relaxed);
+            // The capture thread never claims the published slot, so if it is being written
+            // a newer frame has already been published
+            if state & WRITING != 0 {
+                continue;
+            }
+
+            if slot
+                .state
+                .compare_exchange_weak(state, state + 1, Ordering::Acquire, Ordering::Relaxed)
+                .is_ok()
+            {
+                return Some(CapturedFrame { slot });
+            }
+        }
+    }
+
+    pub fn stats(&self) -> CaptureStats {
+        CaptureStats {
+            captured: self.shared.captured.load(Ordering::Relaxed),
+            dropped: self.shared.dropped.load(Ordering::Relaxed),
+            errors: self.shared.errors.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Stop the capture thread and get the camera back.
+    pub fn stop(mut self) -> ArducamDepthCamera<B> {
+        self.join().unwrap()
+    }
+
+    fn join(&mut self) -> Option<ArducamDepthCamera<B>> {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        let thread = self.thread.take()?;
+        Some(thread.join().expect("Capture thread panicked"))
+    }
+}
+
+impl<B: CameraBackend + Send + 'static> Drop for CaptureEngine<B> {
+    fn drop(&mut self) {
+        self.join();
+    }
+}
+
+fn capture_loop<B: CameraBackend>(camera: &mut ArducamDepthCamera<B>, shared: &Shared) {
+    let slot_count = shared.slots.len();
+    let mut sequence = 0;
+
+    while !shared.stop.load(Ordering::Relaxed) {
+        let frame = match camera.request_frame(Some(POLL_TIMEOUT)) {
+            Ok(frame) => frame,
+            Err(_) => {
+                shared.errors.fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+        };
+
+        let published = shared.latest.load(Ordering::Relaxed);
+        let claimed = (0..slot_count)
+            .map(|offset| (published + offset) % slot_count)
+            .filter(|&index| index + 1 != published)
+            .find(|&index| {
+                shared.slots[index]
+                    .state
+                    .compare_exchange(0, WRITING, Ordering::Acquire, Ordering::Relaxed)
+                    .is_ok()
+            });
+
+        let Some(index) = claimed else {
+            shared.dropped.fetch_add(1, Ordering::Relaxed);
+            metrics_count!(FRAMES_DROPPED);
+            continue;
+        };
+
+        let slot = &shared.slots[index];
+        {
+            let slot_frame = unsafe { &mut *slot.frame.get() };
+            let depth = frame.get_depth_data();
+            let confidence = frame.get_confidence_data();
+
+            slot_frame.sequence = sequence;
+            slot_frame.format = Some(frame.get_format(FrameType::DepthFrame));
+            slot_frame.depth.clear();
+            slot_frame.depth.extend_from_slice(depth.as_slice());
+            slot_frame.confidence.clear();
+            slot_frame
+                .confidence
+                .extend_from_slice(confidence.as_slice());
+        }
+        drop(frame);
+
+        slot.state.store(0, Ordering::Release);
+        shared.latest.store(index + 1, Ordering::Release);
+        shared.captured.fetch_add(1, Ordering::Relaxed);
+        sequence += 1;
+    }
+}
+
+/// A frame borrowed from a [CaptureEngine]'s ring. The slot is handed back when this is dropped.
+pub struct CapturedFrame<'a> {
+    slot: &'a Slot,
+}
+
+impl<'a> CapturedFrame<'a> {
+    fn frame(&self) -> &SlotFrame {
+        unsafe { &*self.slot.frame.get() }
+    }
+
+    /// The position of this frame in the order it was captured, starting from 0. Consumers can
+    /// compare this with the last frame they processed to skip frames they have already seen.
+    pub fn sequence(&self) -> u64 {
+        self.frame().sequence
+    }
+
+    pub fn format(&self) -> ArducamFrameFormat {
+        self.frame().format.unwrap()
+    }
+
+    pub fn get_depth_data(&self) -> FrameData<'_, f32> {
+        let frame = self.frame();
+        let format = self.format();
+        FrameData {
+            width: format.width,
+            height: format.height,
+            data: &frame.depth,
+        }
+    }
+
+    pub fn get_confidence_data(&self) -> FrameData<'_, f32> {
+        let frame = self.frame();
+        let format = self.format();
+        FrameData {
+            width: format.width,
+            height: format.height,
+            data: &frame.confidence,
+        }
+    }
+}
+
+impl<'a> Drop for CapturedFrame<'a> {
+    fn drop(&mut self) {
+        self.slot.state.fetch_sub(1, Ordering::Release);
+    }
+}
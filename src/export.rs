@@ -0,0 +1,353 @@
+//! Writing point clouds to PLY and PCD files for offline analysis.
+//!
+//! [PointCloudExporter] streams points straight from the buffers the rest of the pipeline
+//! produces into any [Write], as binary little-endian records laid out as one of the
+//! [PointLayout]s. Points are packed into one large buffer that is reused between clouds and
+//! handed to the writer a chunk at a time, so nothing is allocated or formatted per point.
+//!
+//! The layout sets the bandwidth needed to record continuously. A 240x180 frame with a point
+//! per pixel takes 691 KB as [PointLayout::XyzConfidence], about 21 MB/s at 30 frames per
+//! second, but 259 KB as [PointLayout::XyzMillimetres], about 8 MB/s, which slow storage such as
+//! an SD card can sustain.
+
+use std::io::Write;
+
+use thiserror::Error;
+
+use crate::{
+    mask::ValidityMask, projection::FrameSizeMismatch, DensePoints, FrameData, PointCloudProjector,
+    ProjectedPoints,
+};
+
+/// Default size of the write buffer, large enough for the writer to see few, big writes
+pub const DEFAULT_BUFFER_SIZE: usize = 1 << 20;
+/// Smallest write buffer allowed, enough for any header
+const MIN_BUFFER_SIZE: usize = 4096;
+
+#[derive(Debug, Error)]
+pub enum ExportError {
+    #[error("I/O error: {0}")]
+    Io(#[from] std::io::Error),
+    #[error(transparent)]
+    FrameSize(#[from] FrameSizeMismatch),
+}
+
+/// The file format a [PointCloudExporter] writes
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum CloudFormat {
+    /// The Polygon File Format, read by most mesh and point cloud tools
+    Ply,
+    /// The Point Cloud Data format of the Point Cloud Library
+    Pcd,
+}
+
+/// The fields written for each point by a [PointCloudExporter]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PointLayout {
+    /// X, Y, Z and confidence as `f32`s, 16 bytes per point
+    XyzConfidence,
+    /// X, Y and Z as `f32`s, 12 bytes per point
+    Xyz,
+    /// X, Y and Z in millimetres as `i16`s, 6 bytes per point. Coordinates are rounded to the
+    /// nearest millimetre and clamped to about ±32.7 m. Integers have no NaN, so invalid points
+    /// of organised PCD clouds are written as 0.
+    XyzMillimetres,
+}
+
+impl PointLayout {
+    /// Bytes per point
+    pub fn point_size(self) -> usize {
+        match self {
+            PointLayout::XyzConfidence => 4 * size_of::<f32>(),
+            PointLayout::Xyz => 3 * size_of::<f32>(),
+            PointLayout::XyzMillimetres => 3 * size_of::<i16>(),
+        }
+    }
+
+    fn field_names(self) -> &'static [&'static str] {
+        match self {
+            PointLayout::XyzConfidence => &["x", "y", "z", "confidence"],
+            PointLayout::Xyz | PointLayout::XyzMillimetres => &["x", "y", "z"],
+        }
+    }
+
+    /// The size of each field in bytes, and its type in PLY and PCD headers
+    fn field_type(self) -> (usize, &'static str, char) {
+        match self {
+            PointLayout::XyzConfidence | PointLayout::Xyz => (4, "float", 'F'),
+            PointLayout::XyzMillimetres => (2, "short", 'I'),
+        }
+    }
+
+    /// Append `point`, an X, Y, Z and confidence in metres, to `buffer`
+    fn encode(self, point: [f32; 4], buffer: &mut Vec<u8>) {
+        match self {
+            PointLayout::XyzConfidence => {
+                for value in point {
+                    buffer.extend_from_slice(&value.to_le_bytes());
+                }
+            }
+            PointLayout::Xyz => {
+                for value in &point[..3] {
+                    buffer.extend_from_slice(&value.to_le_bytes());
+                }
+            }
+            PointLayout::XyzMillimetres => {
+                for value in &point[..3] {
+                    // Float to integer casts saturate, and turn NaN into 0
+                    let millimetres = (value * 1000.0).round() as i16;
+                    buffer.extend_from_slice(&millimetres.to_le_bytes());
+                }
+            }
+        }
+    }
+}
+
+/// Writes point clouds as binary PLY or PCD
+pub struct PointCloudExporter {
+    format: CloudFormat,
+    layout: PointLayout,
+    skip_invalid: bool,
+    buffer: Vec<u8>,
+}
+
+impl PointCloudExporter {
+    /// An exporter writing `format` through a buffer of [DEFAULT_BUFFER_SIZE] bytes, keeping
+    /// invalid points and writing [PointLayout::XyzConfidence] records
+    pub fn new(format: CloudFormat) -> Self {
+        Self {
+            format,
+            layout: PointLayout::XyzConfidence,
+            skip_invalid: false,
+            buffer: Vec::with_capacity(DEFAULT_BUFFER_SIZE),
+        }
+    }
+
+    /// Whether to leave out invalid points.
+    ///
+    /// With `false`, the default, every pixel gets a point. Clouds are written in row-major
+    /// order and, for PCD, with the frame's width and height so tools can treat them as
+    /// organised. Invalid points are kept: as they were projected in PLY files, and with NaN
+    /// coordinates in PCD files as the Point Cloud Library expects.
+    ///
+    /// With `true`, only valid points are written. Clouds are smaller but unorganised, with
+    /// nothing left to tell which pixel each point came from.
+    ///
+    /// [PointCloudExporter::write_dense] only ever has valid points, and writes the same either
+    /// way.
+    pub fn with_skip_invalid(mut self, skip_invalid: bool) -> Self {
+        self.skip_invalid = skip_invalid;
+        self
+    }
+
+    /// Write each point as `layout` rather than [PointLayout::XyzConfidence]
+    pub fn with_layout(mut self, layout: PointLayout) -> Self {
+        self.layout = layout;
+        self
+    }
+
+    /// Hand points to the writer in chunks of up to `bytes` bytes
+    pub fn with_buffer_size(mut self, bytes: usize) -> Self {
+        assert!(
+            bytes >= MIN_BUFFER_SIZE,
+            "Write buffer must be at least {MIN_BUFFER_SIZE} bytes"
+        );
+        self.buffer = Vec::with_capacity(bytes);
+        self
+    }
+
+    pub fn format(&self) -> CloudFormat {
+        self.format
+    }
+
+    pub fn layout(&self) -> PointLayout {
+        self.layout
+    }
+
+    /// Write the points from [PointCloudProjector::project_soa], with their confidences.
+    ///
+    /// Panics if `confidence` does not have one value per point.
+    pub fn write_projected<W: Write>(
+        &mut self,
+        writer: &mut W,
+        points: &ProjectedPoints,
+        confidence: &FrameData<f32>,
+    ) -> Result<(), ExportError> {
+        assert!(
+            confidence.as_slice().len() == points.len(),
+            "Confidence frame must have one value per point"
+        );
+
+        let coordinates = points.x.iter().zip(&points.y).zip(&points.z);
+        let records = coordinates.zip(confidence).enumerate().map(
+            |(index, (((&x, &y), &z), &confidence))| {
+                (points.is_valid(index), [x, y, z, confidence])
+            },
+        );
+
+        let organised = self.organised(confidence);
+        let count = match organised {
+            Some(_) => points.len(),
+            None => points
+                .valid
+                .iter()
+                .map(|word| word.count_ones() as usize)
+                .sum(),
+        };
+        self.write_cloud(writer, count, organised, records)
+    }
+
+    /// Project `depth` with `projector` and write the points with their confidences, without
+    /// an intermediate point buffer. Points are valid if they have a positive depth and, when
+    /// there is a `mask`, are valid in it.
+    pub fn write_frame<W: Write>(
+        &mut self,
+        writer: &mut W,
+        projector: &PointCloudProjector,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: Option<&ValidityMask>,
+    ) -> Result<(), ExportError> {
+        projector.check_size(depth)?;
+        projector.check_size(confidence)?;
+        if let Some(mask) = mask {
+            mask.check_size(depth)?;
+        }
+
+        let is_valid =
+            |index: usize, z: f32| z > 0.0 && mask.map_or(true, |mask| mask.is_valid(index));
+        let organised = self.organised(depth);
+        let count = match organised {
+            Some(_) => depth.as_slice().len(),
+            None => depth
+                .into_iter()
+                .enumerate()
+                .filter(|&(index, &z)| is_valid(index, z))
+                .count(),
+        };
+
+        let (ray_x, ray_y) = projector.rays();
+        let rays = ray_x.iter().zip(ray_y);
+        let records = depth.into_iter().zip(confidence).zip(rays).enumerate().map(
+            |(index, ((&z, &confidence), (&ray_x, &ray_y)))| {
+                (is_valid(index, z), [ray_x * z, ray_y * z, z, confidence])
+            },
+        );
+
+        self.write_cloud(writer, count, organised, records)
+    }
+
+    /// Write the points from [PointCloudProjector::project_dense], which are all valid
+    pub fn write_dense<W: Write>(
+        &mut self,
+        writer: &mut W,
+        points: &DensePoints,
+    ) -> Result<(), ExportError> {
+        let coordinates = points.x().iter().zip(points.y()).zip(points.z());
+        let records = coordinates
+            .zip(points.confidence())
+            .map(|(((&x, &y), &z), &confidence)| (true, [x, y, z, confidence]));
+
+        // The points have no place in a frame any more, so the cloud is never organised
+        self.write_cloud(writer, points.len(), None, records)
+    }
+
+    /// The size of the clouds from `frame` if they are organised, with a point per pixel
+    fn organised<T: Copy>(&self, frame: &FrameData<T>) -> Option<(u16, u16)> {
+        (!self.skip_invalid).then_some((frame.width(), frame.height()))
+    }
+
+    /// Write a header for `count` points and then those of `records`, which are (valid, point)
+    /// pairs. Unless the cloud is `organised`, with the given frame size, invalid points are
+    /// left out.
+    fn write_cloud<W: Write>(
+        &mut self,
+        writer: &mut W,
+        count: usize,
+        organised: Option<(u16, u16)>,
+        records: impl Iterator<Item = (bool, [f32; 4])>,
+    ) -> Result<(), ExportError> {
+        self.buffer.clear();
+        self.write_header(count, organised);
+
+        let nan_invalid = self.format == CloudFormat::Pcd;
+        let point_size = self.layout.point_size();
+        for (valid, mut point) in records {
+            if !valid {
+                if organised.is_none() {
+                    continue;
+                }
+                if nan_invalid {
+                    point[..3].fill(f32::NAN);
+                }
+            }
+
+            if self.buffer.len() + point_size > self.buffer.capacity() {
+                writer.write_all(&self.buffer)?;
+                self.buffer.clear();
+            }
+            self.layout.encode(point, &mut self.buffer);
+        }
+
+        writer.write_all(&self.buffer)?;
+        self.buffer.clear();
+        Ok(())
+    }
+
+    /// Write the header for `count` points into the buffer, giving the frame size of organised
+    /// clouds
+    fn write_header(&mut self, count: usize, organised: Option<(u16, u16)>) {
+        // Writing to a Vec<u8> can't fail, and stays within the buffer's capacity
+        let buffer = &mut self.buffer;
+        let names = self.layout.field_names();
+        let (size, ply_type, pcd_type) = self.layout.field_type();
+        match self.format {
+            CloudFormat::Ply => {
+                write!(
+                    buffer,
+                    "ply\n\
+                     format binary_little_endian 1.0\n\
+                     element vertex {count}\n"
+                )
+                .unwrap();
+                for name in names {
+                    writeln!(buffer, "property {ply_type} {name}").unwrap();
+                }
+                writeln!(buffer, "end_header").unwrap();
+            }
+            CloudFormat::Pcd => {
+                let (width, height) = organised.map_or((count, 1), |(width, height)| {
+                    (width as usize, height as usize)
+                });
+                write!(
+                    buffer,
+                    "# .PCD v0.7 - Point Cloud Data file format\n\
+                     VERSION 0.7\n\
+                     FIELDS"
+                )
+                .unwrap();
+                for name in names {
+                    write!(buffer, " {name}").unwrap();
+                }
+                let repeated: [(&str, &dyn std::fmt::Display); 3] =
+                    [("SIZE", &size), ("TYPE", &pcd_type), ("COUNT", &1)];
+                for (keyword, value) in repeated {
+                    write!(buffer, "\n{keyword}").unwrap();
+                    for _ in names {
+                        write!(buffer, " {value}").unwrap();
+                    }
+                }
+                write!(
+                    buffer,
+                    "\n\
+                     WIDTH {width}\n\
+                     HEIGHT {height}\n\
+                     VIEWPOINT 0 0 0 1 0 0 0\n\
+                     POINTS {count}\n\
+                     DATA binary\n"
+                )
+                .unwrap();
+            }
+        }
+    }
+}
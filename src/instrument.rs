@@ -0,0 +1,329 @@
+//! Per-stage latency measurement, enabled by the `instrument` feature.
+//!
+//! With the feature enabled, the time spent in each [Stage] of the pipeline is recorded into a
+//! process-wide [Histogram] every time it runs: waiting on the camera in
+//! [ArducamDepthCamera::request_frame](crate::ArducamDepthCamera::request_frame), copying frames
+//! into a [FramePool](crate::FramePool), releasing them, projecting them and encoding them for
+//! the wire. [snapshot] reads the median and tail latencies of every stage at any time, from any
+//! thread, without stopping the pipeline.
+//!
+//! Recording a duration is a couple of relaxed atomic additions, so it never blocks and never
+//! allocates. Without the feature the hooks are not compiled at all.
+//!
+//! Each camera timestamps frames with its own clock. Every frame requested is also used to
+//! correlate that clock with the host's, see [Stage::Delivery] and [ClockCorrelation].
+
+use std::{
+    sync::{
+        atomic::{AtomicI64, AtomicU64, Ordering},
+        OnceLock,
+    },
+    time::{Duration, Instant},
+};
+
+/// Each power of two is split into 2^SUB_BUCKET_BITS buckets, so values are recorded to
+/// within 1/64th, about 1.6%
+const SUB_BUCKET_BITS: u32 = 6;
+const SUB_BUCKETS: usize = 1 << SUB_BUCKET_BITS;
+/// Durations are recorded precisely up to 2^VALUE_BITS nanoseconds, about 69 seconds, and
+/// anything longer counts as that. The exact maximum is kept separately.
+const VALUE_BITS: u32 = 36;
+const MAX_VALUE: u64 = (1 << VALUE_BITS) - 1;
+const BUCKETS: usize = (VALUE_BITS - SUB_BUCKET_BITS + 1) as usize * SUB_BUCKETS;
+
+/// A part of the pipeline whose latency is recorded
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub enum Stage {
+    /// Waiting for the camera to hand over a frame, including requests that time out
+    RequestFrame,
+    /// How much later than the fastest frame so far a frame reached the host, judged by its
+    /// camera timestamp. This is the time spent in the camera, driver and SDK before
+    /// [Stage::RequestFrame] could return it.
+    Delivery,
+    /// Copying a frame into a [FramePool](crate::FramePool)
+    Copy,
+    /// Handing a frame back to the camera
+    ReleaseFrame,
+    /// Any of the [PointCloudProjector](crate::PointCloudProjector) projections
+    Projection,
+    /// Encoding a frame with a [FrameEncoder](crate::wire::FrameEncoder)
+    Serialisation,
+}
+
+impl Stage {
+    pub const COUNT: usize = 6;
+
+    pub const ALL: [Stage; Self::COUNT] = [
+        Stage::RequestFrame,
+        Stage::Delivery,
+        Stage::Copy,
+        Stage::ReleaseFrame,
+        Stage::Projection,
+        Stage::Serialisation,
+    ];
+
+    /// A short lowercase name for reports
+    pub fn name(self) -> &'static str {
+        match self {
+            Stage::RequestFrame => "request_frame",
+            Stage::Delivery => "delivery",
+            Stage::Copy => "copy",
+            Stage::ReleaseFrame => "release_frame",
+            Stage::Projection => "projection",
+            Stage::Serialisation => "serialisation",
+        }
+    }
+}
+
+/// A lock-free log-linear histogram of nanosecond durations, in the style of HdrHistogram.
+///
+/// Any number of threads can record into and read from the same histogram at once.
+pub struct Histogram {
+    buckets: [AtomicU64; BUCKETS],
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        Self {
+            buckets: [const { AtomicU64::new(0) }; BUCKETS],
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, duration: Duration) {
+        self.record_nanos(duration.as_nanos().min(u64::MAX as u128) as u64);
+    }
+
+    pub fn record_nanos(&self, nanos: u64) {
+        self.buckets[bucket_index(nanos)].fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(nanos, Ordering::Relaxed);
+        self.max.fetch_max(nanos, Ordering::Relaxed);
+    }
+
+    /// The statistics of everything recorded so far. Durations recorded while this runs may or
+    /// may not be included.
+    pub fn snapshot(&self) -> HistogramSnapshot {
+        let counts = self
+            .buckets
+            .each_ref()
+            .map(|bucket| bucket.load(Ordering::Relaxed));
+        let count = counts.iter().sum();
+        let max = self.max.load(Ordering::Relaxed);
+        let quantile = |quantile: f64| {
+            // The smallest value that at least this fraction of durations are no longer than
+            let rank = ((quantile * count as f64).ceil() as u64).max(1);
+            let mut seen = 0;
+            for (index, &bucket) in counts.iter().enumerate() {
+                seen += bucket;
+                if seen >= rank {
+                    return Duration::from_nanos(highest_equivalent_value(index).min(max));
+                }
+            }
+            Duration::ZERO
+        };
+
+        let sum = self.sum.load(Ordering::Relaxed);
+        HistogramSnapshot {
+            count,
+            sum: Duration::from_nanos(sum),
+            mean: match count {
+                0 => Duration::ZERO,
+                count => Duration::from_nanos(sum / count),
+            },
+            p50: quantile(0.5),
+            p99: quantile(0.99),
+            p999: quantile(0.999),
+            max: Duration::from_nanos(max),
+        }
+    }
+
+    /// Forget everything recorded so far
+    pub fn reset(&self) {
+        for bucket in &self.buckets {
+            bucket.store(0, Ordering::Relaxed);
+        }
+        self.sum.store(0, Ordering::Relaxed);
+        self.max.store(0, Ordering::Relaxed);
+    }
+}
+
+impl Default for Histogram {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// The bucket counting `value`: values below [SUB_BUCKETS] get a bucket each, and every power
+/// of two above is split into [SUB_BUCKETS] equal parts
+fn bucket_index(value: u64) -> usize {
+    let value = value.min(MAX_VALUE);
+    if value < SUB_BUCKETS as u64 {
+        return value as usize;
+    }
+    let shift = u64::BITS - 1 - value.leading_zeros() - SUB_BUCKET_BITS;
+    (shift as usize + 1) * SUB_BUCKETS + (value >> shift) as usize - SUB_BUCKETS
+}
+
+/// The largest value counted by the bucket at `index`
+fn highest_equivalent_value(index: usize) -> u64 {
+    if index < SUB_BUCKETS {
+        return index as u64;
+    }
+    let shift = index / SUB_BUCKETS - 1;
+    let mantissa = (index % SUB_BUCKETS + SUB_BUCKETS) as u64;
+    (mantissa << shift) + ((1 << shift) - 1)
+}
+
+/// Statistics read from a [Histogram]. Percentiles are accurate to within about 1.6%, and never
+/// more than the maximum.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct HistogramSnapshot {
+    pub count: u64,
+    /// The total of every duration recorded
+    pub sum: Duration,
+    pub mean: Duration,
+    pub p50: Duration,
+    pub p99: Duration,
+    pub p999: Duration,
+    pub max: Duration,
+}
+
+/// The latencies of every [Stage], from [snapshot]
+#[derive(Debug, Clone, Copy)]
+pub struct Snapshot {
+    stages: [HistogramSnapshot; Stage::COUNT],
+}
+
+impl Snapshot {
+    pub fn get(&self, stage: Stage) -> &HistogramSnapshot {
+        &self.stages[stage as usize]
+    }
+
+    /// Every stage with its statistics, in the order of [Stage::ALL]
+    pub fn iter(&self) -> impl Iterator<Item = (Stage, &HistogramSnapshot)> {
+        Stage::ALL.into_iter().zip(&self.stages)
+    }
+}
+
+static STAGES: [Histogram; Stage::COUNT] = [const { Histogram::new() }; Stage::COUNT];
+
+/// Read the latencies recorded for every stage so far
+pub fn snapshot() -> Snapshot {
+    Snapshot {
+        stages: STAGES.each_ref().map(Histogram::snapshot),
+    }
+}
+
+/// Forget the latencies recorded so far, e.g. after warming up
+pub fn reset() {
+    for histogram in &STAGES {
+        histogram.reset();
+    }
+}
+
+/// Record one run of `stage` that took `duration`, for stages timed outside this crate
+pub fn record(stage: Stage, duration: Duration) {
+    STAGES[stage as usize].record(duration);
+}
+
+/// Times the rest of its scope as a [Stage], recording the duration when dropped
+pub(crate) struct Span {
+    stage: Stage,
+    start: Instant,
+}
+
+impl Span {
+    pub(crate) fn enter(stage: Stage) -> Self {
+        Self {
+            stage,
+            start: Instant::now(),
+        }
+    }
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        record(self.stage, self.start.elapsed());
+    }
+}
+
+/// The instant host times are measured from
+fn epoch() -> Instant {
+    static EPOCH: OnceLock<Instant> = OnceLock::new();
+    *EPOCH.get_or_init(Instant::now)
+}
+
+/// The correlation between one camera's clock and the host's, from the camera timestamps of
+/// the frames requested from it. Every [ArducamDepthCamera](crate::ArducamDepthCamera) keeps its
+/// own, see [ArducamDepthCamera::clock](crate::ArducamDepthCamera::clock), as each camera has a
+/// clock of its own.
+pub struct ClockCorrelation {
+    /// Nanoseconds of the camera clock per timestamp tick
+    tick_nanos: AtomicU64,
+    /// The smallest difference seen between the host clock and a frame's camera timestamp, in
+    /// nanoseconds, or i64::MAX before the first. This is the offset between the clocks plus
+    /// the fastest delivery seen.
+    offset: AtomicI64,
+}
+
+impl ClockCorrelation {
+    pub(crate) fn new() -> Self {
+        Self {
+            tick_nanos: AtomicU64::new(1),
+            offset: AtomicI64::new(i64::MAX),
+        }
+    }
+
+    /// Set how long one tick of
+    /// [ArducamFrameFormat::timestamp](crate::ArducamFrameFormat::timestamp) is. The default is
+    /// a nanosecond, as used by [SyntheticBackend](crate::synthetic::SyntheticBackend).
+    pub fn set_timestamp_tick(&self, tick: Duration) {
+        assert!(!tick.is_zero(), "Timestamp tick must be positive");
+        let tick = u64::try_from(tick.as_nanos()).unwrap_or(u64::MAX);
+        self.tick_nanos.store(tick, Ordering::Relaxed);
+        self.reset();
+    }
+
+    /// The host instant a frame with the camera `timestamp` was captured at, as best it can be
+    /// told: assuming the fastest frame requested since the camera started reached the host
+    /// instantly. None before any frame has been requested.
+    ///
+    /// Drift between the two clocks shows up as a slowly growing [Stage::Delivery].
+    pub fn host_time(&self, timestamp: u64) -> Option<Instant> {
+        let offset = self.offset.load(Ordering::Relaxed);
+        if offset == i64::MAX {
+            return None;
+        }
+        let nanos = self.sensor_nanos(timestamp).saturating_add(offset);
+        Some(match u64::try_from(nanos) {
+            Ok(nanos) => epoch() + Duration::from_nanos(nanos),
+            Err(_) => epoch() - Duration::from_nanos(nanos.unsigned_abs()),
+        })
+    }
+
+    /// The camera time of `timestamp` in nanoseconds, saturating at i64::MAX
+    fn sensor_nanos(&self, timestamp: u64) -> i64 {
+        let nanos = timestamp.saturating_mul(self.tick_nanos.load(Ordering::Relaxed));
+        i64::try_from(nanos).unwrap_or(i64::MAX)
+    }
+
+    /// Correlate the camera `timestamp` of a frame that has just been requested with the host
+    /// clock, and record its [Stage::Delivery]
+    pub(crate) fn observe(&self, timestamp: u64) {
+        let now = i64::try_from(epoch().elapsed().as_nanos()).unwrap_or(i64::MAX);
+        let offset = now - self.sensor_nanos(timestamp);
+        let fastest = self.offset.fetch_min(offset, Ordering::Relaxed).min(offset);
+        record(
+            Stage::Delivery,
+            Duration::from_nanos(offset.abs_diff(fastest)),
+        );
+    }
+
+    /// Forget the correlation, as the camera clock may restart along with the camera
+    pub(crate) fn reset(&self) {
+        self.offset.store(i64::MAX, Ordering::Relaxed);
+    }
+}
@@ -0,0 +1,189 @@
+//! Camera intrinsics and lens distortion.
+//!
+//! [Intrinsics] describes how points in front of the camera map to pixels, using the same
+//! Brown-Conrady model and coefficient names as OpenCV, so the results of a calibration there can
+//! be used directly.
+//! [PointCloudProjector::from_intrinsics](crate::PointCloudProjector::from_intrinsics)
+//! undistorts the ray through every pixel once, so correct projection costs no more per frame
+//! than the pinhole model.
+//!
+//! Intrinsics can be loaded from a text file of `key = value` lines:
+//!
+//! ```text
+//! # Calibrated at 240x180
+//! fx = 190.6
+//! fy = 190.2
+//! cx = 119.3
+//! cy = 90.8
+//! k1 = -0.12
+//! k2 = 0.031
+//! ```
+//!
+//! `fx`, `fy`, `cx` and `cy` are required, and any of the distortion coefficients `k1`, `k2`,
+//! `k3`, `p1` and `p2` that are left out are 0.
+
+use std::path::Path;
+
+use thiserror::Error;
+
+/// Iterations used to invert the distortion model, enough to converge to well under a
+/// hundredth of a pixel across the sensor's field of view
+const UNDISTORT_ITERATIONS: usize = 20;
+
+#[derive(Debug, Error)]
+pub enum IntrinsicsError {
+    #[error("I/O error: {0}")]
+    Io(#[from] std::io::Error),
+    #[error("Line {0} is not of the form key = value")]
+    Syntax(usize),
+    #[error("Unknown key {key:?} on line {line}")]
+    UnknownKey { line: usize, key: String },
+    #[error("Invalid value for {key} on line {line}")]
+    InvalidValue { line: usize, key: &'static str },
+    #[error("Missing value for {0}")]
+    Missing(&'static str),
+}
+
+/// Pinhole camera intrinsics with radial and tangential distortion
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Intrinsics {
+    /// Horizontal focal length in pixels
+    pub fx: f32,
+    /// Vertical focal length in pixels
+    pub fy: f32,
+    /// Column of the optical centre
+    pub cx: f32,
+    /// Row of the optical centre
+    pub cy: f32,
+    /// Radial distortion coefficients
+    pub k1: f32,
+    pub k2: f32,
+    pub k3: f32,
+    /// Tangential distortion coefficients
+    pub p1: f32,
+    pub p2: f32,
+}
+
+impl Intrinsics {
+    /// Intrinsics with no distortion
+    pub fn pinhole(fx: f32, fy: f32, cx: f32, cy: f32) -> Self {
+        Self {
+            fx,
+            fy,
+            cx,
+            cy,
+            k1: 0.0,
+            k2: 0.0,
+            k3: 0.0,
+            p1: 0.0,
+            p2: 0.0,
+        }
+    }
+
+    /// Undistorted intrinsics from the horizontal and vertical field of view in degrees, with
+    /// the optical centre in the middle of a `width`x`height` frame. This is only as good as the
+    /// nominal field of view; a calibration is needed for straight edges.
+    pub fn from_fov(width: u16, height: u16, horizontal_fov: f32, vertical_fov: f32) -> Self {
+        let fx = width as f32 / (2.0 * f32::tan(0.5 * horizontal_fov.to_radians()));
+        let fy = height as f32 / (2.0 * f32::tan(0.5 * vertical_fov.to_radians()));
+        Self::pinhole(fx, fy, (width / 2) as f32, (height / 2) as f32)
+    }
+
+    /// Set the distortion coefficients, given in the order OpenCV uses
+    pub fn with_distortion(mut self, k1: f32, k2: f32, p1: f32, p2: f32, k3: f32) -> Self {
+        self.k1 = k1;
+        self.k2 = k2;
+        self.p1 = p1;
+        self.p2 = p2;
+        self.k3 = k3;
+        self
+    }
+
+    /// Load intrinsics from a file in the format described in the [module docs](self)
+    pub fn load(path: impl AsRef<Path>) -> Result<Self, IntrinsicsError> {
+        Self::parse(&std::fs::read_to_string(path)?)
+    }
+
+    /// Parse intrinsics in the format described in the [module docs](self)
+    pub fn parse(text: &str) -> Result<Self, IntrinsicsError> {
+        let mut focal_and_centre = [None; 4];
+        let mut intrinsics = Self::pinhole(0.0, 0.0, 0.0, 0.0);
+
+        for (index, line) in text.lines().enumerate() {
+            let line_number = index + 1;
+            let line = line.split('#').next().unwrap().trim();
+            if line.is_empty() {
+                continue;
+            }
+
+            let (key, value) = line
+                .split_once('=')
+                .ok_or(IntrinsicsError::Syntax(line_number))?;
+            let (key, value) = (key.trim(), value.trim());
+            let (key, field): (&'static str, &mut f32) = match key {
+                "fx" => ("fx", focal_and_centre[0].insert(0.0)),
+                "fy" => ("fy", focal_and_centre[1].insert(0.0)),
+                "cx" => ("cx", focal_and_centre[2].insert(0.0)),
+                "cy" => ("cy", focal_and_centre[3].insert(0.0)),
+                "k1" => ("k1", &mut intrinsics.k1),
+                "k2" => ("k2", &mut intrinsics.k2),
+                "k3" => ("k3", &mut intrinsics.k3),
+                "p1" => ("p1", &mut intrinsics.p1),
+                "p2" => ("p2", &mut intrinsics.p2),
+                _ => {
+                    return Err(IntrinsicsError::UnknownKey {
+                        line: line_number,
+                        key: key.to_owned(),
+                    })
+                }
+            };
+            *field = value
+                .parse()
+                .ok()
+                .filter(|value: &f32| value.is_finite())
+                .ok_or(IntrinsicsError::InvalidValue {
+                    line: line_number,
+                    key,
+                })?;
+        }
+
+        let [fx, fy, cx, cy] = [("fx", 0), ("fy", 1), ("cx", 2), ("cy", 3)]
+            .map(|(key, index)| focal_and_centre[index].ok_or(IntrinsicsError::Missing(key)));
+        intrinsics.fx = fx?;
+        intrinsics.fy = fy?;
+        intrinsics.cx = cx?;
+        intrinsics.cy = cy?;
+        Ok(intrinsics)
+    }
+
+    /// Whether any distortion coefficient is non-zero
+    pub fn is_distorted(&self) -> bool {
+        [self.k1, self.k2, self.k3, self.p1, self.p2] != [0.0; 5]
+    }
+
+    /// The direction through pixel (`column`, `row`) as the X and Y of a point at a depth of 1,
+    /// in the axes used by [PointCloudProjector](crate::PointCloudProjector)
+    pub fn ray(&self, column: f32, row: f32) -> [f32; 2] {
+        // Work in OpenCV's axes, with X to the right and Y down, and flip at the end
+        let x_distorted = (column as f64 - self.cx as f64) / self.fx as f64;
+        let y_distorted = (row as f64 - self.cy as f64) / self.fy as f64;
+        if !self.is_distorted() {
+            return [-x_distorted as f32, -y_distorted as f32];
+        }
+
+        let [k1, k2, k3, p1, p2] = [self.k1, self.k2, self.k3, self.p1, self.p2].map(f64::from);
+        // There is no closed form inverse, so iterate from the distorted point as OpenCV's
+        // undistortPoints does
+        let (mut x, mut y) = (x_distorted, y_distorted);
+        for _ in 0..UNDISTORT_ITERATIONS {
+            let r2 = x * x + y * y;
+            let radial = 1.0 + r2 * (k1 + r2 * (k2 + r2 * k3));
+            let dx = 2.0 * p1 * x * y + p2 * (r2 + 2.0 * x * x);
+            let dy = p1 * (r2 + 2.0 * y * y) + 2.0 * p2 * x * y;
+            x = (x_distorted - dx) / radial;
+            y = (y_distorted - dy) / radial;
+        }
+
+        [-x as f32, -y as f32]
+    }
+}
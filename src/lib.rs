@@ -1,4 +1,6 @@
-use std::{marker::PhantomData, num::NonZero, ptr::NonNull, time::Duration};
+#[cfg(feature = "instrument")]
+use std::sync::Arc;
+use std::{mem::ManuallyDrop, num::NonZero, time::Duration};
 
 use thiserror::Error;
 
@@ -10,11 +12,71 @@ mod raw {
     include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
 }
 
+/// Time the rest of the enclosing block as an `instrument::Stage` when the `instrument` feature
+/// is enabled, and compile to nothing otherwise
+macro_rules! instrument_span {
+    ($stage:ident) => {
+        #[cfg(feature = "instrument")]
+        let _span = $crate::instrument::Span::enter($crate::instrument::Stage::$stage);
+    };
+}
+
+/// Add one to a `metrics` counter when the `metrics` feature is enabled, and compile to nothing
+/// otherwise
+macro_rules! metrics_count {
+    ($counter:ident) => {
+        #[cfg(feature = "metrics")]
+        $crate::metrics::$counter.fetch_add(1, std::sync::atomic::Ordering::Relaxed);
+    };
+}
+
+mod aligned;
+pub mod array;
+pub mod backend;
+pub mod binning;
+pub mod capture;
+pub mod export;
+#[cfg(feature = "instrument")]
+pub mod instrument;
+pub mod intrinsics;
+pub mod mailbox;
+pub mod mask;
+#[cfg(feature = "metrics")]
+pub mod metrics;
+pub mod outlier;
+pub mod phase;
+pub mod pool;
+pub mod projection;
+#[cfg(all(unix, target_endian = "little"))]
+pub mod recording;
+#[cfg(all(target_os = "linux", target_endian = "little"))]
+pub mod shm;
+pub mod simd;
+pub mod spatial;
+#[cfg(feature = "async")]
+pub mod stream;
+pub mod synthetic;
+pub mod temporal;
+pub mod voxel;
+pub mod wire;
+mod workers;
+
+pub use backend::{CameraBackend, SdkBackend};
+pub use intrinsics::Intrinsics;
+pub use mask::ValidityMask;
+pub use pool::{FramePool, OwnedFrame, OwnedFrameError};
+pub use projection::{DensePoints, PointCloudProjector, ProjectedPoints};
+
 /// The handle to use to perform camera operations
-pub struct ArducamDepthCamera {
-    inner: NonNull<std::ffi::c_void>,
+///
+/// By default this drives a real camera through [SdkBackend], but any [CameraBackend] can be
+/// used via [ArducamDepthCamera::with_backend].
+pub struct ArducamDepthCamera<B: CameraBackend = SdkBackend> {
+    backend: B,
     opened: bool,
     started: bool,
+    #[cfg(feature = "instrument")]
+    clock: Arc<instrument::ClockCorrelation>,
 }
 
 #[derive(Debug, Error)]
@@ -43,38 +105,46 @@ pub struct StartError(NonZero<std::ffi::c_int>);
 #[error("Failed to stop camera, got error code: {0}")]
 pub struct StopError(NonZero<std::ffi::c_int>);
 
+#[derive(Debug, Error)]
+#[error("Failed to release camera frame, got error code: {0}")]
+pub struct ReleaseFrameError(NonZero<std::ffi::c_int>);
+
 impl ArducamDepthCamera {
     pub fn new() -> Result<Self, InitError> {
-        let inner = unsafe { raw::createArducamDepthCamera() };
-        let inner = NonNull::<std::ffi::c_void>::new(inner).ok_or(InitError)?;
-        Ok(Self {
-            inner,
+        Ok(Self::with_backend(SdkBackend::create()?))
+    }
+}
+
+impl<B: CameraBackend> ArducamDepthCamera<B> {
+    pub fn with_backend(backend: B) -> Self {
+        Self {
+            backend,
             opened: false,
             started: false,
-        })
+            #[cfg(feature = "instrument")]
+            clock: Arc::new(instrument::ClockCorrelation::new()),
+        }
     }
 
     pub fn open(&mut self, conn: Connection, index: i32) -> Result<(), OpenError> {
-        let status =
-            unsafe { raw::arducamCameraOpen(self.inner.as_ptr(), conn.into(), index as _) };
-        match NonZero::new(status) {
-            Some(error) => Err(OpenError(error)),
-            None => {
-                self.opened = true;
-                Ok(())
-            }
-        }
+        self.backend.open(conn, index)?;
+        self.opened = true;
+        Ok(())
     }
 
     pub fn start(&mut self, frame_type: FrameType) -> Result<(), StartError> {
-        let status = unsafe { raw::arducamCameraStart(self.inner.as_ptr(), frame_type.into()) };
-        match NonZero::new(status) {
-            Some(error) => Err(StartError(error)),
-            None => {
-                self.started = true;
-                Ok(())
-            }
-        }
+        self.backend.start(frame_type)?;
+        self.started = true;
+        #[cfg(feature = "instrument")]
+        self.clock.reset();
+        Ok(())
+    }
+
+    /// The correlation between this camera's clock and the host's, for turning the timestamps
+    /// of its frames into host instants. Clone the [Arc] to use it from other threads.
+    #[cfg(feature = "instrument")]
+    pub fn clock(&self) -> &Arc<instrument::ClockCorrelation> {
+        &self.clock
     }
 
     // pub fn get_info(&self) -> CameraInfo {
@@ -91,51 +161,48 @@ impl ArducamDepthCamera {
     // }
 
     pub fn close(&mut self) -> Result<(), CloseError> {
-        let status = unsafe {
-            raw::arducamCameraClose(todo!(
-                "blocked by https://github.com/ArduCAM/Arducam_tof_camera/issues/78"
-            ))
-        };
-        match NonZero::new(status) {
-            Some(error) => Err(CloseError(error)),
-            None => {
-                // Not sure whether to set self.started to false too
-                self.opened = false;
-                Ok(())
-            }
-        }
+        self.backend.close()?;
+        // Not sure whether to set self.started to false too
+        self.opened = false;
+        Ok(())
     }
 
     pub fn stop(&mut self) -> Result<(), StopError> {
-        let status = unsafe { raw::arducamCameraStop(self.inner.as_ptr()) };
-        match NonZero::new(status) {
-            Some(error) => Err(StopError(error)),
-            None => {
-                self.started = false;
-                Ok(())
-            }
-        }
+        self.backend.stop()?;
+        self.started = false;
+        Ok(())
     }
 
     pub fn request_frame(
         &mut self,
         timeout: Option<Duration>,
-    ) -> Result<ArducamFrameBuffer, RequestFrameError> {
-        let timeout = match timeout {
-            Some(timeout) => timeout.as_millis() as std::ffi::c_int,
-            None => -1,
+    ) -> Result<ArducamFrameBuffer<'_, B>, RequestFrameError> {
+        let frame = {
+            instrument_span!(RequestFrame);
+            self.backend.request_frame(timeout)
+        };
+        let frame = match frame {
+            Ok(frame) => frame,
+            Err(error) => {
+                metrics_count!(REQUEST_ERRORS);
+                return Err(error);
+            }
         };
-        let inner = unsafe { raw::arducamCameraRequestFrame(self.inner.as_ptr(), timeout) };
-        let inner = NonNull::<std::ffi::c_void>::new(inner).ok_or(RequestFrameError)?;
+        metrics_count!(FRAMES_CAPTURED);
+        #[cfg(feature = "instrument")]
+        self.clock.observe(
+            self.backend
+                .get_format(&frame, FrameType::DepthFrame)
+                .timestamp,
+        );
         Ok(ArducamFrameBuffer {
-            marker: PhantomData,
-            inner,
-            camera: self.inner,
+            backend: &self.backend,
+            frame: ManuallyDrop::new(frame),
         })
     }
 }
 
-impl Drop for ArducamDepthCamera {
+impl<B: CameraBackend> Drop for ArducamDepthCamera<B> {
     fn drop(&mut self) {
         if self.started {
             self.stop().unwrap();
@@ -147,80 +214,57 @@ impl Drop for ArducamDepthCamera {
     }
 }
 
-pub struct ArducamFrameBuffer<'a> {
-    marker: PhantomData<&'a ()>,
-    inner: NonNull<std::ffi::c_void>,
-    camera: NonNull<std::ffi::c_void>,
+pub struct ArducamFrameBuffer<'a, B: CameraBackend = SdkBackend> {
+    backend: &'a B,
+    frame: ManuallyDrop<B::Frame>,
 }
 
-impl<'a> ArducamFrameBuffer<'a> {
+impl<'a, B: CameraBackend> ArducamFrameBuffer<'a, B> {
     pub fn get_format(&self, frame_type: FrameType) -> ArducamFrameFormat {
-        let format = unsafe { raw::arducamCameraGetFormat(self.inner.as_ptr(), frame_type.into()) };
-        ArducamFrameFormat {
-            width: format.width,
-            height: format.height,
-            frame_type: format.type_.try_into().unwrap(),
-            timestamp: format.timestamp,
-        }
+        self.backend.get_format(&self.frame, frame_type)
     }
 
     pub fn get_depth_data<'b>(&'b self) -> FrameData<'b, f32> {
-        let data = unsafe { raw::arducamCameraGetDepthData(self.inner.as_ptr()) };
-
-        if data.is_null() {
-            panic!("Got null pointer from arducamCameraGetDepthData");
-        }
-
-        let format = self.get_format(FrameType::DepthFrame);
-
-        FrameData {
-            width: format.width,
-            height: format.height,
-            data: unsafe {
-                std::slice::from_raw_parts(
-                    data as *mut f32,
-                    format.width as usize * format.height as usize,
-                )
-            },
-        }
+        self.backend.get_depth_data(&self.frame)
     }
 
     pub fn get_confidence_data<'b>(&'b self) -> FrameData<'b, f32> {
-        let data = unsafe { raw::arducamCameraGetAmplitudeData(self.inner.as_ptr()) }; // 0.1.3 called confidence amplitude
+        self.backend.get_confidence_data(&self.frame)
+    }
 
-        if data.is_null() {
-            panic!("Got null pointer from arducamCameraGetAmplitudeData");
-        }
+    /// Get the phase measurement of a frame from a camera started in [FrameType::RawFrame]
+    /// mode. See [phase::PhaseDecoder] for turning these into depth.
+    pub fn get_raw_data<'b>(&'b self) -> FrameData<'b, i16> {
+        self.backend.get_raw_data(&self.frame)
+    }
 
-        let format = self.get_format(FrameType::ConfidenceFrame);
-
-        FrameData {
-            width: format.width,
-            height: format.height,
-            data: unsafe {
-                std::slice::from_raw_parts(
-                    data as *mut f32,
-                    format.width as usize * format.height as usize,
-                )
-            },
-        }
+    /// Copy the depth and confidence data into a buffer from `pool` and release this frame
+    /// back to the camera, whether or not the copy succeeded.
+    pub fn into_owned(self, pool: &FramePool) -> Result<OwnedFrame, OwnedFrameError> {
+        pool.copy_frame(
+            self.get_format(FrameType::DepthFrame),
+            &self.get_depth_data(),
+            &self.get_confidence_data(),
+        )
     }
 }
 
-impl<'a> Drop for ArducamFrameBuffer<'a> {
+impl<'a, B: CameraBackend> Drop for ArducamFrameBuffer<'a, B> {
     fn drop(&mut self) {
-        let status =
-            unsafe { raw::arducamCameraReleaseFrame(self.camera.as_ptr(), self.inner.as_ptr()) };
-        if status != 0 {
-            panic!("Failed to release camera frame, got status: {status}");
+        instrument_span!(ReleaseFrame);
+        let frame = unsafe { ManuallyDrop::take(&mut self.frame) };
+        if let Err(error) = self.backend.release_frame(frame) {
+            metrics_count!(RELEASE_ERRORS);
+            panic!("{error}");
         }
     }
 }
 
 /// A row-major frame buffer reference.
 ///
-/// Created by calling [ArducamFrameBuffer::get_depth_data] or [ArducamFrameBuffer::get_confidence_data],
-/// this type references frame data that is still owned by [ArducamFrameBuffer]
+/// Created by calling [ArducamFrameBuffer::get_depth_data], [ArducamFrameBuffer::get_confidence_data]
+/// or [ArducamFrameBuffer::get_raw_data], this type references frame data that is still owned by
+/// [ArducamFrameBuffer]
 pub struct FrameData<'a, T> {
     width: u16,
     height: u16,
@@ -228,6 +272,21 @@ pub struct FrameData<'a, T> {
 }
 
 impl<'a, T: Copy> FrameData<'a, T> {
+    /// Wrap a row-major slice of `width`x`height` pixels, e.g. one kept from an earlier frame.
+    ///
+    /// Panics if `data` is not exactly `width * height` long.
+    pub fn new(width: u16, height: u16, data: &'a [T]) -> Self {
+        assert!(
+            data.len() == width as usize * height as usize,
+            "Frame data length does not match its dimensions"
+        );
+        Self {
+            width,
+            height,
+            data,
+        }
+    }
+
     /// Get the pixel value of the frame at the specified co-ordinates, or None if out of bounds.
     pub fn get(&self, x: u16, y: u16) -> Option<T> {
         self.data
@@ -309,7 +368,7 @@ macro_rules! make_enum_from_c {
 }
 
 make_enum_from_c! {
-    #[derive(Debug)]
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
     pub enum FrameType: raw::ArducamFrameType {
         RawFrame => raw::ArducamFrameType_RAW_FRAME,
         ConfidenceFrame => raw::ArducamFrameType_AMPLITUDE_FRAME, // 0.1.3 called confidence amplitude
@@ -322,7 +381,7 @@ make_enum_from_c! {
 }
 
 make_enum_from_c! {
-    #[derive(Debug)]
+    #[derive(Debug, Clone, Copy, PartialEq, Eq)]
     pub enum Connection: raw::ArducamCameraConn {
         CSI => raw::ArducamCameraConn_CSI,
         USB => raw::ArducamCameraConn_USB,
@@ -356,6 +415,7 @@ make_enum_from_c! {
 //     pub bpp: u32,
 // }
 
+#[derive(Debug, Clone, Copy)]
 pub struct ArducamFrameFormat {
     pub width: u16,
     pub height: u16,
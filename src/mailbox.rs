@@ -0,0 +1,172 @@
+//! A single-slot, latest-wins channel for handing frames between threads.
+//!
+//! Unlike [std::sync::mpsc::channel], a mailbox never queues: sending replaces any value the
+//! receiver has not picked up yet, so a slow consumer always gets the newest frame and memory use
+//! stays flat. Replaced values are counted as dropped and handed back to the sender for reuse,
+//! and the receiver can hand values it has finished with back the same way, so frames can
+//! circulate between the two threads without allocating. Both operations are a single atomic
+//! pointer swap.
+
+use std::{
+    ptr::null_mut,
+    sync::{
+        atomic::{AtomicBool, AtomicPtr, AtomicU64, Ordering},
+        mpsc::{SendError, TryRecvError},
+        Arc,
+    },
+};
+
+/// Create a connected sender and receiver
+pub fn mailbox<T>() -> (MailboxSender<T>, MailboxReceiver<T>) {
+    let shared = Arc::new(Shared {
+        slot: AtomicPtr::new(null_mut()),
+        spare: AtomicPtr::new(null_mut()),
+        sent: AtomicU64::new(0),
+        dropped: AtomicU64::new(0),
+        sender_alive: AtomicBool::new(true),
+        receiver_alive: AtomicBool::new(true),
+    });
+
+    (
+        MailboxSender {
+            shared: shared.clone(),
+        },
+        MailboxReceiver { shared },
+    )
+}
+
+struct Shared<T> {
+    /// The newest value not yet received, or null
+    slot: AtomicPtr<T>,
+    /// A value the receiver has finished with, waiting to be reused by the sender, or null
+    spare: AtomicPtr<T>,
+    sent: AtomicU64,
+    dropped: AtomicU64,
+    sender_alive: AtomicBool,
+    receiver_alive: AtomicBool,
+}
+
+// Values are only ever owned by one side at a time, passing through the atomic pointers.
+unsafe impl<T: Send> Send for Shared<T> {}
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+fn into_ptr<T>(value: Option<Box<T>>) -> *mut T {
+    value.map_or(null_mut(), Box::into_raw)
+}
+
+/// Take ownership of a pointer previously produced by [into_ptr]
+unsafe fn from_ptr<T>(ptr: *mut T) -> Option<Box<T>> {
+    (!ptr.is_null()).then(|| Box::from_raw(ptr))
+}
+
+impl<T> Shared<T> {
+    fn swap_slot(&self, value: Option<Box<T>>) -> Option<Box<T>> {
+        unsafe { from_ptr(self.slot.swap(into_ptr(value), Ordering::AcqRel)) }
+    }
+
+    fn swap_spare(&self, value: Option<Box<T>>) -> Option<Box<T>> {
+        unsafe { from_ptr(self.spare.swap(into_ptr(value), Ordering::AcqRel)) }
+    }
+
+    fn stats(&self) -> MailboxStats {
+        MailboxStats {
+            sent: self.sent.load(Ordering::Relaxed),
+            dropped: self.dropped.load(Ordering::Relaxed),
+        }
+    }
+}
+
+impl<T> Drop for Shared<T> {
+    fn drop(&mut self) {
+        self.swap_slot(None);
+        self.swap_spare(None);
+    }
+}
+
+/// Counters shared by both ends of a mailbox
+#[derive(Debug, Clone, Copy)]
+pub struct MailboxStats {
+    /// Values sent
+    pub sent: u64,
+    /// Values replaced by a newer one before they were received
+    pub dropped: u64,
+}
+
+pub struct MailboxSender<T> {
+    shared: Arc<Shared<T>>,
+}
+
+impl<T> MailboxSender<T> {
+    /// Put `value` in the mailbox, replacing any value the receiver has not taken yet.
+    ///
+    /// The replaced value, if any, is counted as dropped and returned so it can be reused.
+    /// Fails if the receiver has been dropped.
+    pub fn send(&self, value: Box<T>) -> Result<Option<Box<T>>, SendError<Box<T>>> {
+        if !self.shared.receiver_alive.load(Ordering::Acquire) {
+            return Err(SendError(value));
+        }
+
+        self.shared.sent.fetch_add(1, Ordering::Relaxed);
+        let replaced = self.shared.swap_slot(Some(value));
+        if replaced.is_some() {
+            self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+        Ok(replaced)
+    }
+
+    /// Take back a value the receiver passed to [MailboxReceiver::recycle], if there is one.
+    pub fn recycled(&self) -> Option<Box<T>> {
+        self.shared.swap_spare(None)
+    }
+
+    pub fn stats(&self) -> MailboxStats {
+        self.shared.stats()
+    }
+}
+
+impl<T> Drop for MailboxSender<T> {
+    fn drop(&mut self) {
+        self.shared.sender_alive.store(false, Ordering::Release);
+    }
+}
+
+pub struct MailboxReceiver<T> {
+    shared: Arc<Shared<T>>,
+}
+
+impl<T> MailboxReceiver<T> {
+    /// Take the newest value, if one has been sent since the last call.
+    ///
+    /// Returns [TryRecvError::Disconnected] once the sender has been dropped and its last value
+    /// has been taken.
+    pub fn try_recv(&self) -> Result<Box<T>, TryRecvError> {
+        if let Some(value) = self.shared.swap_slot(None) {
+            return Ok(value);
+        }
+
+        if self.shared.sender_alive.load(Ordering::Acquire) {
+            return Err(TryRecvError::Empty);
+        }
+
+        // The sender may have sent a last value just before going away
+        self.shared
+            .swap_slot(None)
+            .ok_or(TryRecvError::Disconnected)
+    }
+
+    /// Hand a value back to the sender to be reused for a later value. If the sender has not
+    /// collected the previously recycled value, that one is dropped.
+    pub fn recycle(&self, value: Box<T>) {
+        self.shared.swap_spare(Some(value));
+    }
+
+    pub fn stats(&self) -> MailboxStats {
+        self.shared.stats()
+    }
+}
+
+impl<T> Drop for MailboxReceiver<T> {
+    fn drop(&mut self) {
+        self.shared.receiver_alive.store(false, Ordering::Release);
+    }
+}
@@ -0,0 +1,257 @@
+//! Packed per-pixel validity flags.
+//!
+//! A [ValidityMask] travels alongside a frame's planes to say which pixels later stages should
+//! use. [ThresholdFilter] builds one from depth and confidence limits in a single vectorised
+//! pass, [FlyingPixelFilter](crate::outlier::FlyingPixelFilter) narrows it down further, and
+//! [PointCloudProjector::project_compact](crate::PointCloudProjector::project_compact) and
+//! [FrameEncoder::encode_masked](crate::wire::FrameEncoder::encode_masked) skip the pixels it
+//! rules out.
+
+use crate::{
+    projection::FrameSizeMismatch,
+    simd::{self, Kernel, ThresholdInput, MASK_BITS},
+    FrameData,
+};
+
+/// One bit per pixel of a frame, set for pixels that later stages should use.
+///
+/// Bit `i % 64` of word `i / 64` belongs to pixel `i` in row-major order, so whole words of
+/// invalid pixels can be skipped at once. Bits past the last pixel are always clear.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct ValidityMask {
+    width: u16,
+    height: u16,
+    words: Vec<u64>,
+}
+
+impl ValidityMask {
+    /// A mask for `width`x`height` frames with every pixel invalid
+    pub fn new(width: u16, height: u16) -> Self {
+        let mut mask = Self::default();
+        mask.resize(width, height);
+        mask
+    }
+
+    /// A mask for `width`x`height` frames with every pixel valid
+    pub fn all_valid(width: u16, height: u16) -> Self {
+        let mut mask = Self::new(width, height);
+        mask.fill_valid();
+        mask
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    /// The number of pixels, valid or not
+    pub fn len(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Whether pixel `index` is valid
+    pub fn is_valid(&self, index: usize) -> bool {
+        self.words[index / MASK_BITS] & (1 << (index % MASK_BITS)) != 0
+    }
+
+    /// Mark pixel `index` as valid or invalid
+    pub fn set(&mut self, index: usize, valid: bool) {
+        assert!(index < self.len(), "Pixel index out of bounds");
+        let bit = 1 << (index % MASK_BITS);
+        if valid {
+            self.words[index / MASK_BITS] |= bit;
+        } else {
+            self.words[index / MASK_BITS] &= !bit;
+        }
+    }
+
+    /// The number of valid pixels
+    pub fn count_valid(&self) -> usize {
+        self.words
+            .iter()
+            .map(|word| word.count_ones() as usize)
+            .sum()
+    }
+
+    /// The packed bits, one word per 64 pixels
+    pub fn words(&self) -> &[u64] {
+        &self.words
+    }
+
+    /// Keep only the pixels valid in both this mask and `other`.
+    ///
+    /// Panics if the masks are for different frame sizes.
+    pub fn intersect(&mut self, other: &ValidityMask) {
+        assert!(
+            self.width == other.width && self.height == other.height,
+            "Validity masks are for different frame sizes"
+        );
+        for (word, &other) in self.words.iter_mut().zip(&other.words) {
+            *word &= other;
+        }
+    }
+
+    /// The indices of the valid pixels in ascending order
+    pub fn iter_valid(&self) -> ValidIndices<'_> {
+        ValidIndices {
+            words: &self.words,
+            word_index: 0,
+            bits: self.words.first().copied().unwrap_or(0),
+        }
+    }
+
+    /// Replace the contents of `indices` with the indices of the valid pixels in ascending
+    /// order, so data for just those pixels can be gathered without testing every bit again
+    pub fn compact_indices(&self, indices: &mut Vec<u32>) {
+        indices.clear();
+        indices.reserve(self.count_valid());
+        indices.extend(self.iter_valid().map(|index| index as u32));
+    }
+
+    /// Resize for `width`x`height` frames and mark every pixel invalid. This only allocates when
+    /// growing beyond the largest size so far.
+    pub(crate) fn resize(&mut self, width: u16, height: u16) {
+        self.width = width;
+        self.height = height;
+        self.words.clear();
+        self.words.resize(self.len().div_ceil(MASK_BITS), 0);
+    }
+
+    /// Mark every pixel valid, leaving the bits past the last pixel clear
+    pub(crate) fn fill_valid(&mut self) {
+        self.words.fill(u64::MAX);
+        let tail = self.len() % MASK_BITS;
+        if let (Some(last), true) = (self.words.last_mut(), tail != 0) {
+            *last = (1 << tail) - 1;
+        }
+    }
+
+    pub(crate) fn words_mut(&mut self) -> &mut [u64] {
+        &mut self.words
+    }
+
+    pub(crate) fn check_size<T: Copy>(
+        &self,
+        frame: &FrameData<T>,
+    ) -> Result<(), FrameSizeMismatch> {
+        if frame.width() == self.width && frame.height() == self.height {
+            Ok(())
+        } else {
+            Err(FrameSizeMismatch {
+                width: frame.width(),
+                height: frame.height(),
+                expected_width: self.width,
+                expected_height: self.height,
+            })
+        }
+    }
+}
+
+/// Iterator over the indices of the valid pixels of a [ValidityMask], from
+/// [ValidityMask::iter_valid]. Words with no valid pixels cost a single comparison.
+pub struct ValidIndices<'a> {
+    words: &'a [u64],
+    word_index: usize,
+    /// The bits of the current word not yet returned
+    bits: u64,
+}
+
+impl Iterator for ValidIndices<'_> {
+    type Item = usize;
+
+    fn next(&mut self) -> Option<usize> {
+        while self.bits == 0 {
+            self.word_index += 1;
+            self.bits = *self.words.get(self.word_index)?;
+        }
+
+        let index = self.word_index * MASK_BITS + self.bits.trailing_zeros() as usize;
+        self.bits &= self.bits - 1;
+        Some(index)
+    }
+}
+
+/// Marks the pixels whose depth is within a range and whose confidence is above a threshold
+#[derive(Debug, Clone)]
+pub struct ThresholdFilter {
+    pub(crate) min_depth: f32,
+    pub(crate) max_depth: f32,
+    pub(crate) min_confidence: f32,
+    kernel: Kernel,
+}
+
+impl Default for ThresholdFilter {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl ThresholdFilter {
+    /// By default every pixel with a positive depth passes.
+    pub fn new() -> Self {
+        Self {
+            min_depth: 0.0,
+            max_depth: f32::INFINITY,
+            min_confidence: f32::NEG_INFINITY,
+            kernel: Kernel::detect(),
+        }
+    }
+
+    /// Only pass depths from `min_depth` to `max_depth` metres inclusive. If `min_depth` is
+    /// greater than `max_depth` nothing passes.
+    pub fn with_depth_range(mut self, min_depth: f32, max_depth: f32) -> Self {
+        self.min_depth = min_depth;
+        self.max_depth = max_depth;
+        self
+    }
+
+    /// Only pass pixels with a confidence of at least `min_confidence`
+    pub fn with_min_confidence(mut self, min_confidence: f32) -> Self {
+        self.min_confidence = min_confidence;
+        self
+    }
+
+    /// Use `kernel` instead of the fastest one the CPU supports, e.g. to compare them.
+    ///
+    /// Panics if the CPU does not support `kernel`.
+    pub fn with_kernel(mut self, kernel: Kernel) -> Self {
+        assert!(
+            kernel.is_supported(),
+            "{kernel:?} is not supported on this CPU"
+        );
+        self.kernel = kernel;
+        self
+    }
+
+    pub fn kernel(&self) -> Kernel {
+        self.kernel
+    }
+
+    /// Mark the pixels that pass in `mask`, resizing it to the frame
+    pub fn apply(
+        &self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: &mut ValidityMask,
+    ) -> Result<(), FrameSizeMismatch> {
+        mask.resize(depth.width(), depth.height());
+        mask.check_size(confidence)?;
+
+        let input = ThresholdInput {
+            depth: depth.as_slice(),
+            confidence: confidence.as_slice(),
+            min_depth: self.min_depth,
+            max_depth: self.max_depth,
+            min_confidence: self.min_confidence,
+        };
+        simd::threshold(self.kernel, &input, mask.words_mut());
+        Ok(())
+    }
+}
@@ -0,0 +1,324 @@
+//! A Prometheus endpoint for the capture path, enabled by the `metrics` feature.
+//!
+//! With the feature enabled, [ArducamDepthCamera](crate::ArducamDepthCamera) and the capture
+//! helpers count the frames they capture, drop and fail on in process-wide atomic [Counters].
+//! [MetricsServer] serves these, together with the per-stage latencies from
+//! [instrument](crate::instrument), in the Prometheus text format over HTTP on a local TCP or
+//! Unix socket, from a thread of its own. Scraping only reads the counters, so the capture path
+//! never waits on it.
+//!
+//! The metrics served are:
+//!
+//! - `arducam_tof_frames_captured_total`: frames requested from the camera successfully
+//! - `arducam_tof_frames_dropped_total`: frames discarded by a [CaptureEngine] or [FrameStream]
+//!   because the consumer fell behind
+//! - `arducam_tof_request_errors_total`: failed or timed out frame requests
+//! - `arducam_tof_release_errors_total`: frames the camera failed to take back
+//! - `arducam_tof_stage_latency_seconds`: a summary of each [Stage](crate::instrument::Stage),
+//!   with the median, 99th and 99.9th percentiles
+//!
+//! There is no frame rate gauge, as any rate kept between scrapes would be split between every
+//! scraper. Take it from the counter instead, e.g. `rate(arducam_tof_frames_captured_total[1m])`.
+//!
+//! [CaptureEngine]: crate::capture::CaptureEngine
+//! [FrameStream]: crate::stream::FrameStream
+
+use std::{
+    fmt::Write as _,
+    io::{self, Read, Write},
+    net::{SocketAddr, TcpListener, TcpStream, ToSocketAddrs},
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc,
+    },
+    thread::JoinHandle,
+    time::Duration,
+};
+#[cfg(unix)]
+use std::{
+    os::unix::{
+        fs::FileTypeExt,
+        net::{UnixListener, UnixStream},
+    },
+    path::{Path, PathBuf},
+};
+
+use crate::instrument;
+
+pub(crate) static FRAMES_CAPTURED: AtomicU64 = AtomicU64::new(0);
+pub(crate) static FRAMES_DROPPED: AtomicU64 = AtomicU64::new(0);
+pub(crate) static REQUEST_ERRORS: AtomicU64 = AtomicU64::new(0);
+pub(crate) static RELEASE_ERRORS: AtomicU64 = AtomicU64::new(0);
+
+/// How long the server thread waits for a connection before checking whether it should stop
+const POLL_INTERVAL: Duration = Duration::from_millis(50);
+/// How long a client gets to send its request and read the response
+const CLIENT_TIMEOUT: Duration = Duration::from_secs(1);
+/// Requests larger than this are cut off, as a scrape needs nothing beyond the request line
+const MAX_REQUEST_SIZE: usize = 8192;
+
+/// The process-wide counters, see the [module docs](self)
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct Counters {
+    pub frames_captured: u64,
+    pub frames_dropped: u64,
+    pub request_errors: u64,
+    pub release_errors: u64,
+}
+
+/// Read the counters as they are now
+pub fn counters() -> Counters {
+    Counters {
+        frames_captured: FRAMES_CAPTURED.load(Ordering::Relaxed),
+        frames_dropped: FRAMES_DROPPED.load(Ordering::Relaxed),
+        request_errors: REQUEST_ERRORS.load(Ordering::Relaxed),
+        release_errors: RELEASE_ERRORS.load(Ordering::Relaxed),
+    }
+}
+
+/// Every metric in the Prometheus text format, as served by [MetricsServer], for serving some
+/// other way
+pub fn render() -> String {
+    let mut text = String::new();
+    let counters = counters();
+    // Writing to a String can't fail
+    let mut metric = |name: &str, kind: &str, help: &str, value: &dyn std::fmt::Display| {
+        writeln!(text, "# HELP arducam_tof_{name} {help}").unwrap();
+        writeln!(text, "# TYPE arducam_tof_{name} {kind}").unwrap();
+        writeln!(text, "arducam_tof_{name} {value}").unwrap();
+    };
+    metric(
+        "frames_captured_total",
+        "counter",
+        "Frames requested from the camera successfully.",
+        &counters.frames_captured,
+    );
+    metric(
+        "frames_dropped_total",
+        "counter",
+        "Frames discarded because the consumer fell behind.",
+        &counters.frames_dropped,
+    );
+    metric(
+        "request_errors_total",
+        "counter",
+        "Frame requests that failed or timed out.",
+        &counters.request_errors,
+    );
+    metric(
+        "release_errors_total",
+        "counter",
+        "Frames the camera failed to take back.",
+        &counters.release_errors,
+    );
+
+    let name = "arducam_tof_stage_latency_seconds";
+    writeln!(
+        text,
+        "# HELP {name} Time spent in each stage of the pipeline."
+    )
+    .unwrap();
+    writeln!(text, "# TYPE {name} summary").unwrap();
+    for (stage, latency) in instrument::snapshot().iter() {
+        let stage = stage.name();
+        let quantiles = [
+            ("0.5", latency.p50),
+            ("0.99", latency.p99),
+            ("0.999", latency.p999),
+        ];
+        for (quantile, value) in quantiles {
+            // Prometheus expects NaN for the quantiles of nothing
+            let value = match latency.count {
+                0 => f64::NAN,
+                _ => value.as_secs_f64(),
+            };
+            writeln!(
+                text,
+                "{name}{{stage=\"{stage}\",quantile=\"{quantile}\"}} {value}"
+            )
+            .unwrap();
+        }
+        let sum = latency.sum.as_secs_f64();
+        writeln!(text, "{name}_sum{{stage=\"{stage}\"}} {sum}").unwrap();
+        writeln!(text, "{name}_count{{stage=\"{stage}\"}} {}", latency.count).unwrap();
+    }
+    text
+}
+
+/// Serves the metrics over HTTP from a thread of its own until dropped
+pub struct MetricsServer {
+    stop: Arc<AtomicBool>,
+    thread: Option<JoinHandle<()>>,
+    local_addr: Option<SocketAddr>,
+}
+
+impl MetricsServer {
+    /// Serve on a TCP socket bound to `address`, e.g. `127.0.0.1:9464`
+    pub fn serve_tcp(address: impl ToSocketAddrs) -> io::Result<Self> {
+        let listener = TcpListener::bind(address)?;
+        let local_addr = listener.local_addr()?;
+        listener.set_nonblocking(true)?;
+        let mut server = Self::spawn(Listener::Tcp(listener))?;
+        server.local_addr = Some(local_addr);
+        Ok(server)
+    }
+
+    /// Serve on a Unix socket at `path`, replacing any socket left there by an earlier process.
+    /// The socket is removed again when the server is dropped.
+    #[cfg(unix)]
+    pub fn serve_unix(path: impl AsRef<Path>) -> io::Result<Self> {
+        let path = path.as_ref();
+        match std::fs::symlink_metadata(path) {
+            Ok(metadata) if metadata.file_type().is_socket() => std::fs::remove_file(path)?,
+            _ => (),
+        }
+        let listener = UnixListener::bind(path)?;
+        listener.set_nonblocking(true)?;
+        Self::spawn(Listener::Unix(listener, path.to_owned()))
+    }
+
+    fn spawn(listener: Listener) -> io::Result<Self> {
+        let stop = Arc::new(AtomicBool::new(false));
+        let thread_stop = stop.clone();
+        let thread = std::thread::Builder::new()
+            .name("arducam-tof-metrics".into())
+            .spawn(move || serve(listener, &thread_stop))?;
+
+        Ok(Self {
+            stop,
+            thread: Some(thread),
+            local_addr: None,
+        })
+    }
+
+    /// The address a TCP server is listening on, e.g. to find the port picked for port 0
+    pub fn local_addr(&self) -> Option<SocketAddr> {
+        self.local_addr
+    }
+}
+
+impl Drop for MetricsServer {
+    fn drop(&mut self) {
+        self.stop.store(true, Ordering::Relaxed);
+        if let Some(thread) = self.thread.take() {
+            thread.join().expect("Metrics thread panicked");
+        }
+    }
+}
+
+enum Listener {
+    Tcp(TcpListener),
+    #[cfg(unix)]
+    Unix(UnixListener, PathBuf),
+}
+
+impl Listener {
+    /// A blocking connection with timeouts set, or None if nobody is waiting to connect
+    fn accept(&self) -> io::Result<Option<Box<dyn Connection>>> {
+        let connection: Box<dyn Connection> = match self {
+            Listener::Tcp(listener) => match pending(listener.accept())? {
+                Some((stream, _)) => Box::new(stream),
+                None => return Ok(None),
+            },
+            #[cfg(unix)]
+            Listener::Unix(listener, _) => match pending(listener.accept())? {
+                Some((stream, _)) => Box::new(stream),
+                None => return Ok(None),
+            },
+        };
+        connection.prepare()?;
+        Ok(Some(connection))
+    }
+}
+
+/// The result of a non-blocking accept, or None if there was nothing to accept
+fn pending<T>(result: io::Result<T>) -> io::Result<Option<T>> {
+    match result {
+        Ok(accepted) => Ok(Some(accepted)),
+        Err(error) if error.kind() == io::ErrorKind::WouldBlock => Ok(None),
+        Err(error) => Err(error),
+    }
+}
+
+#[cfg(unix)]
+impl Drop for Listener {
+    fn drop(&mut self) {
+        if let Listener::Unix(_, path) = self {
+            let _ = std::fs::remove_file(path);
+        }
+    }
+}
+
+trait Connection: Read + Write {
+    /// Make the connection blocking, with the timeouts for a client
+    fn prepare(&self) -> io::Result<()>;
+}
+
+impl Connection for TcpStream {
+    fn prepare(&self) -> io::Result<()> {
+        self.set_nonblocking(false)?;
+        self.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+        self.set_write_timeout(Some(CLIENT_TIMEOUT))
+    }
+}
+
+#[cfg(unix)]
+impl Connection for UnixStream {
+    fn prepare(&self) -> io::Result<()> {
+        self.set_nonblocking(false)?;
+        self.set_read_timeout(Some(CLIENT_TIMEOUT))?;
+        self.set_write_timeout(Some(CLIENT_TIMEOUT))
+    }
+}
+
+fn serve(listener: Listener, stop: &AtomicBool) {
+    let mut request = Vec::new();
+
+    while !stop.load(Ordering::Relaxed) {
+        match listener.accept() {
+            Ok(Some(mut connection)) => {
+                // A client that goes away or misbehaves only affects its own scrape
+                let _ = respond(&mut *connection, &mut request);
+            }
+            Ok(None) => std::thread::sleep(POLL_INTERVAL),
+            // Errors such as running out of file descriptors may pass, so keep serving
+            Err(_) => std::thread::sleep(POLL_INTERVAL),
+        }
+    }
+}
+
+/// Read one HTTP request from `connection` and answer it
+fn respond(connection: &mut dyn Connection, request: &mut Vec<u8>) -> io::Result<()> {
+    request.clear();
+    let mut chunk = [0; 1024];
+    while !request.windows(4).any(|window| window == b"\r\n\r\n") {
+        let read = connection.read(&mut chunk)?;
+        if read == 0 || request.len() >= MAX_REQUEST_SIZE {
+            break;
+        }
+        request.extend_from_slice(&chunk[..read]);
+    }
+
+    let request_line = request
+        .split(|&byte| byte == b'\r')
+        .next()
+        .unwrap_or_default();
+    let mut parts = request_line.split(|&byte| byte == b' ');
+    let (status, body) = match (parts.next(), parts.next()) {
+        (Some(b"GET"), Some(b"/" | b"/metrics")) => ("200 OK", render()),
+        (Some(b"GET"), _) => ("404 Not Found", String::new()),
+        _ => ("405 Method Not Allowed", String::new()),
+    };
+
+    write!(
+        connection,
+        "HTTP/1.1 {status}\r\n\
+         Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n\
+         Content-Length: {}\r\n\
+         Connection: close\r\n\
+         \r\n\
+         {body}",
+        body.len()
+    )?;
+    connection.flush()
+}
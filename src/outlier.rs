@@ -0,0 +1,150 @@
+//! Flagging flying pixels and other unreliable depth measurements.
+//!
+//! A pixel that straddles the edge of an object receives light from both the object and the
+//! surface behind it, and the sensor reports a depth somewhere in between. These "flying
+//! pixels" form a fringe of points floating in empty space around every object. Light that
+//! reaches a pixel by more than one path (multipath) causes similar errors near corners and
+//! edges, and both come with a weaker signal than a clean measurement.
+//!
+//! [FlyingPixelFilter] marks the pixels that survive in a [ValidityMask] rather than altering
+//! the depth, so the points it rejects can be skipped without a copy.
+
+use crate::{mask::ValidityMask, projection::FrameSizeMismatch, simd::MASK_BITS, FrameData};
+
+/// Offsets of the neighbours on either side of a pixel, horizontally, vertically and along
+/// both diagonals, as (column, row)
+const OPPOSITE_NEIGHBOURS: [[(isize, isize); 2]; 4] = [
+    [(-1, 0), (1, 0)],
+    [(0, -1), (0, 1)],
+    [(-1, -1), (1, 1)],
+    [(1, -1), (-1, 1)],
+];
+
+/// Rejects pixels with a low confidence, pixels lying between two surfaces at different depths,
+/// and pixels on the edge of a surface without a strong enough signal to be trusted
+#[derive(Debug, Clone)]
+pub struct FlyingPixelFilter {
+    min_confidence: f32,
+    edge_confidence: f32,
+    max_jump: f32,
+}
+
+impl Default for FlyingPixelFilter {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FlyingPixelFilter {
+    /// By default pixels need a confidence of 30, or 60 next to a change in depth of more than
+    /// 5%.
+    pub fn new() -> Self {
+        Self {
+            min_confidence: 30.0,
+            edge_confidence: 60.0,
+            max_jump: 0.05,
+        }
+    }
+
+    /// Reject every pixel with a confidence below `min_confidence`
+    pub fn with_min_confidence(mut self, min_confidence: f32) -> Self {
+        self.min_confidence = min_confidence;
+        self
+    }
+
+    /// Reject pixels next to a discontinuity with a confidence below `edge_confidence`
+    pub fn with_edge_confidence(mut self, edge_confidence: f32) -> Self {
+        self.edge_confidence = edge_confidence;
+        self
+    }
+
+    /// Treat neighbours whose depth differs by more than `max_jump` times a pixel's own depth
+    /// as a discontinuity, as the noise in depth grows with distance
+    pub fn with_max_jump(mut self, max_jump: f32) -> Self {
+        assert!(max_jump > 0.0, "Maximum jump must be positive");
+        self.max_jump = max_jump;
+        self
+    }
+
+    /// Mark the pixels of `depth` that pass the filter in `mask`, resizing it to the frame.
+    ///
+    /// Pixels without a valid depth are never marked. Neighbours without a valid depth, or
+    /// outside the frame, are ignored.
+    pub fn apply(
+        &self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: &mut ValidityMask,
+    ) -> Result<(), FrameSizeMismatch> {
+        mask.resize(depth.width(), depth.height());
+        mask.fill_valid();
+        self.refine(depth, confidence, mask)
+    }
+
+    /// Clear the pixels of `mask` that fail the filter, e.g. one from a
+    /// [ThresholdFilter](crate::mask::ThresholdFilter). Pixels already invalid are not looked
+    /// at, and whole words of them are skipped at once.
+    pub fn refine(
+        &self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: &mut ValidityMask,
+    ) -> Result<(), FrameSizeMismatch> {
+        mask.check_size(depth)?;
+        mask.check_size(confidence)?;
+
+        let (width, height) = (depth.width() as isize, depth.height() as isize);
+        let (depth, confidence) = (depth.as_slice(), confidence.as_slice());
+
+        // Depth at (x, y), or 0 outside the frame
+        let depth_at = |x: isize, y: isize| {
+            if x >= 0 && x < width && y >= 0 && y < height {
+                depth[(y * width + x) as usize]
+            } else {
+                0.0
+            }
+        };
+
+        for (word_index, word) in mask.words_mut().iter_mut().enumerate() {
+            let mut bits = *word;
+            while bits != 0 {
+                let bit = bits.trailing_zeros() as usize;
+                bits &= bits - 1;
+
+                let index = word_index * MASK_BITS + bit;
+                let (x, y) = (
+                    (index % width as usize) as isize,
+                    (index / width as usize) as isize,
+                );
+                let centre = depth[index];
+                let pixel_confidence = confidence[index];
+
+                let mut valid = centre > 0.0 && pixel_confidence >= self.min_confidence;
+                if valid {
+                    let jump = centre * self.max_jump;
+                    let mut edge = false;
+                    let mut flying = false;
+                    for [(ax, ay), (bx, by)] in OPPOSITE_NEIGHBOURS {
+                        let a = depth_at(x + ax, y + ay);
+                        let b = depth_at(x + bx, y + by);
+                        // Neighbours with no depth compare as neither nearer nor farther
+                        let (a_nearer, a_farther) =
+                            (a > 0.0 && centre - a > jump, a - centre > jump);
+                        let (b_nearer, b_farther) =
+                            (b > 0.0 && centre - b > jump, b - centre > jump);
+
+                        flying |= (a_nearer && b_farther) || (a_farther && b_nearer);
+                        edge |= a_nearer || a_farther || b_nearer || b_farther;
+                    }
+                    valid = !flying && (!edge || pixel_confidence >= self.edge_confidence);
+                }
+
+                if !valid {
+                    *word &= !(1 << bit);
+                }
+            }
+        }
+
+        Ok(())
+    }
+}
@@ -0,0 +1,264 @@
+//! Reconstructing depth from raw phase frames in software.
+//!
+//! In [FrameType::RawFrame](crate::FrameType::RawFrame) mode the camera skips its own depth
+//! processing and hands out the correlation measurements behind each depth frame one at a time.
+//! The sensor samples the reflected modulated light at four phase offsets (0, 90, 180 and 270
+//! degrees), cycling through them in order, so four consecutive raw frames make up one depth
+//! frame. [PhaseDecoder] recovers from them the phase shift of the reflected light at every
+//! pixel, which is proportional to depth, and the amplitude of the reflected signal, which
+//! serves as the confidence.
+//!
+//! The camera measures at a single modulation frequency, so a phase shift is only known up to
+//! whole turns: depths beyond the [unambiguous_range] wrap around to the near end. Unwrapping
+//! needs measurements at a second frequency, which this mode does not provide, so decoded
+//! depths are always within `0..range`.
+
+use crate::{
+    projection::FrameSizeMismatch,
+    simd::{self, Kernel, PhaseInput},
+    workers::Workers,
+    FrameData,
+};
+
+/// The number of raw frames that make up one depth frame
+pub const PHASES: usize = 4;
+
+const SPEED_OF_LIGHT: f32 = 299_792_458.0;
+
+/// The depth in metres at which the phase shift wraps around, for a modulation frequency in Hz
+pub fn unambiguous_range(modulation_frequency: f32) -> f32 {
+    SPEED_OF_LIGHT / (2.0 * modulation_frequency)
+}
+
+/// Turns sets of [PHASES] raw frames into depth and amplitude frames
+pub struct PhaseDecoder {
+    width: u16,
+    height: u16,
+    /// Metres of depth per radian of phase shift
+    depth_scale: f32,
+    kernel: Kernel,
+    workers: Workers,
+    /// The raw frames stored with [PhaseDecoder::set_phase]
+    phases: [Vec<i16>; PHASES],
+}
+
+impl PhaseDecoder {
+    /// Build a decoder for `width`x`height` raw frames from a camera whose unambiguous range is
+    /// `range` metres, see [unambiguous_range].
+    pub fn new(width: u16, height: u16, range: f32) -> Self {
+        let pixel_count = width as usize * height as usize;
+        Self {
+            width,
+            height,
+            depth_scale: range / std::f32::consts::TAU,
+            kernel: Kernel::detect(),
+            workers: Workers::new(1),
+            phases: std::array::from_fn(|_| vec![0; pixel_count]),
+        }
+    }
+
+    /// Use `kernel` instead of the fastest one the CPU supports, e.g. to compare them.
+    ///
+    /// Panics if the CPU does not support `kernel`.
+    pub fn with_kernel(mut self, kernel: Kernel) -> Self {
+        assert!(
+            kernel.is_supported(),
+            "{kernel:?} is not supported on this CPU"
+        );
+        self.kernel = kernel;
+        self
+    }
+
+    /// Split each frame into `threads` parts decoded in parallel, to spread the work over spare
+    /// cores. The decoder keeps `threads - 1` threads of its own parked between frames, and the
+    /// thread decoding works on a part too.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        assert!(threads >= 1, "Phase decoder needs at least 1 thread");
+        self.workers = Workers::new(threads);
+        self
+    }
+
+    pub fn kernel(&self) -> Kernel {
+        self.kernel
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    fn pixel_count(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+
+    fn check_size(&self, frame: &FrameData<i16>) -> Result<(), FrameSizeMismatch> {
+        if frame.width() == self.width && frame.height() == self.height {
+            Ok(())
+        } else {
+            Err(FrameSizeMismatch {
+                width: frame.width(),
+                height: frame.height(),
+                expected_width: self.width,
+                expected_height: self.height,
+            })
+        }
+    }
+
+    /// Keep a copy of `raw` as the measurement at phase offset `phase` * 90 degrees, for
+    /// [PhaseDecoder::decode]. The nth raw frame after the camera is started has phase `n % 4`.
+    pub fn set_phase(
+        &mut self,
+        phase: usize,
+        raw: &FrameData<i16>,
+    ) -> Result<(), FrameSizeMismatch> {
+        self.check_size(raw)?;
+        self.phases[phase].copy_from_slice(raw.as_slice());
+        Ok(())
+    }
+
+    /// Decode the raw frames stored with [PhaseDecoder::set_phase] into `depth` in metres and
+    /// `amplitude`, each holding one value per pixel.
+    pub fn decode(&self, depth: &mut [f32], amplitude: &mut [f32]) {
+        let phases = self.phases.each_ref().map(|phase| phase.as_slice());
+        self.decode_slices(phases, depth, amplitude);
+    }
+
+    /// Decode four raw frames, in order of phase offset, into `depth` in metres and `amplitude`,
+    /// each holding one value per pixel.
+    pub fn decode_frames(
+        &self,
+        phases: [&FrameData<i16>; PHASES],
+        depth: &mut [f32],
+        amplitude: &mut [f32],
+    ) -> Result<(), FrameSizeMismatch> {
+        for phase in phases {
+            self.check_size(phase)?;
+        }
+        self.decode_slices(phases.map(|phase| phase.as_slice()), depth, amplitude);
+        Ok(())
+    }
+
+    fn decode_slices(&self, phases: [&[i16]; PHASES], depth: &mut [f32], amplitude: &mut [f32]) {
+        let pixel_count = self.pixel_count();
+        assert!(
+            depth.len() == pixel_count && amplitude.len() == pixel_count,
+            "Output buffers must hold one value per pixel"
+        );
+
+        // A multiple of a cache line of output per thread, so threads rarely share a line
+        let chunk = pixel_count
+            .div_ceil(self.workers.threads())
+            .next_multiple_of(16)
+            .max(16);
+        let outputs = depth.chunks_mut(chunk).zip(amplitude.chunks_mut(chunk));
+        self.workers
+            .for_each(outputs.enumerate(), |(index, (depth, amplitude))| {
+                let start = index * chunk;
+                let input = PhaseInput {
+                    phases: phases.map(|phase| &phase[start..start + depth.len()]),
+                    depth_scale: self.depth_scale,
+                };
+                simd::reconstruct(self.kernel, &input, depth, amplitude);
+            });
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::synthetic::{render_frame, render_raw_phase, SYNTHETIC_RANGE};
+
+    /// Odd dimensions, so no kernel's vector blocks cover the frame exactly
+    const WIDTH: u16 = 67;
+    const HEIGHT: u16 = 45;
+
+    /// Raw frames of a rendered scene, with the scene's depth and confidence
+    fn raw_scene() -> ([Vec<i16>; PHASES], Vec<f32>, Vec<f32>) {
+        let pixel_count = WIDTH as usize * HEIGHT as usize;
+        let mut depth = vec![0.0; pixel_count];
+        let mut confidence = vec![0.0; pixel_count];
+        render_frame(7, WIDTH, HEIGHT, &mut depth, &mut confidence);
+
+        let raw = std::array::from_fn(|phase| {
+            let mut raw = vec![0; pixel_count];
+            render_raw_phase(&depth, &confidence, phase, SYNTHETIC_RANGE, &mut raw);
+            raw
+        });
+        (raw, depth, confidence)
+    }
+
+    fn decode(decoder: &PhaseDecoder, raw: &[Vec<i16>; PHASES]) -> (Vec<f32>, Vec<f32>) {
+        let frames = raw.each_ref().map(|raw| FrameData::new(WIDTH, HEIGHT, raw));
+        let mut depth = vec![0.0; raw[0].len()];
+        let mut amplitude = vec![0.0; raw[0].len()];
+        decoder
+            .decode_frames(frames.each_ref(), &mut depth, &mut amplitude)
+            .unwrap();
+        (depth, amplitude)
+    }
+
+    fn bits(values: &[f32]) -> Vec<u32> {
+        values.iter().map(|value| value.to_bits()).collect()
+    }
+
+    #[test]
+    fn recovers_rendered_scene() {
+        let (raw, expected_depth, expected_confidence) = raw_scene();
+        let decoder = PhaseDecoder::new(WIDTH, HEIGHT, SYNTHETIC_RANGE).with_kernel(Kernel::Scalar);
+        let (depth, amplitude) = decode(&decoder, &raw);
+
+        let expected = expected_depth.iter().zip(&expected_confidence);
+        let decoded = depth.iter().zip(&amplitude);
+        for (index, ((&expected_depth, &confidence), (&depth, &amplitude))) in
+            expected.zip(decoded).enumerate()
+        {
+            if confidence <= 0.0 {
+                continue;
+            }
+            // Rounding the raw samples moves the phase by up to about 0.75 / amplitude radians,
+            // on top of the 2e-6 radians of the polynomial atan
+            let signal = 4.0 * confidence;
+            let tolerance = SYNTHETIC_RANGE / std::f32::consts::TAU * (0.75 / signal + 1e-5);
+            assert!(
+                (depth - expected_depth).abs() <= tolerance,
+                "Pixel {index}: depth {depth}, expected {expected_depth}"
+            );
+            assert!(
+                (amplitude - signal).abs() <= 1.0,
+                "Pixel {index}: amplitude {amplitude}, expected {signal}"
+            );
+        }
+    }
+
+    #[test]
+    fn kernels_and_threads_match_scalar() {
+        let (raw, _, _) = raw_scene();
+        let scalar = PhaseDecoder::new(WIDTH, HEIGHT, SYNTHETIC_RANGE).with_kernel(Kernel::Scalar);
+        let (scalar_depth, scalar_amplitude) = decode(&scalar, &raw);
+
+        for kernel in Kernel::supported() {
+            for threads in [1, 2, 3, 8] {
+                let decoder = PhaseDecoder::new(WIDTH, HEIGHT, SYNTHETIC_RANGE)
+                    .with_kernel(kernel)
+                    .with_threads(threads);
+                // Twice, so the second decode reuses the decoder's parked threads
+                for _ in 0..2 {
+                    let (depth, amplitude) = decode(&decoder, &raw);
+                    assert_eq!(
+                        bits(&depth),
+                        bits(&scalar_depth),
+                        "{kernel:?}, {threads} threads"
+                    );
+                    assert_eq!(
+                        bits(&amplitude),
+                        bits(&scalar_amplitude),
+                        "{kernel:?}, {threads} threads"
+                    );
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,245 @@
+//! Owned, [Send]able copies of frames backed by a fixed pool of recycled buffers.
+//!
+//! [ArducamFrameBuffer](crate::ArducamFrameBuffer) borrows the SDK's own buffer, so it has to be
+//! processed and released on the thread that requested it. [OwnedFrame] copies the depth and
+//! confidence planes into a 64-byte aligned buffer taken from a [FramePool] so the SDK frame can
+//! be released straight away, and hands the buffer back to the pool when dropped. Once the pool
+//! is created no further allocations are made.
+
+use std::{
+    alloc::Layout,
+    ptr::NonNull,
+    sync::{
+        atomic::{AtomicPtr, Ordering},
+        Arc,
+    },
+};
+
+use thiserror::Error;
+
+use crate::{ArducamFrameFormat, FrameData};
+
+/// Alignment of the start of each plane in a pooled buffer
+pub const BUFFER_ALIGN: usize = 64;
+
+#[derive(Debug, Error)]
+pub enum OwnedFrameError {
+    #[error("Frame pool has no free buffers")]
+    PoolExhausted,
+    #[error("Frame of {width}x{height} does not fit in the frame pool's buffers")]
+    TooLarge { width: u16, height: u16 },
+    #[error("Depth and confidence planes have different sizes")]
+    SizeMismatch,
+}
+
+/// A fixed number of preallocated frame buffers shared between [OwnedFrame]s
+#[derive(Clone)]
+pub struct FramePool {
+    shared: Arc<PoolShared>,
+}
+
+struct PoolShared {
+    /// Each entry holds a free buffer or is null. There are exactly as many entries as buffers,
+    /// so a buffer being returned always finds an empty entry.
+    free: Box<[AtomicPtr<f32>]>,
+    /// Number of f32s reserved for each plane, a multiple of [BUFFER_ALIGN] bytes
+    plane_stride: usize,
+    layout: Layout,
+}
+
+impl FramePool {
+    /// Allocate `capacity` buffers, each big enough for depth and confidence planes of up to
+    /// `width`x`height` pixels.
+    pub fn new(capacity: usize, width: u16, height: u16) -> Self {
+        let pixels = width as usize * height as usize;
+        assert!(capacity > 0 && pixels > 0, "Frame pool must not be empty");
+
+        let floats_per_line = BUFFER_ALIGN / size_of::<f32>();
+        let plane_stride = pixels.div_ceil(floats_per_line) * floats_per_line;
+        let layout =
+            Layout::from_size_align(plane_stride * 2 * size_of::<f32>(), BUFFER_ALIGN).unwrap();
+
+        let free = (0..capacity)
+            .map(|_| {
+                let buffer = unsafe { std::alloc::alloc_zeroed(layout) };
+                if buffer.is_null() {
+                    std::alloc::handle_alloc_error(layout);
+                }
+                AtomicPtr::new(buffer as *mut f32)
+            })
+            .collect();
+
+        Self {
+            shared: Arc::new(PoolShared {
+                free,
+                plane_stride,
+                layout,
+            }),
+        }
+    }
+
+    /// The largest number of pixels a frame from this pool can hold
+    pub fn max_pixels(&self) -> usize {
+        self.shared.plane_stride
+    }
+
+    /// The number of buffers not currently held by an [OwnedFrame]
+    pub fn available(&self) -> usize {
+        self.shared
+            .free
+            .iter()
+            .filter(|entry| !entry.load(Ordering::Relaxed).is_null())
+            .count()
+    }
+
+    /// Copy a frame's depth and confidence planes into a buffer from the pool.
+    pub fn copy_frame(
+        &self,
+        format: ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> Result<OwnedFrame, OwnedFrameError> {
+        instrument_span!(Copy);
+        let pixels = depth.as_slice().len();
+        if confidence.as_slice().len() != pixels {
+            return Err(OwnedFrameError::SizeMismatch);
+        }
+        if pixels > self.shared.plane_stride {
+            return Err(OwnedFrameError::TooLarge {
+                width: depth.width(),
+                height: depth.height(),
+            });
+        }
+
+        let buffer = self
+            .shared
+            .acquire()
+            .ok_or(OwnedFrameError::PoolExhausted)?;
+        let mut frame = OwnedFrame {
+            pool: self.shared.clone(),
+            buffer,
+            width: depth.width(),
+            height: depth.height(),
+            format,
+        };
+        frame.depth_mut().copy_from_slice(depth.as_slice());
+        frame
+            .confidence_mut()
+            .copy_from_slice(confidence.as_slice());
+        Ok(frame)
+    }
+}
+
+impl PoolShared {
+    fn acquire(&self) -> Option<NonNull<f32>> {
+        self.free.iter().find_map(|entry| {
+            if entry.load(Ordering::Relaxed).is_null() {
+                return None;
+            }
+            NonNull::new(entry.swap(std::ptr::null_mut(), Ordering::Acquire))
+        })
+    }
+
+    fn release(&self, buffer: NonNull<f32>) {
+        let returned = self.free.iter().any(|entry| {
+            entry
+                .compare_exchange(
+                    std::ptr::null_mut(),
+                    buffer.as_ptr(),
+                    Ordering::Release,
+                    Ordering::Relaxed,
+                )
+                .is_ok()
+        });
+        debug_assert!(returned, "Frame pool has more buffers than entries");
+    }
+}
+
+impl Drop for PoolShared {
+    fn drop(&mut self) {
+        for entry in self.free.iter_mut() {
+            let buffer = *entry.get_mut();
+            if !buffer.is_null() {
+                unsafe { std::alloc::dealloc(buffer as *mut u8, self.layout) };
+            }
+        }
+    }
+}
+
+/// A frame whose data lives in a buffer borrowed from a [FramePool].
+///
+/// Created by [ArducamFrameBuffer::into_owned](crate::ArducamFrameBuffer::into_owned) or
+/// [FramePool::copy_frame]. Unlike [ArducamFrameBuffer](crate::ArducamFrameBuffer) this can be
+/// sent to other threads, and the buffer goes back to the pool when it is dropped.
+pub struct OwnedFrame {
+    pool: Arc<PoolShared>,
+    buffer: NonNull<f32>,
+    width: u16,
+    height: u16,
+    format: ArducamFrameFormat,
+}
+
+// The buffer is uniquely owned by this frame until it is handed back to the pool on drop.
+unsafe impl Send for OwnedFrame {}
+unsafe impl Sync for OwnedFrame {}
+
+impl OwnedFrame {
+    fn pixel_count(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+
+    fn plane(&self, index: usize) -> &[f32] {
+        unsafe {
+            std::slice::from_raw_parts(
+                self.buffer.as_ptr().add(index * self.pool.plane_stride),
+                self.pixel_count(),
+            )
+        }
+    }
+
+    fn plane_mut(&mut self, index: usize) -> &mut [f32] {
+        unsafe {
+            std::slice::from_raw_parts_mut(
+                self.buffer.as_ptr().add(index * self.pool.plane_stride),
+                self.pixel_count(),
+            )
+        }
+    }
+
+    /// The format of the frame this was copied from
+    pub fn format(&self) -> ArducamFrameFormat {
+        self.format
+    }
+
+    pub fn get_depth_data(&self) -> FrameData<'_, f32> {
+        FrameData {
+            width: self.width,
+            height: self.height,
+            data: self.plane(0),
+        }
+    }
+
+    pub fn get_confidence_data(&self) -> FrameData<'_, f32> {
+        FrameData {
+            width: self.width,
+            height: self.height,
+            data: self.plane(1),
+        }
+    }
+
+    /// Mutable access to the row-major depth plane, 64-byte aligned
+    pub fn depth_mut(&mut self) -> &mut [f32] {
+        self.plane_mut(0)
+    }
+
+    /// Mutable access to the row-major confidence plane, 64-byte aligned
+    pub fn confidence_mut(&mut self) -> &mut [f32] {
+        self.plane_mut(1)
+    }
+}
+
+impl Drop for OwnedFrame {
+    fn drop(&mut self) {
+        self.pool.release(self.buffer);
+    }
+}
@@ -0,0 +1,354 @@
+//! Projecting depth frames into 3D points.
+//!
+//! [PointCloudProjector] precomputes the ray through every pixel once, so projecting a frame is
+//! a single multiply per component with no trigonometry, division or index arithmetic.
+//!
+//! Points use the same axes as the examples: Z is the depth reported by the sensor, X increases
+//! to the left of the image and Y increases towards the top.
+
+use thiserror::Error;
+
+use crate::{
+    binning::BinFactor,
+    intrinsics::Intrinsics,
+    mask::{ThresholdFilter, ValidityMask},
+    simd::{self, CompactInput, Kernel, ProjectionInput, MASK_BITS},
+    FrameData,
+};
+
+/// Horizontal field of view of the sensor in degrees
+pub const HORIZONTAL_FOV: f32 = 64.3;
+/// Vertical field of view of the sensor in degrees
+pub const VERTICAL_FOV: f32 = 50.4;
+
+#[derive(Debug, Error)]
+#[error("Frame is {width}x{height} but projector was built for {expected_width}x{expected_height}")]
+/// Returned when a frame does not have the dimensions a [PointCloudProjector] was built for
+pub struct FrameSizeMismatch {
+    pub width: u16,
+    pub height: u16,
+    pub expected_width: u16,
+    pub expected_height: u16,
+}
+
+/// Structure-of-arrays output of [PointCloudProjector::project_dense], holding just the points
+/// that passed its thresholds one after another. Reused between frames.
+#[derive(Default)]
+pub struct DensePoints {
+    pub(crate) x: Vec<f32>,
+    pub(crate) y: Vec<f32>,
+    pub(crate) z: Vec<f32>,
+    pub(crate) confidence: Vec<f32>,
+    len: usize,
+}
+
+impl DensePoints {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// The number of points
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    pub fn x(&self) -> &[f32] {
+        &self.x[..self.len]
+    }
+
+    pub fn y(&self) -> &[f32] {
+        &self.y[..self.len]
+    }
+
+    pub fn z(&self) -> &[f32] {
+        &self.z[..self.len]
+    }
+
+    /// The confidence of the pixel each point came from
+    pub fn confidence(&self) -> &[f32] {
+        &self.confidence[..self.len]
+    }
+
+    /// Make room for up to `pixels` points. This only allocates when growing beyond the largest
+    /// size so far.
+    fn reserve(&mut self, pixels: usize) {
+        if self.z.len() < pixels {
+            self.x.resize(pixels, 0.0);
+            self.y.resize(pixels, 0.0);
+            self.z.resize(pixels, 0.0);
+            self.confidence.resize(pixels, 0.0);
+        }
+    }
+}
+
+/// A per-pixel ray table for a fixed frame size and camera geometry
+pub struct PointCloudProjector {
+    width: u16,
+    height: u16,
+    /// X component of each pixel's ray, for a Z component of 1
+    ray_x: Vec<f32>,
+    /// Y component of each pixel's ray, for a Z component of 1
+    ray_y: Vec<f32>,
+    kernel: Kernel,
+}
+
+/// Structure-of-arrays output of [PointCloudProjector::project_soa], reused between frames
+#[derive(Default)]
+pub struct ProjectedPoints {
+    pub x: Vec<f32>,
+    pub y: Vec<f32>,
+    pub z: Vec<f32>,
+    /// Packed validity bits, one per point: bit `i % 64` of word `i / 64` is set if point `i`
+    /// has a positive depth and passed the confidence threshold.
+    pub valid: Vec<u64>,
+}
+
+impl ProjectedPoints {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// The number of points, valid or not
+    pub fn len(&self) -> usize {
+        self.z.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.z.is_empty()
+    }
+
+    /// Whether point `index` passed the depth and confidence checks
+    pub fn is_valid(&self, index: usize) -> bool {
+        self.valid[index / MASK_BITS] & (1 << (index % MASK_BITS)) != 0
+    }
+
+    /// Resize for `len` points. This only allocates when growing beyond the largest size so far.
+    fn resize(&mut self, len: usize) {
+        self.x.resize(len, 0.0);
+        self.y.resize(len, 0.0);
+        self.z.resize(len, 0.0);
+        self.valid.resize(len.div_ceil(MASK_BITS), 0);
+    }
+}
+
+impl PointCloudProjector {
+    /// Build a projector from the horizontal and vertical field of view in degrees, with the
+    /// optical centre in the middle of the frame and no distortion.
+    pub fn from_fov(width: u16, height: u16, horizontal_fov: f32, vertical_fov: f32) -> Self {
+        let intrinsics = Intrinsics::from_fov(width, height, horizontal_fov, vertical_fov);
+        Self::from_intrinsics(width, height, &intrinsics)
+    }
+
+    /// Build a projector for `width`x`height` frames from calibrated intrinsics. Lens
+    /// distortion is removed from the ray table here, so it costs nothing per frame.
+    pub fn from_intrinsics(width: u16, height: u16, intrinsics: &Intrinsics) -> Self {
+        let pixel_count = width as usize * height as usize;
+        let mut ray_x = Vec::with_capacity(pixel_count);
+        let mut ray_y = Vec::with_capacity(pixel_count);
+
+        for row in 0..height {
+            for column in 0..width {
+                let [x, y] = intrinsics.ray(column as f32, row as f32);
+                ray_x.push(x);
+                ray_y.push(y);
+            }
+        }
+
+        Self {
+            width,
+            height,
+            ray_x,
+            ray_y,
+            kernel: Kernel::detect(),
+        }
+    }
+
+    /// A projector for frames binned from this one's frame size by `factor`, e.g. with
+    /// [FrameData::bin]. Each ray is the mean of the rays of the pixels in its bin, so it passes
+    /// through the centre of the bin whatever the camera geometry.
+    pub fn binned(&self, factor: BinFactor) -> Self {
+        let size = factor.size() as usize;
+        let (width, height) = (self.width / factor.size(), self.height / factor.size());
+        let pixel_count = width as usize * height as usize;
+        let mut ray_x = Vec::with_capacity(pixel_count);
+        let mut ray_y = Vec::with_capacity(pixel_count);
+
+        let scale = 1.0 / (size * size) as f32;
+        for row in 0..height as usize {
+            for column in 0..width as usize {
+                let (mut sum_x, mut sum_y) = (0.0, 0.0);
+                for y in row * size..(row + 1) * size {
+                    let start = y * self.width as usize + column * size;
+                    sum_x += self.ray_x[start..start + size].iter().sum::<f32>();
+                    sum_y += self.ray_y[start..start + size].iter().sum::<f32>();
+                }
+                ray_x.push(sum_x * scale);
+                ray_y.push(sum_y * scale);
+            }
+        }
+
+        Self {
+            width,
+            height,
+            ray_x,
+            ray_y,
+            kernel: self.kernel,
+        }
+    }
+
+    /// Use `kernel` for [PointCloudProjector::project_soa] instead of the fastest one the CPU
+    /// supports, e.g. to compare them.
+    ///
+    /// Panics if the CPU does not support `kernel`.
+    pub fn with_kernel(mut self, kernel: Kernel) -> Self {
+        assert!(
+            kernel.is_supported(),
+            "{kernel:?} is not supported on this CPU"
+        );
+        self.kernel = kernel;
+        self
+    }
+
+    pub fn kernel(&self) -> Kernel {
+        self.kernel
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    /// The X and Y components of each pixel's ray, for a Z component of 1
+    pub(crate) fn rays(&self) -> (&[f32], &[f32]) {
+        (&self.ray_x, &self.ray_y)
+    }
+
+    pub(crate) fn check_size<T: Copy>(
+        &self,
+        frame: &FrameData<T>,
+    ) -> Result<(), FrameSizeMismatch> {
+        if frame.width() == self.width && frame.height() == self.height {
+            Ok(())
+        } else {
+            Err(FrameSizeMismatch {
+                width: frame.width(),
+                height: frame.height(),
+                expected_width: self.width,
+                expected_height: self.height,
+            })
+        }
+    }
+
+    /// Project every pixel of `depth` into `points`, which must hold one point per pixel.
+    /// Points are written in the same row-major order as the frame.
+    pub fn project(
+        &self,
+        depth: &FrameData<f32>,
+        points: &mut [[f32; 3]],
+    ) -> Result<(), FrameSizeMismatch> {
+        instrument_span!(Projection);
+        self.check_size(depth)?;
+        assert!(
+            points.len() == self.ray_x.len(),
+            "Point buffer must hold one point per pixel"
+        );
+
+        let rays = self.ray_x.iter().zip(&self.ray_y);
+        for ((point, &z), (&ray_x, &ray_y)) in points.iter_mut().zip(depth).zip(rays) {
+            *point = [ray_x * z, ray_y * z, z];
+        }
+
+        Ok(())
+    }
+
+    /// Project every pixel of `depth` into separate X, Y and Z arrays in `points`, and mark the
+    /// points with a positive depth and a confidence of at least `min_confidence` as valid.
+    ///
+    /// This runs the fastest SIMD kernel available, see [PointCloudProjector::with_kernel].
+    pub fn project_soa(
+        &self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        min_confidence: f32,
+        points: &mut ProjectedPoints,
+    ) -> Result<(), FrameSizeMismatch> {
+        instrument_span!(Projection);
+        self.check_size(depth)?;
+        self.check_size(confidence)?;
+        points.resize(self.ray_x.len());
+
+        let input = ProjectionInput {
+            ray_x: &self.ray_x,
+            ray_y: &self.ray_y,
+            depth: depth.as_slice(),
+            confidence: confidence.as_slice(),
+            min_confidence,
+        };
+        simd::project(self.kernel, &input, points);
+
+        Ok(())
+    }
+
+    /// Project only the pixels of `depth` marked valid in `mask`, replacing the contents of
+    /// `points` with them. Points are in the same order as [ValidityMask::iter_valid], so the
+    /// nth point came from the nth valid pixel.
+    pub fn project_compact(
+        &self,
+        depth: &FrameData<f32>,
+        mask: &ValidityMask,
+        points: &mut Vec<[f32; 3]>,
+    ) -> Result<(), FrameSizeMismatch> {
+        instrument_span!(Projection);
+        self.check_size(depth)?;
+        mask.check_size(depth)?;
+
+        let depth = depth.as_slice();
+        points.clear();
+        points.reserve(mask.count_valid());
+        points.extend(mask.iter_valid().map(|i| {
+            let z = depth[i];
+            [self.ray_x[i] * z, self.ray_y[i] * z, z]
+        }));
+
+        Ok(())
+    }
+
+    /// Project only the pixels of `depth` that pass `thresholds` into `points`, packed one
+    /// after another with the confidence of each, and return how many there are.
+    ///
+    /// This runs the fastest SIMD kernel available, see [PointCloudProjector::with_kernel], and
+    /// does the same job as [ThresholdFilter::apply] followed by
+    /// [PointCloudProjector::project_compact] in a single pass.
+    pub fn project_dense(
+        &self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        thresholds: &ThresholdFilter,
+        points: &mut DensePoints,
+    ) -> Result<usize, FrameSizeMismatch> {
+        instrument_span!(Projection);
+        self.check_size(depth)?;
+        self.check_size(confidence)?;
+        points.reserve(self.ray_x.len());
+
+        let input = CompactInput {
+            ray_x: &self.ray_x,
+            ray_y: &self.ray_y,
+            depth: depth.as_slice(),
+            confidence: confidence.as_slice(),
+            min_depth: thresholds.min_depth,
+            max_depth: thresholds.max_depth,
+            min_confidence: thresholds.min_confidence,
+        };
+        points.len = simd::compact(self.kernel, &input, points);
+
+        Ok(points.len)
+    }
+}
@@ -0,0 +1,591 @@
+//! Recording frames to a file and replaying them without a camera.
+//!
+//! A recording is a 64 byte [FileHeader], one record per frame and an index footer, all
+//! little-endian. Every record starts on a [RECORD_ALIGN]-byte boundary with a 64 byte
+//! record header, followed by the depth plane and the confidence plane as raw `f32`s, each padded
+//! to [RECORD_ALIGN] bytes:
+//!
+//! ```text
+//! file header | record 0 | record 1 | ... | index entries | index trailer
+//! ```
+//!
+//! [ReplayBackend] memory maps a recording and hands out planes that point straight into the
+//! mapping, so replaying costs no copies. Recordings that were not finished, e.g. because the
+//! recording process was killed, have no index; they are replayed up to the last complete record.
+
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::Path,
+    ptr::NonNull,
+    time::{Duration, Instant, SystemTime},
+};
+
+use thiserror::Error;
+
+use crate::{
+    backend::CameraBackend, ArducamFrameBuffer, ArducamFrameFormat, CloseError, Connection,
+    FrameData, FrameType, InitError, OpenError, ReleaseFrameError, RequestFrameError, StartError,
+    StopError,
+};
+
+/// The first bytes of a recording
+pub const FILE_MAGIC: [u8; 8] = *b"ATOFREC\0";
+/// The first bytes of every record
+pub const RECORD_MAGIC: [u8; 8] = *b"ATOFFRM\0";
+/// The last bytes of a finished recording
+pub const INDEX_MAGIC: [u8; 8] = *b"ATOFIDX\0";
+/// The recording format version written by [Recorder]
+pub const VERSION: u16 = 1;
+
+/// Alignment of every record and plane in the file, so planes can be read in place with
+/// aligned vector loads
+pub const RECORD_ALIGN: usize = 64;
+
+const FILE_HEADER_SIZE: usize = 64;
+const RECORD_HEADER_SIZE: usize = 64;
+const INDEX_ENTRY_SIZE: usize = 16;
+const INDEX_TRAILER_SIZE: usize = 24;
+
+#[derive(Debug, Error)]
+pub enum RecordingError {
+    #[error("I/O error: {0}")]
+    Io(#[from] std::io::Error),
+    #[error("Not a recording, bad magic: {0:?}")]
+    BadMagic([u8; 8]),
+    #[error("Unsupported recording version: {0}")]
+    UnsupportedVersion(u16),
+    #[error("Corrupt record at offset {0}")]
+    CorruptRecord(u64),
+}
+
+/// The header at the start of a recording
+#[derive(Debug, Clone, Copy)]
+pub struct FileHeader {
+    pub version: u16,
+    /// When the recording was started, in nanoseconds since the Unix epoch
+    pub created: u64,
+}
+
+impl FileHeader {
+    fn to_bytes(self) -> [u8; FILE_HEADER_SIZE] {
+        let mut bytes = [0; FILE_HEADER_SIZE];
+        bytes[0..8].copy_from_slice(&FILE_MAGIC);
+        bytes[8..10].copy_from_slice(&self.version.to_le_bytes());
+        // bytes[10..16] are reserved
+        bytes[16..24].copy_from_slice(&self.created.to_le_bytes());
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8]) -> Result<Self, RecordingError> {
+        let magic = bytes[0..8].try_into().unwrap();
+        if magic != FILE_MAGIC {
+            return Err(RecordingError::BadMagic(magic));
+        }
+
+        let version = u16::from_le_bytes(bytes[8..10].try_into().unwrap());
+        if version != VERSION {
+            return Err(RecordingError::UnsupportedVersion(version));
+        }
+
+        Ok(Self {
+            version,
+            created: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+        })
+    }
+}
+
+/// The header at the start of every record
+#[derive(Debug, Clone, Copy)]
+pub struct RecordHeader {
+    /// Position of the frame in the recording
+    pub sequence: u64,
+    pub format: ArducamFrameFormat,
+    /// When the frame was handed to the [Recorder], in nanoseconds since the recording started.
+    /// Recording straight after requesting a frame makes this its host receive time.
+    pub received: u64,
+}
+
+impl RecordHeader {
+    fn pixel_count(&self) -> usize {
+        self.format.width as usize * self.format.height as usize
+    }
+
+    /// Bytes from the start of one plane to the start of the next
+    fn plane_stride(&self) -> usize {
+        (self.pixel_count() * size_of::<f32>()).next_multiple_of(RECORD_ALIGN)
+    }
+
+    /// Size of the whole record including padding
+    fn record_len(&self) -> usize {
+        RECORD_HEADER_SIZE + 2 * self.plane_stride()
+    }
+
+    fn to_bytes(self) -> [u8; RECORD_HEADER_SIZE] {
+        let mut bytes = [0; RECORD_HEADER_SIZE];
+        bytes[0..8].copy_from_slice(&RECORD_MAGIC);
+        bytes[8..16].copy_from_slice(&self.sequence.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.format.timestamp.to_le_bytes());
+        bytes[24..32].copy_from_slice(&self.received.to_le_bytes());
+        bytes[32..34].copy_from_slice(&self.format.width.to_le_bytes());
+        bytes[34..36].copy_from_slice(&self.format.height.to_le_bytes());
+        bytes[36] = frame_type_code(self.format.frame_type);
+        // bytes[37..64] are reserved
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8], offset: u64) -> Result<Self, RecordingError> {
+        if bytes[0..8] != RECORD_MAGIC {
+            return Err(RecordingError::CorruptRecord(offset));
+        }
+
+        Ok(Self {
+            sequence: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+            format: ArducamFrameFormat {
+                timestamp: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+                width: u16::from_le_bytes(bytes[32..34].try_into().unwrap()),
+                height: u16::from_le_bytes(bytes[34..36].try_into().unwrap()),
+                frame_type: frame_type_from_code(bytes[36])
+                    .ok_or(RecordingError::CorruptRecord(offset))?,
+            },
+            received: u64::from_le_bytes(bytes[24..32].try_into().unwrap()),
+        })
+    }
+}
+
+/// The file's own frame type codes, independent of the SDK's
+pub(crate) fn frame_type_code(frame_type: FrameType) -> u8 {
+    match frame_type {
+        FrameType::RawFrame => 0,
+        FrameType::ConfidenceFrame => 1,
+        FrameType::DepthFrame => 2,
+    }
+}
+
+pub(crate) fn frame_type_from_code(code: u8) -> Option<FrameType> {
+    match code {
+        0 => Some(FrameType::RawFrame),
+        1 => Some(FrameType::ConfidenceFrame),
+        2 => Some(FrameType::DepthFrame),
+        _ => None,
+    }
+}
+
+fn plane_bytes(plane: &[f32]) -> &[u8] {
+    // The file is little-endian, as is every target this module is built for
+    unsafe { std::slice::from_raw_parts(plane.as_ptr() as *const u8, size_of_val(plane)) }
+}
+
+/// The location of a record, as stored in the index
+#[derive(Debug, Clone, Copy)]
+struct IndexEntry {
+    offset: u64,
+    received: u64,
+}
+
+/// Writes frames to a recording
+pub struct Recorder<W: Write> {
+    writer: W,
+    position: u64,
+    started_at: Instant,
+    index: Vec<IndexEntry>,
+}
+
+impl Recorder<BufWriter<File>> {
+    /// Start a recording at `path`, replacing any file already there
+    pub fn create(path: impl AsRef<Path>) -> Result<Self, RecordingError> {
+        Self::new(BufWriter::new(File::create(path)?))
+    }
+}
+
+impl<W: Write> Recorder<W> {
+    /// Start a recording by writing its header to `writer`
+    pub fn new(mut writer: W) -> Result<Self, RecordingError> {
+        let created = SystemTime::now()
+            .duration_since(SystemTime::UNIX_EPOCH)
+            .unwrap_or_default()
+            .as_nanos() as u64;
+        let header = FileHeader {
+            version: VERSION,
+            created,
+        };
+        writer.write_all(&header.to_bytes())?;
+
+        Ok(Self {
+            writer,
+            position: FILE_HEADER_SIZE as u64,
+            started_at: Instant::now(),
+            index: Vec::new(),
+        })
+    }
+
+    /// The number of frames written so far
+    pub fn frame_count(&self) -> usize {
+        self.index.len()
+    }
+
+    /// Record a frame straight from [ArducamDepthCamera::request_frame](crate::ArducamDepthCamera::request_frame)
+    pub fn record<B: CameraBackend>(
+        &mut self,
+        frame: &ArducamFrameBuffer<'_, B>,
+    ) -> Result<(), RecordingError> {
+        self.write_frame(
+            &frame.get_format(FrameType::DepthFrame),
+            &frame.get_depth_data(),
+            &frame.get_confidence_data(),
+        )
+    }
+
+    /// Record a frame, stamping it with the time since the recording started.
+    ///
+    /// Panics if either plane does not have the dimensions given in `format`.
+    pub fn write_frame(
+        &mut self,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> Result<(), RecordingError> {
+        for plane in [depth, confidence] {
+            assert!(
+                plane.width() == format.width && plane.height() == format.height,
+                "Plane dimensions must match the frame format"
+            );
+        }
+
+        let header = RecordHeader {
+            sequence: self.index.len() as u64,
+            format: *format,
+            received: self.started_at.elapsed().as_nanos() as u64,
+        };
+        let padding = [0; RECORD_ALIGN];
+        let plane_padding = header.plane_stride() - header.pixel_count() * size_of::<f32>();
+
+        self.writer.write_all(&header.to_bytes())?;
+        for plane in [depth, confidence] {
+            self.writer.write_all(plane_bytes(plane.as_slice()))?;
+            self.writer.write_all(&padding[..plane_padding])?;
+        }
+
+        self.index.push(IndexEntry {
+            offset: self.position,
+            received: header.received,
+        });
+        self.position += header.record_len() as u64;
+        Ok(())
+    }
+
+    /// Write the index and flush, returning the underlying writer.
+    ///
+    /// A recording that is dropped without being finished can still be replayed, but has to be
+    /// scanned when it is opened.
+    pub fn finish(mut self) -> Result<W, RecordingError> {
+        let index_offset = self.position;
+        for entry in &self.index {
+            self.writer.write_all(&entry.offset.to_le_bytes())?;
+            self.writer.write_all(&entry.received.to_le_bytes())?;
+        }
+
+        self.writer.write_all(&index_offset.to_le_bytes())?;
+        self.writer
+            .write_all(&(self.index.len() as u64).to_le_bytes())?;
+        self.writer.write_all(&INDEX_MAGIC)?;
+        self.writer.flush()?;
+        Ok(self.writer)
+    }
+}
+
+/// A read-only memory mapping of a whole file
+struct Mmap {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// The mapping is read-only and lives until the Mmap is dropped
+unsafe impl Send for Mmap {}
+unsafe impl Sync for Mmap {}
+
+impl Mmap {
+    fn map(file: &File) -> std::io::Result<Self> {
+        use std::os::fd::AsRawFd;
+
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(std::io::ErrorKind::UnexpectedEof.into());
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        // Replay reads front to back, so ask for aggressive read-ahead. This is only a hint.
+        unsafe { libc::madvise(ptr, len, libc::MADV_SEQUENTIAL) };
+
+        Ok(Self {
+            ptr: NonNull::new(ptr as *mut u8).unwrap(),
+            len,
+        })
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr.as_ptr() as *mut libc::c_void, self.len) };
+    }
+}
+
+/// How [ReplayBackend] paces the frames it serves
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Pacing {
+    /// Keep to the intervals the frames were received at when they were recorded
+    Recorded,
+    /// Serve frames as fast as they are requested
+    Unpaced,
+}
+
+/// A camera backend serving the frames of a recording, straight from a memory mapping
+pub struct ReplayBackend {
+    map: Mmap,
+    header: FileHeader,
+    index: Vec<IndexEntry>,
+    pacing: Pacing,
+    /// Index of the next frame to serve
+    next: usize,
+    /// The wall clock time the next frame is due under [Pacing::Recorded], and the recorded
+    /// receive time it corresponds to
+    clock: Option<(Instant, u64)>,
+    started: bool,
+}
+
+/// A frame served by [ReplayBackend]
+pub struct ReplayFrame {
+    header: RecordHeader,
+    offset: usize,
+}
+
+impl ReplayBackend {
+    /// Open the recording at `path` for replay
+    pub fn from_file(path: impl AsRef<Path>, pacing: Pacing) -> Result<Self, RecordingError> {
+        let map = Mmap::map(&File::open(path)?)?;
+        let bytes = map.as_slice();
+        if bytes.len() < FILE_HEADER_SIZE {
+            return Err(std::io::Error::from(std::io::ErrorKind::UnexpectedEof).into());
+        }
+        let header = FileHeader::from_bytes(&bytes[..FILE_HEADER_SIZE])?;
+
+        let index = match read_index(bytes) {
+            Some(index) => index,
+            None => scan_records(bytes),
+        };
+
+        Ok(Self {
+            map,
+            header,
+            index,
+            pacing,
+            next: 0,
+            clock: None,
+            started: false,
+        })
+    }
+
+    pub fn header(&self) -> &FileHeader {
+        &self.header
+    }
+
+    /// The number of frames in the recording
+    pub fn frame_count(&self) -> usize {
+        self.index.len()
+    }
+
+    /// The index of the frame the next call to [CameraBackend::request_frame] will serve
+    pub fn position(&self) -> usize {
+        self.next
+    }
+
+    /// Continue replaying from frame `index`, e.g. 0 to loop.
+    ///
+    /// Panics if `index` is past the end of the recording.
+    pub fn seek(&mut self, index: usize) {
+        assert!(index <= self.index.len(), "Seek past end of recording");
+        self.next = index;
+        self.clock = None;
+    }
+
+    fn record_header(&self, offset: usize) -> RecordHeader {
+        let bytes = &self.map.as_slice()[offset..offset + RECORD_HEADER_SIZE];
+        // Records were validated when the recording was opened
+        RecordHeader::from_bytes(bytes, offset as u64).unwrap()
+    }
+
+    fn plane<'a>(&'a self, frame: &'a ReplayFrame, plane: usize) -> FrameData<'a, f32> {
+        let start = frame.offset + RECORD_HEADER_SIZE + plane * frame.header.plane_stride();
+        let data =
+            &self.map.as_slice()[start..start + frame.header.pixel_count() * size_of::<f32>()];
+        FrameData {
+            width: frame.header.format.width,
+            height: frame.header.format.height,
+            // Planes are 64-byte aligned within the page-aligned mapping
+            data: unsafe {
+                std::slice::from_raw_parts(data.as_ptr() as *const f32, frame.header.pixel_count())
+            },
+        }
+    }
+}
+
+/// Read the index of a finished recording, or `None` if it has no valid index
+fn read_index(bytes: &[u8]) -> Option<Vec<IndexEntry>> {
+    let trailer = bytes.get(bytes.len().checked_sub(INDEX_TRAILER_SIZE)?..)?;
+    if trailer[16..24] != INDEX_MAGIC {
+        return None;
+    }
+
+    let index_offset = u64::from_le_bytes(trailer[0..8].try_into().unwrap()) as usize;
+    let frame_count = u64::from_le_bytes(trailer[8..16].try_into().unwrap()) as usize;
+    let index_len = frame_count.checked_mul(INDEX_ENTRY_SIZE)?;
+    if index_offset.checked_add(index_len)? != bytes.len() - INDEX_TRAILER_SIZE {
+        return None;
+    }
+
+    let index: Vec<_> = bytes[index_offset..index_offset + index_len]
+        .chunks_exact(INDEX_ENTRY_SIZE)
+        .map(|entry| IndexEntry {
+            offset: u64::from_le_bytes(entry[0..8].try_into().unwrap()),
+            received: u64::from_le_bytes(entry[8..16].try_into().unwrap()),
+        })
+        .collect();
+
+    let valid = index.iter().all(|entry| {
+        record_at(bytes, entry.offset as usize, index_offset)
+            .is_some_and(|header| header.received == entry.received)
+    });
+    valid.then_some(index)
+}
+
+/// Find every complete record by walking them from the start of the file
+fn scan_records(bytes: &[u8]) -> Vec<IndexEntry> {
+    let mut index = Vec::new();
+    let mut offset = FILE_HEADER_SIZE;
+
+    while let Some(header) = record_at(bytes, offset, bytes.len()) {
+        index.push(IndexEntry {
+            offset: offset as u64,
+            received: header.received,
+        });
+        offset += header.record_len();
+    }
+
+    index
+}
+
+/// The header of the record at `offset`, if there is a valid one that ends by `end`
+fn record_at(bytes: &[u8], offset: usize, end: usize) -> Option<RecordHeader> {
+    if offset % RECORD_ALIGN != 0 {
+        return None;
+    }
+    let header_bytes = bytes.get(offset..offset.checked_add(RECORD_HEADER_SIZE)?)?;
+    let header = RecordHeader::from_bytes(header_bytes, offset as u64).ok()?;
+    (offset + header.record_len() <= end).then_some(header)
+}
+
+impl CameraBackend for ReplayBackend {
+    type Frame = ReplayFrame;
+
+    /// A replay needs a recording to read, so this always fails. Use
+    /// [ReplayBackend::from_file] and [ArducamDepthCamera::with_backend](crate::ArducamDepthCamera::with_backend).
+    fn create() -> Result<Self, InitError> {
+        Err(InitError)
+    }
+
+    fn open(&mut self, _conn: Connection, _index: i32) -> Result<(), OpenError> {
+        Ok(())
+    }
+
+    fn close(&mut self) -> Result<(), CloseError> {
+        Ok(())
+    }
+
+    fn start(&mut self, _frame_type: FrameType) -> Result<(), StartError> {
+        self.started = true;
+        self.clock = None;
+        Ok(())
+    }
+
+    fn stop(&mut self) -> Result<(), StopError> {
+        self.started = false;
+        Ok(())
+    }
+
+    /// Serve the next frame of the recording. Fails once the end is reached, see
+    /// [ReplayBackend::seek].
+    fn request_frame(
+        &mut self,
+        timeout: Option<Duration>,
+    ) -> Result<ReplayFrame, RequestFrameError> {
+        if !self.started {
+            return Err(RequestFrameError);
+        }
+        let entry = *self.index.get(self.next).ok_or(RequestFrameError)?;
+
+        if self.pacing == Pacing::Recorded {
+            let now = Instant::now();
+            let (due, received) = *self.clock.get_or_insert((now, entry.received));
+            let due = due + Duration::from_nanos(entry.received.saturating_sub(received));
+
+            let wait = due.saturating_duration_since(now);
+            if timeout.is_some_and(|timeout| timeout < wait) {
+                std::thread::sleep(timeout.unwrap());
+                return Err(RequestFrameError);
+            }
+            std::thread::sleep(wait);
+            // A slow consumer gets the next frame straight away rather than a burst of stale
+            // ones, after which the recorded intervals are kept from there
+            self.clock = Some((due.max(Instant::now()), entry.received));
+        }
+
+        self.next += 1;
+        let offset = entry.offset as usize;
+        Ok(ReplayFrame {
+            header: self.record_header(offset),
+            offset,
+        })
+    }
+
+    fn release_frame(&self, _frame: ReplayFrame) -> Result<(), ReleaseFrameError> {
+        Ok(())
+    }
+
+    /// The timestamp is the one reported by the camera the frame was recorded from
+    fn get_format(&self, frame: &ReplayFrame, frame_type: FrameType) -> ArducamFrameFormat {
+        ArducamFrameFormat {
+            frame_type,
+            ..frame.header.format
+        }
+    }
+
+    fn get_depth_data<'a>(&'a self, frame: &'a ReplayFrame) -> FrameData<'a, f32> {
+        self.plane(frame, 0)
+    }
+
+    fn get_confidence_data<'a>(&'a self, frame: &'a ReplayFrame) -> FrameData<'a, f32> {
+        self.plane(frame, 1)
+    }
+
+    /// Recordings only hold depth and confidence, so this always panics
+    fn get_raw_data<'a>(&'a self, _frame: &'a ReplayFrame) -> FrameData<'a, i16> {
+        panic!("Recordings do not hold raw frames")
+    }
+}
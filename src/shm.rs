@@ -0,0 +1,589 @@
+//! Sharing frames with other processes on the same host through POSIX shared memory.
+//!
+//! A [ShmPublisher] creates a named ring of frame slots with `shm_open` and copies each frame
+//! into the next slot once. Any number of [ShmSubscriber]s, in any process, map the ring
+//! read-only and read the planes straight out of it, so adding a consumer costs nothing on the
+//! publishing side.
+//!
+//! The ring starts with a 64 byte control block, followed by the slots. Each slot is a 64 byte
+//! header then the depth and confidence planes as `f32`s, each padded to 64 bytes:
+//!
+//! ```text
+//! control | slot 0: header, depth, confidence | slot 1 | ...
+//! ```
+//!
+//! Every slot header holds a sequence lock: odd while the publisher is writing a frame into
+//! it, even once the frame is complete. Subscribers never write to the ring, so they cannot
+//! hold the publisher up. Instead they check the lock again after reading, with
+//! [ShmFrame::is_intact], to find out whether the publisher lapped them and reused the slot
+//! meanwhile. As a read can race with the publisher, the planes are only ever accessed with
+//! relaxed atomic loads and stores, never through plain `&[f32]`s. Subscribers sleep on a futex
+//! in the control block, which the publisher wakes on every frame.
+
+use std::{
+    ffi::CString,
+    ptr::NonNull,
+    sync::atomic::{fence, AtomicU32, AtomicU64, Ordering},
+    time::{Duration, Instant},
+};
+
+use thiserror::Error;
+
+use crate::{
+    backend::CameraBackend,
+    projection::FrameSizeMismatch,
+    recording::{frame_type_code, frame_type_from_code},
+    ArducamFrameBuffer, ArducamFrameFormat, FrameData, FrameType,
+};
+
+/// The first bytes of a frame ring, written once it is ready to use
+pub const MAGIC: [u8; 8] = *b"ATOFSHM\0";
+/// The ring layout version written by [ShmPublisher]
+pub const VERSION: u32 = 1;
+
+/// Alignment of the control block, every slot and every plane
+const SLOT_ALIGN: usize = 64;
+const CONTROL_SIZE: usize = 64;
+const SLOT_HEADER_SIZE: usize = 64;
+
+/// Permissions of a new ring: writable by its owner, readable by everyone
+const RING_MODE: libc::mode_t = 0o644;
+
+#[derive(Debug, Error)]
+pub enum ShmError {
+    #[error("I/O error: {0}")]
+    Io(#[from] std::io::Error),
+    #[error("Not a frame ring, or not initialised yet, bad magic: {0:?}")]
+    BadMagic([u8; 8]),
+    #[error("Unsupported frame ring version: {0}")]
+    UnsupportedVersion(u32),
+    #[error("The publisher has closed the frame ring")]
+    Closed,
+    #[error("Timed out waiting for a frame")]
+    Timeout,
+}
+
+/// The control block at the start of a ring
+#[repr(C)]
+struct Control {
+    /// [MAGIC], stored last when the ring is created
+    magic: AtomicU64,
+    version: u32,
+    slot_count: u32,
+    width: u16,
+    height: u16,
+    _reserved: u32,
+    /// Bytes from the start of one slot to the start of the next
+    slot_stride: u64,
+    /// The sequence number of the newest complete frame plus 1, or 0 before the first
+    published: AtomicU64,
+    /// Futex word incremented on every frame and on closing, for subscribers to sleep on
+    notify: AtomicU32,
+    /// Non-zero once the publisher has gone
+    closed: AtomicU32,
+}
+
+/// The header at the start of every slot. Everything but the lock is only meaningful while the
+/// lock reads the same before and after.
+#[repr(C)]
+struct SlotHeader {
+    /// 2 * sequence + 1 while frame `sequence` is being written, 2 * sequence + 2 once complete
+    lock: AtomicU64,
+    timestamp: AtomicU64,
+    frame_type: AtomicU32,
+}
+
+const _: () = assert!(size_of::<Control>() <= CONTROL_SIZE);
+const _: () = assert!(size_of::<SlotHeader>() <= SLOT_HEADER_SIZE);
+
+/// Bytes from the start of one plane of a `width`x`height` frame to the start of the next
+fn plane_stride(width: u16, height: u16) -> usize {
+    (width as usize * height as usize * size_of::<f32>()).next_multiple_of(SLOT_ALIGN)
+}
+
+/// A shared mapping of a whole shared memory object
+struct Mapping {
+    ptr: NonNull<u8>,
+    len: usize,
+}
+
+// The mapping lives until the Mapping is dropped, and everything shared through it that can
+// change is either atomic or guarded by a slot's sequence lock
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    fn map(fd: libc::c_int, len: usize, writable: bool) -> std::io::Result<Self> {
+        let protection = if writable {
+            libc::PROT_READ | libc::PROT_WRITE
+        } else {
+            libc::PROT_READ
+        };
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                protection,
+                libc::MAP_SHARED,
+                fd,
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+
+        Ok(Self {
+            ptr: NonNull::new(ptr as *mut u8).unwrap(),
+            len,
+        })
+    }
+
+    fn control(&self) -> &Control {
+        unsafe { &*(self.ptr.as_ptr() as *const Control) }
+    }
+
+    fn slot_header(&self, slot: usize) -> &SlotHeader {
+        unsafe { &*(self.slot_ptr(slot) as *const SlotHeader) }
+    }
+
+    fn slot_ptr(&self, slot: usize) -> *mut u8 {
+        let offset = CONTROL_SIZE + slot * self.control().slot_stride as usize;
+        debug_assert!(offset + SLOT_HEADER_SIZE <= self.len);
+        unsafe { self.ptr.as_ptr().add(offset) }
+    }
+
+    /// Plane `plane` (0 for depth, 1 for confidence) of `slot`, as the bits of each `f32`
+    fn plane(&self, slot: usize, plane: usize) -> &[AtomicU32] {
+        let control = self.control();
+        let (width, height) = (control.width, control.height);
+        let offset = SLOT_HEADER_SIZE + plane * plane_stride(width, height);
+        // AtomicU32 has the layout of f32, and the plane is 64 byte aligned
+        unsafe {
+            std::slice::from_raw_parts(
+                self.slot_ptr(slot).add(offset) as *const AtomicU32,
+                width as usize * height as usize,
+            )
+        }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr.as_ptr() as *mut libc::c_void, self.len) };
+    }
+}
+
+/// The name of a shared memory object as a C string
+fn object_name(name: &str) -> std::io::Result<CString> {
+    CString::new(name).map_err(|_| std::io::ErrorKind::InvalidInput.into())
+}
+
+/// Wake every subscriber sleeping on `word`
+fn futex_wake(word: &AtomicU32) {
+    // Not FUTEX_PRIVATE_FLAG: the waiters are in other processes
+    unsafe {
+        libc::syscall(
+            libc::SYS_futex,
+            word.as_ptr(),
+            libc::FUTEX_WAKE,
+            i32::MAX,
+            std::ptr::null::<libc::timespec>(),
+        )
+    };
+}
+
+/// Sleep until `word` is woken, unless it no longer holds `expected`, or until `timeout` has
+/// passed. Spurious wake-ups are possible.
+fn futex_wait(word: &AtomicU32, expected: u32, timeout: Option<Duration>) {
+    let timeout = timeout.map(|timeout| libc::timespec {
+        tv_sec: timeout.as_secs() as libc::time_t,
+        tv_nsec: timeout.subsec_nanos() as libc::c_long,
+    });
+    unsafe {
+        libc::syscall(
+            libc::SYS_futex,
+            word.as_ptr(),
+            libc::FUTEX_WAIT,
+            expected,
+            timeout
+                .as_ref()
+                .map_or(std::ptr::null(), |timeout| timeout as *const libc::timespec),
+        )
+    };
+}
+
+/// Publishes frames to a shared memory ring
+pub struct ShmPublisher {
+    name: CString,
+    map: Mapping,
+    next_sequence: u64,
+}
+
+impl ShmPublisher {
+    /// Create a ring named `name` with `slots` slots for `width`x`height` frames, replacing any
+    /// ring already of that name. Names start with a `/` and have no other `/`.
+    ///
+    /// A subscriber may read a frame for up to `slots - 1` frame periods before the publisher
+    /// can reuse its slot.
+    ///
+    /// Panics if `slots` is less than 2.
+    pub fn create(name: &str, width: u16, height: u16, slots: usize) -> Result<Self, ShmError> {
+        assert!(slots >= 2, "Frame ring needs at least 2 slots");
+
+        let slot_stride = SLOT_HEADER_SIZE + 2 * plane_stride(width, height);
+        let len = CONTROL_SIZE + slots * slot_stride;
+        let name = object_name(name)?;
+
+        // Subscribers of a ring left by a publisher that died keep their old mapping, and this
+        // one starts from scratch
+        unsafe { libc::shm_unlink(name.as_ptr()) };
+        let fd = unsafe {
+            libc::shm_open(
+                name.as_ptr(),
+                libc::O_RDWR | libc::O_CREAT | libc::O_EXCL,
+                RING_MODE,
+            )
+        };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        let map = (|| {
+            if unsafe { libc::ftruncate(fd, len as libc::off_t) } != 0 {
+                return Err(std::io::Error::last_os_error());
+            }
+            Mapping::map(fd, len, true)
+        })();
+        unsafe { libc::close(fd) };
+        let map = match map {
+            Ok(map) => map,
+            Err(error) => {
+                unsafe { libc::shm_unlink(name.as_ptr()) };
+                return Err(error.into());
+            }
+        };
+
+        // The object is zero filled, so only the fixed fields need setting. Nothing else has
+        // the mapping until the magic is stored.
+        unsafe {
+            let control = map.ptr.as_ptr() as *mut Control;
+            (*control).version = VERSION;
+            (*control).slot_count = slots as u32;
+            (*control).width = width;
+            (*control).height = height;
+            (*control).slot_stride = slot_stride as u64;
+        }
+        map.control()
+            .magic
+            .store(u64::from_le_bytes(MAGIC), Ordering::Release);
+
+        Ok(Self {
+            name,
+            map,
+            next_sequence: 0,
+        })
+    }
+
+    pub fn width(&self) -> u16 {
+        self.map.control().width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.map.control().height
+    }
+
+    /// Publish a frame straight from
+    /// [ArducamDepthCamera::request_frame](crate::ArducamDepthCamera::request_frame)
+    pub fn publish_frame<B: CameraBackend>(
+        &mut self,
+        frame: &ArducamFrameBuffer<'_, B>,
+    ) -> Result<u64, FrameSizeMismatch> {
+        self.publish(
+            &frame.get_format(FrameType::DepthFrame),
+            &frame.get_depth_data(),
+            &frame.get_confidence_data(),
+        )
+    }
+
+    /// Copy a frame into the next slot and wake the subscribers, returning its sequence number
+    pub fn publish(
+        &mut self,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> Result<u64, FrameSizeMismatch> {
+        for plane in [depth, confidence] {
+            if plane.width() != self.width() || plane.height() != self.height() {
+                return Err(FrameSizeMismatch {
+                    width: plane.width(),
+                    height: plane.height(),
+                    expected_width: self.width(),
+                    expected_height: self.height(),
+                });
+            }
+        }
+
+        let sequence = self.next_sequence;
+        let control = self.map.control();
+        let slot = (sequence % control.slot_count as u64) as usize;
+        let header = self.map.slot_header(slot);
+
+        header.lock.store(2 * sequence + 1, Ordering::Relaxed);
+        // Keep the writes below from becoming visible before the lock is odd
+        fence(Ordering::Release);
+        header.timestamp.store(format.timestamp, Ordering::Relaxed);
+        header
+            .frame_type
+            .store(frame_type_code(format.frame_type) as u32, Ordering::Relaxed);
+        for (plane, data) in [depth, confidence].into_iter().enumerate() {
+            // Subscribers may be reading the slot still, so the copy has to be atomic too.
+            // Relaxed stores compile to plain ones.
+            for (pixel, &value) in self.map.plane(slot, plane).iter().zip(data.as_slice()) {
+                pixel.store(value.to_bits(), Ordering::Relaxed);
+            }
+        }
+        header.lock.store(2 * sequence + 2, Ordering::Release);
+
+        control.published.store(sequence + 1, Ordering::Release);
+        // Subscribers only read the ring, so there is no count of sleepers to check first. At
+        // frame rates the unconditional wake costs nothing noticeable.
+        control.notify.fetch_add(1, Ordering::Release);
+        futex_wake(&control.notify);
+
+        self.next_sequence += 1;
+        Ok(sequence)
+    }
+}
+
+impl Drop for ShmPublisher {
+    fn drop(&mut self) {
+        let control = self.map.control();
+        control.closed.store(1, Ordering::Release);
+        control.notify.fetch_add(1, Ordering::Release);
+        futex_wake(&control.notify);
+        // Subscribers keep their mappings, and new ones can no longer find the ring
+        unsafe { libc::shm_unlink(self.name.as_ptr()) };
+    }
+}
+
+/// Reads frames from a shared memory ring created by a [ShmPublisher]
+pub struct ShmSubscriber {
+    map: Mapping,
+    /// The sequence number of the next frame this subscriber has not returned
+    next_sequence: u64,
+    missed_frames: u64,
+}
+
+/// A frame in a shared memory ring, read in place.
+///
+/// The publisher does not wait for subscribers, so once it has published as many frames as
+/// the ring has slots it starts writing over this one. Check [ShmFrame::is_intact] after
+/// reading the planes, and discard whatever was computed from them if it returns false.
+///
+/// For the same reason the planes are never handed out as `&[f32]`, which would promise that
+/// they cannot change. Copy them out with [ShmFrame::copy_depth_into] and
+/// [ShmFrame::copy_confidence_into], or read single pixels from [ShmFrame::depth] and
+/// [ShmFrame::confidence].
+pub struct ShmFrame<'a> {
+    sequence: u64,
+    format: ArducamFrameFormat,
+    lock: &'a AtomicU64,
+    depth: &'a [AtomicU32],
+    confidence: &'a [AtomicU32],
+}
+
+impl ShmFrame<'_> {
+    /// The publisher's sequence number for this frame, counting from 0
+    pub fn sequence(&self) -> u64 {
+        self.sequence
+    }
+
+    pub fn format(&self) -> ArducamFrameFormat {
+        self.format
+    }
+
+    /// The depth plane in place, row-major, holding the bits of each `f32`: read a pixel with
+    /// `f32::from_bits(depth[i].load(Ordering::Relaxed))`
+    pub fn depth(&self) -> &[AtomicU32] {
+        self.depth
+    }
+
+    /// The confidence plane in place, laid out like [ShmFrame::depth]
+    pub fn confidence(&self) -> &[AtomicU32] {
+        self.confidence
+    }
+
+    /// Copy the depth plane into `out`, which must hold one value per pixel
+    pub fn copy_depth_into(&self, out: &mut [f32]) {
+        copy_plane(self.depth, out);
+    }
+
+    /// Copy the confidence plane into `out`, which must hold one value per pixel
+    pub fn copy_confidence_into(&self, out: &mut [f32]) {
+        copy_plane(self.confidence, out);
+    }
+
+    /// Whether the publisher has left this frame's slot alone so far, so everything read from
+    /// it up to now is the frame as published
+    pub fn is_intact(&self) -> bool {
+        // Keep the reads of the planes from moving after the check
+        fence(Ordering::Acquire);
+        self.lock.load(Ordering::Relaxed) == 2 * self.sequence + 2
+    }
+}
+
+fn copy_plane(plane: &[AtomicU32], out: &mut [f32]) {
+    assert!(
+        out.len() == plane.len(),
+        "Output buffer must hold one value per pixel"
+    );
+    for (out, pixel) in out.iter_mut().zip(plane) {
+        *out = f32::from_bits(pixel.load(Ordering::Relaxed));
+    }
+}
+
+impl ShmSubscriber {
+    /// Map the ring named `name` read-only. New subscribers start from the newest frame.
+    pub fn open(name: &str) -> Result<Self, ShmError> {
+        let name = object_name(name)?;
+        let fd = unsafe { libc::shm_open(name.as_ptr(), libc::O_RDONLY, 0) };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        let map = (|| {
+            let mut stat: libc::stat = unsafe { std::mem::zeroed() };
+            if unsafe { libc::fstat(fd, &mut stat) } != 0 {
+                return Err(std::io::Error::last_os_error());
+            }
+            let len = stat.st_size as usize;
+            if len < CONTROL_SIZE {
+                return Err(std::io::ErrorKind::UnexpectedEof.into());
+            }
+            Mapping::map(fd, len, false)
+        })();
+        unsafe { libc::close(fd) };
+        let map = map?;
+
+        let control = map.control();
+        let magic = control.magic.load(Ordering::Acquire).to_le_bytes();
+        if magic != MAGIC {
+            return Err(ShmError::BadMagic(magic));
+        }
+        if control.version != VERSION {
+            return Err(ShmError::UnsupportedVersion(control.version));
+        }
+        let expected_len =
+            CONTROL_SIZE + control.slot_count as usize * control.slot_stride as usize;
+        if map.len < expected_len
+            || (control.slot_stride as usize)
+                < SLOT_HEADER_SIZE + 2 * plane_stride(control.width, control.height)
+        {
+            return Err(std::io::Error::from(std::io::ErrorKind::UnexpectedEof).into());
+        }
+
+        let next_sequence = control.published.load(Ordering::Acquire).saturating_sub(1);
+        Ok(Self {
+            map,
+            next_sequence,
+            missed_frames: 0,
+        })
+    }
+
+    pub fn width(&self) -> u16 {
+        self.map.control().width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.map.control().height
+    }
+
+    /// Whether the publisher has closed the ring
+    pub fn is_closed(&self) -> bool {
+        self.map.control().closed.load(Ordering::Acquire) != 0
+    }
+
+    /// The number of frames published that this subscriber never returned, because newer
+    /// frames were published before it asked
+    pub fn missed_frames(&self) -> u64 {
+        self.missed_frames
+    }
+
+    /// The newest frame, or None if nothing has been published yet
+    pub fn latest(&mut self) -> Option<ShmFrame<'_>> {
+        loop {
+            let published = self.map.control().published.load(Ordering::Acquire);
+            let sequence = published.checked_sub(1)?;
+            // Only fails if the publisher lapped the whole ring since the load above
+            if self.read(sequence) {
+                self.missed_frames += sequence.saturating_sub(self.next_sequence);
+                self.next_sequence = self.next_sequence.max(sequence + 1);
+                return Some(self.frame(sequence));
+            }
+        }
+    }
+
+    /// Wait for a frame newer than any returned so far, then return the newest frame.
+    ///
+    /// Returns [ShmError::Closed] once the publisher has gone and [ShmError::Timeout] if no
+    /// frame arrives within `timeout`.
+    pub fn wait_next(&mut self, timeout: Option<Duration>) -> Result<ShmFrame<'_>, ShmError> {
+        let deadline = timeout.map(|timeout| Instant::now() + timeout);
+        loop {
+            let control = self.map.control();
+            // Read before checking for a frame, so a publish in between is never slept through
+            let notify = control.notify.load(Ordering::Acquire);
+            if control.published.load(Ordering::Acquire) > self.next_sequence {
+                break;
+            }
+            if self.is_closed() {
+                return Err(ShmError::Closed);
+            }
+
+            let remaining = match deadline {
+                Some(deadline) => match deadline.checked_duration_since(Instant::now()) {
+                    Some(remaining) if !remaining.is_zero() => Some(remaining),
+                    _ => return Err(ShmError::Timeout),
+                },
+                None => None,
+            };
+            futex_wait(&control.notify, notify, remaining);
+        }
+
+        Ok(self.latest().expect("A frame has been published"))
+    }
+
+    /// Whether the slot for `sequence` holds that frame, complete
+    fn read(&self, sequence: u64) -> bool {
+        let slot = self.slot(sequence);
+        self.map.slot_header(slot).lock.load(Ordering::Acquire) == 2 * sequence + 2
+    }
+
+    fn slot(&self, sequence: u64) -> usize {
+        (sequence % self.map.control().slot_count as u64) as usize
+    }
+
+    fn frame(&self, sequence: u64) -> ShmFrame<'_> {
+        let control = self.map.control();
+        let slot = self.slot(sequence);
+        let header = self.map.slot_header(slot);
+        let (width, height) = (control.width, control.height);
+
+        ShmFrame {
+            sequence,
+            format: ArducamFrameFormat {
+                width,
+                height,
+                // A frame type that doesn't decode means the slot is being rewritten, which
+                // is_intact reports
+                frame_type: frame_type_from_code(header.frame_type.load(Ordering::Relaxed) as u8)
+                    .unwrap_or(FrameType::DepthFrame),
+                timestamp: header.timestamp.load(Ordering::Relaxed),
+            },
+            lock: &header.lock,
+            depth: self.map.plane(slot, 0),
+            confidence: self.map.plane(slot, 1),
+        }
+    }
+}
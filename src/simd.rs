@@ -0,0 +1,1336 @@
+//! Explicitly vectorised kernels, selected at runtime from the features of the host CPU.
+//!
+//! Every kernel has a scalar implementation that produces identical results, which is used for
+//! the tail of a frame that does not fill a whole vector block and on CPUs without a supported
+//! instruction set.
+
+use std::f32::consts::{FRAC_PI_2, PI, TAU};
+
+use crate::projection::{DensePoints, ProjectedPoints};
+
+/// An instruction set a kernel can be run with
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Kernel {
+    Scalar,
+    /// x86 SSE4.1, 4 lanes
+    Sse41,
+    /// x86 AVX2, 8 lanes
+    Avx2,
+    /// aarch64 Advanced SIMD, 4 lanes
+    Neon,
+}
+
+impl Kernel {
+    /// Every kernel, whether or not the CPU supports it
+    pub const ALL: [Kernel; 4] = [Kernel::Scalar, Kernel::Sse41, Kernel::Avx2, Kernel::Neon];
+
+    /// The kernels the CPU this is running on supports
+    pub fn supported() -> impl Iterator<Item = Kernel> {
+        Self::ALL.into_iter().filter(|kernel| kernel.is_supported())
+    }
+
+    /// The fastest kernel supported by the CPU this is running on
+    pub fn detect() -> Self {
+        [Kernel::Avx2, Kernel::Sse41, Kernel::Neon]
+            .into_iter()
+            .find(|kernel| kernel.is_supported())
+            .unwrap_or(Kernel::Scalar)
+    }
+
+    /// Whether the CPU this is running on can run this kernel
+    pub fn is_supported(self) -> bool {
+        match self {
+            Kernel::Scalar => true,
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernel::Sse41 => is_x86_feature_detected!("sse4.1"),
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernel::Avx2 => is_x86_feature_detected!("avx2"),
+            #[cfg(target_arch = "aarch64")]
+            Kernel::Neon => std::arch::is_aarch64_feature_detected!("neon"),
+            #[allow(unreachable_patterns)]
+            _ => false,
+        }
+    }
+}
+
+/// Pixels covered by each word of a packed validity mask
+pub(crate) const MASK_BITS: usize = u64::BITS as usize;
+
+/// Inputs to [project], all slices having one entry per pixel
+pub(crate) struct ProjectionInput<'a> {
+    pub ray_x: &'a [f32],
+    pub ray_y: &'a [f32],
+    pub depth: &'a [f32],
+    pub confidence: &'a [f32],
+    pub min_confidence: f32,
+}
+
+/// Multiply each pixel's ray by its depth into `out`, and set its bit in `out.valid` if its
+/// depth is positive and its confidence is at least `min_confidence`.
+///
+/// `out` must already be sized to the number of pixels.
+pub(crate) fn project(kernel: Kernel, input: &ProjectionInput, out: &mut ProjectedPoints) {
+    let pixels = input.depth.len();
+    assert!(input.ray_x.len() == pixels && input.ray_y.len() == pixels);
+    assert!(input.confidence.len() == pixels);
+    assert!(out.x.len() == pixels && out.y.len() == pixels && out.z.len() == pixels);
+    assert!(out.valid.len() == pixels.div_ceil(MASK_BITS));
+
+    let blocks = pixels / MASK_BITS;
+    debug_assert!(kernel.is_supported());
+
+    match kernel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Avx2 => unsafe { x86::project_avx2(input, out, blocks) },
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Sse41 => unsafe { x86::project_sse41(input, out, blocks) },
+        #[cfg(target_arch = "aarch64")]
+        Kernel::Neon => unsafe { neon::project_neon(input, out, blocks) },
+        _ => project_scalar(input, out, 0, blocks * MASK_BITS),
+    }
+
+    project_scalar(input, out, blocks * MASK_BITS, pixels);
+}
+
+/// Project pixels `start..end`, where `start` is a multiple of [MASK_BITS]
+fn project_scalar(input: &ProjectionInput, out: &mut ProjectedPoints, start: usize, end: usize) {
+    for block_start in (start..end).step_by(MASK_BITS) {
+        let block_end = (block_start + MASK_BITS).min(end);
+        let mut bits = 0;
+
+        for i in block_start..block_end {
+            let z = input.depth[i];
+            out.x[i] = input.ray_x[i] * z;
+            out.y[i] = input.ray_y[i] * z;
+            out.z[i] = z;
+
+            let valid = z > 0.0 && input.confidence[i] >= input.min_confidence;
+            bits |= (valid as u64) << (i - block_start);
+        }
+
+        out.valid[block_start / MASK_BITS] = bits;
+    }
+}
+
+/// Inputs to [threshold], both slices having one entry per pixel
+pub(crate) struct ThresholdInput<'a> {
+    pub depth: &'a [f32],
+    pub confidence: &'a [f32],
+    pub min_depth: f32,
+    pub max_depth: f32,
+    pub min_confidence: f32,
+}
+
+/// Set the bit in `words` of each pixel with a positive depth in the range `min_depth..=max_depth`
+/// and a confidence of at least `min_confidence`, clearing the rest.
+///
+/// `words` must already be sized to the number of pixels.
+pub(crate) fn threshold(kernel: Kernel, input: &ThresholdInput, words: &mut [u64]) {
+    let pixels = input.depth.len();
+    assert!(input.confidence.len() == pixels);
+    assert!(words.len() == pixels.div_ceil(MASK_BITS));
+
+    let blocks = pixels / MASK_BITS;
+    debug_assert!(kernel.is_supported());
+
+    match kernel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Avx2 => unsafe { x86::threshold_avx2(input, words, blocks) },
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Sse41 => unsafe { x86::threshold_sse41(input, words, blocks) },
+        #[cfg(target_arch = "aarch64")]
+        Kernel::Neon => unsafe { neon::threshold_neon(input, words, blocks) },
+        _ => threshold_scalar(input, words, 0, blocks * MASK_BITS),
+    }
+
+    threshold_scalar(input, words, blocks * MASK_BITS, pixels);
+}
+
+/// Threshold pixels `start..end`, where `start` is a multiple of [MASK_BITS]
+fn threshold_scalar(input: &ThresholdInput, words: &mut [u64], start: usize, end: usize) {
+    for block_start in (start..end).step_by(MASK_BITS) {
+        let block_end = (block_start + MASK_BITS).min(end);
+        let mut bits = 0;
+
+        for i in block_start..block_end {
+            let depth = input.depth[i];
+            let valid = depth > 0.0
+                && depth >= input.min_depth
+                && depth <= input.max_depth
+                && input.confidence[i] >= input.min_confidence;
+            bits |= (valid as u64) << (i - block_start);
+        }
+
+        words[block_start / MASK_BITS] = bits;
+    }
+}
+
+/// Inputs to [compact], all slices having one entry per pixel
+pub(crate) struct CompactInput<'a> {
+    pub ray_x: &'a [f32],
+    pub ray_y: &'a [f32],
+    pub depth: &'a [f32],
+    pub confidence: &'a [f32],
+    pub min_depth: f32,
+    pub max_depth: f32,
+    pub min_confidence: f32,
+}
+
+/// For each 4-bit lane mask, the `pshufb`/`tbl` byte indices that move the selected `f32` lanes
+/// to the front, in order. Unused slots are 0x80, which both instructions turn into zeroes.
+static COMPACT_SHUFFLE_4: [[u8; 16]; 16] = {
+    let mut table = [[0x80; 16]; 16];
+    let mut mask = 0;
+    while mask < 16 {
+        let (mut lane, mut slot) = (0, 0);
+        while lane < 4 {
+            if mask & (1 << lane) != 0 {
+                let mut byte = 0;
+                while byte < 4 {
+                    table[mask][slot * 4 + byte] = (lane * 4 + byte) as u8;
+                    byte += 1;
+                }
+                slot += 1;
+            }
+            lane += 1;
+        }
+        mask += 1;
+    }
+    table
+};
+
+/// Project the pixels with a positive depth in the range `min_depth..=max_depth` and a
+/// confidence of at least `min_confidence` one after another into the start of `out`'s arrays,
+/// returning how many there are.
+///
+/// `out`'s arrays must each hold at least one entry per pixel. The vector kernels store whole
+/// vectors, so entries past the returned count are overwritten with junk.
+pub(crate) fn compact(kernel: Kernel, input: &CompactInput, out: &mut DensePoints) -> usize {
+    let pixels = input.depth.len();
+    assert!(input.ray_x.len() == pixels && input.ray_y.len() == pixels);
+    assert!(input.confidence.len() == pixels);
+    assert!(out.x.len() >= pixels && out.y.len() >= pixels);
+    assert!(out.z.len() >= pixels && out.confidence.len() >= pixels);
+    debug_assert!(kernel.is_supported());
+
+    let (done, count) = match kernel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Avx2 => unsafe { x86::compact_avx2(input, out) },
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Sse41 => unsafe { x86::compact_sse41(input, out) },
+        #[cfg(target_arch = "aarch64")]
+        Kernel::Neon => unsafe { neon::compact_neon(input, out) },
+        _ => (0, 0),
+    };
+
+    compact_scalar(input, out, done, count)
+}
+
+/// Compact pixels `start..` after `count` points, returning the new count. Every pixel's point
+/// is written, but only a valid one moves the count on, so the next point replaces it.
+fn compact_scalar(
+    input: &CompactInput,
+    out: &mut DensePoints,
+    start: usize,
+    count: usize,
+) -> usize {
+    let mut count = count;
+    for i in start..input.depth.len() {
+        let z = input.depth[i];
+        let confidence = input.confidence[i];
+        out.x[count] = input.ray_x[i] * z;
+        out.y[count] = input.ray_y[i] * z;
+        out.z[count] = z;
+        out.confidence[count] = confidence;
+
+        let valid = z > 0.0
+            && z >= input.min_depth
+            && z <= input.max_depth
+            && confidence >= input.min_confidence;
+        count += valid as usize;
+    }
+    count
+}
+
+/// Coefficients of an odd polynomial approximating atan on [0, 1] to within 2e-6 radians, highest
+/// power first
+const ATAN_COEFFICIENTS: [f32; 6] = [
+    -0.011_721_2,
+    0.052_653_32,
+    -0.116_432_87,
+    0.193_543_46,
+    -0.332_623_47,
+    0.999_977_26,
+];
+
+/// Inputs to [reconstruct], each phase slice having one sample per pixel
+pub(crate) struct PhaseInput<'a> {
+    /// Correlation samples at phase offsets of 0, 90, 180 and 270 degrees
+    pub phases: [&'a [i16]; 4],
+    /// Metres of depth per radian of phase shift
+    pub depth_scale: f32,
+}
+
+/// Recover each pixel's phase shift from its four correlation samples and write the depth it
+/// corresponds to into `depth`, and the amplitude of the reflected signal into `amplitude`.
+pub(crate) fn reconstruct(
+    kernel: Kernel,
+    input: &PhaseInput,
+    depth: &mut [f32],
+    amplitude: &mut [f32],
+) {
+    let pixels = depth.len();
+    assert!(amplitude.len() == pixels);
+    assert!(input.phases.iter().all(|phase| phase.len() == pixels));
+    debug_assert!(kernel.is_supported());
+
+    let done = match kernel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Avx2 => unsafe { x86::reconstruct_avx2(input, depth, amplitude) },
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Sse41 => unsafe { x86::reconstruct_sse41(input, depth, amplitude) },
+        #[cfg(target_arch = "aarch64")]
+        Kernel::Neon => unsafe { neon::reconstruct_neon(input, depth, amplitude) },
+        _ => 0,
+    };
+
+    reconstruct_scalar(input, depth, amplitude, done);
+}
+
+/// The angle of (`x`, `y`) in radians, in the range [-pi, pi]. The vector kernels perform the
+/// same operations in the same order, so give bit-identical results.
+fn atan2(y: f32, x: f32) -> f32 {
+    let (ax, ay) = (x.abs(), y.abs());
+    let a = ax.min(ay) / ax.max(ay).max(f32::MIN_POSITIVE);
+    let s = a * a;
+
+    let mut r = ATAN_COEFFICIENTS[0];
+    for &c in &ATAN_COEFFICIENTS[1..] {
+        r = r * s + c;
+    }
+    r *= a;
+
+    if ay > ax {
+        r = FRAC_PI_2 - r;
+    }
+    if x < 0.0 {
+        r = PI - r;
+    }
+    if y < 0.0 {
+        r = -r;
+    }
+    r
+}
+
+/// Reconstruct pixels `start..`
+fn reconstruct_scalar(input: &PhaseInput, depth: &mut [f32], amplitude: &mut [f32], start: usize) {
+    for i in start..depth.len() {
+        let [p0, p1, p2, p3] = input.phases.map(|phase| phase[i] as f32);
+        let in_phase = p0 - p2;
+        let quadrature = p3 - p1;
+
+        let mut angle = atan2(quadrature, in_phase);
+        if angle < 0.0 {
+            angle += TAU;
+        }
+
+        depth[i] = angle * input.depth_scale;
+        amplitude[i] = (in_phase * in_phase + quadrature * quadrature).sqrt() * 0.5;
+    }
+}
+
+/// Inputs to [smooth], all slices having one entry per pixel
+pub(crate) struct TemporalInput<'a> {
+    pub depth: &'a [f32],
+    pub confidence: &'a [f32],
+    /// Weight given to a new measurement with full confidence
+    pub alpha: f32,
+    /// Reciprocal of the confidence at which a measurement is given the full `alpha`
+    pub confidence_scale: f32,
+    /// Change in depth beyond which a pixel's history is discarded
+    pub jump_threshold: f32,
+}
+
+/// Blend each pixel's new depth into its smoothed depth in `state`, weighted by its confidence,
+/// and write the result into `out`.
+///
+/// A pixel with no history (a smoothed depth of 0) or whose depth moved by more than the jump
+/// threshold takes the new depth as is. A pixel without a valid depth keeps its history and is
+/// written to `out` as 0.
+pub(crate) fn smooth(kernel: Kernel, input: &TemporalInput, state: &mut [f32], out: &mut [f32]) {
+    let pixels = state.len();
+    assert!(input.depth.len() == pixels && input.confidence.len() == pixels);
+    assert!(out.len() == pixels);
+    debug_assert!(kernel.is_supported());
+
+    let done = match kernel {
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Avx2 => unsafe { x86::smooth_avx2(input, state, out) },
+        #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+        Kernel::Sse41 => unsafe { x86::smooth_sse41(input, state, out) },
+        #[cfg(target_arch = "aarch64")]
+        Kernel::Neon => unsafe { neon::smooth_neon(input, state, out) },
+        _ => 0,
+    };
+
+    smooth_scalar(input, state, out, done);
+}
+
+/// Smooth pixels `start..`
+fn smooth_scalar(input: &TemporalInput, state: &mut [f32], out: &mut [f32], start: usize) {
+    for i in start..state.len() {
+        let depth = input.depth[i];
+        let previous = state[i];
+
+        let weight = (input.confidence[i] * input.confidence_scale)
+            .max(0.0)
+            .min(1.0)
+            * input.alpha;
+        let change = depth - previous;
+        let mut next = previous + change * weight;
+        if change.abs() > input.jump_threshold || previous <= 0.0 {
+            next = depth;
+        }
+
+        let valid = depth > 0.0;
+        state[i] = if valid { next } else { previous };
+        out[i] = if valid { next } else { 0.0 };
+    }
+}
+
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod x86 {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    use std::f32::consts::{FRAC_PI_2, PI, TAU};
+
+    use super::{
+        CompactInput, PhaseInput, ProjectionInput, TemporalInput, ThresholdInput,
+        ATAN_COEFFICIENTS, COMPACT_SHUFFLE_4, MASK_BITS,
+    };
+    use crate::projection::{DensePoints, ProjectedPoints};
+
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn project_avx2(
+        input: &ProjectionInput,
+        out: &mut ProjectedPoints,
+        blocks: usize,
+    ) {
+        const LANES: usize = 8;
+        let min_confidence = _mm256_set1_ps(input.min_confidence);
+        let zero = _mm256_setzero_ps();
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let z = _mm256_loadu_ps(input.depth.as_ptr().add(i));
+                let confidence = _mm256_loadu_ps(input.confidence.as_ptr().add(i));
+                let ray_x = _mm256_loadu_ps(input.ray_x.as_ptr().add(i));
+                let ray_y = _mm256_loadu_ps(input.ray_y.as_ptr().add(i));
+
+                _mm256_storeu_ps(out.x.as_mut_ptr().add(i), _mm256_mul_ps(ray_x, z));
+                _mm256_storeu_ps(out.y.as_mut_ptr().add(i), _mm256_mul_ps(ray_y, z));
+                _mm256_storeu_ps(out.z.as_mut_ptr().add(i), z);
+
+                let valid = _mm256_and_ps(
+                    _mm256_cmp_ps::<_CMP_GT_OQ>(z, zero),
+                    _mm256_cmp_ps::<_CMP_GE_OQ>(confidence, min_confidence),
+                );
+                bits |= (_mm256_movemask_ps(valid) as u64) << (lane_group * LANES);
+            }
+
+            out.valid[block] = bits;
+        }
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub(super) unsafe fn project_sse41(
+        input: &ProjectionInput,
+        out: &mut ProjectedPoints,
+        blocks: usize,
+    ) {
+        const LANES: usize = 4;
+        let min_confidence = _mm_set1_ps(input.min_confidence);
+        let zero = _mm_setzero_ps();
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let z = _mm_loadu_ps(input.depth.as_ptr().add(i));
+                let confidence = _mm_loadu_ps(input.confidence.as_ptr().add(i));
+                let ray_x = _mm_loadu_ps(input.ray_x.as_ptr().add(i));
+                let ray_y = _mm_loadu_ps(input.ray_y.as_ptr().add(i));
+
+                _mm_storeu_ps(out.x.as_mut_ptr().add(i), _mm_mul_ps(ray_x, z));
+                _mm_storeu_ps(out.y.as_mut_ptr().add(i), _mm_mul_ps(ray_y, z));
+                _mm_storeu_ps(out.z.as_mut_ptr().add(i), z);
+
+                let valid = _mm_and_ps(
+                    _mm_cmpgt_ps(z, zero),
+                    _mm_cmpge_ps(confidence, min_confidence),
+                );
+                bits |= (_mm_movemask_ps(valid) as u64) << (lane_group * LANES);
+            }
+
+            out.valid[block] = bits;
+        }
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn threshold_avx2(input: &ThresholdInput, words: &mut [u64], blocks: usize) {
+        const LANES: usize = 8;
+        let zero = _mm256_setzero_ps();
+        let min_depth = _mm256_set1_ps(input.min_depth);
+        let max_depth = _mm256_set1_ps(input.max_depth);
+        let min_confidence = _mm256_set1_ps(input.min_confidence);
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let depth = _mm256_loadu_ps(input.depth.as_ptr().add(i));
+                let confidence = _mm256_loadu_ps(input.confidence.as_ptr().add(i));
+
+                let in_range = _mm256_and_ps(
+                    _mm256_cmp_ps::<_CMP_GE_OQ>(depth, min_depth),
+                    _mm256_cmp_ps::<_CMP_LE_OQ>(depth, max_depth),
+                );
+                let valid = _mm256_and_ps(
+                    _mm256_and_ps(_mm256_cmp_ps::<_CMP_GT_OQ>(depth, zero), in_range),
+                    _mm256_cmp_ps::<_CMP_GE_OQ>(confidence, min_confidence),
+                );
+                bits |= (_mm256_movemask_ps(valid) as u64) << (lane_group * LANES);
+            }
+
+            words[block] = bits;
+        }
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub(super) unsafe fn threshold_sse41(input: &ThresholdInput, words: &mut [u64], blocks: usize) {
+        const LANES: usize = 4;
+        let zero = _mm_setzero_ps();
+        let min_depth = _mm_set1_ps(input.min_depth);
+        let max_depth = _mm_set1_ps(input.max_depth);
+        let min_confidence = _mm_set1_ps(input.min_confidence);
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let depth = _mm_loadu_ps(input.depth.as_ptr().add(i));
+                let confidence = _mm_loadu_ps(input.confidence.as_ptr().add(i));
+
+                let in_range = _mm_and_ps(
+                    _mm_cmpge_ps(depth, min_depth),
+                    _mm_cmple_ps(depth, max_depth),
+                );
+                let valid = _mm_and_ps(
+                    _mm_and_ps(_mm_cmpgt_ps(depth, zero), in_range),
+                    _mm_cmpge_ps(confidence, min_confidence),
+                );
+                bits |= (_mm_movemask_ps(valid) as u64) << (lane_group * LANES);
+            }
+
+            words[block] = bits;
+        }
+    }
+
+    /// For each 8-bit lane mask, the `vpermps` lane indices that move the selected lanes to the
+    /// front, in order
+    static COMPACT_PERMUTE_8: [[u32; 8]; 256] = {
+        let mut table = [[0; 8]; 256];
+        let mut mask = 0;
+        while mask < 256 {
+            let (mut lane, mut slot) = (0, 0);
+            while lane < 8 {
+                if mask & (1 << lane) != 0 {
+                    table[mask][slot] = lane as u32;
+                    slot += 1;
+                }
+                lane += 1;
+            }
+            mask += 1;
+        }
+        table
+    };
+
+    /// Compact whole groups of 8 pixels, returning how many pixels were done and how many
+    /// points were written
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn compact_avx2(
+        input: &CompactInput,
+        out: &mut DensePoints,
+    ) -> (usize, usize) {
+        const LANES: usize = 8;
+        let end = input.depth.len() / LANES * LANES;
+        let zero = _mm256_setzero_ps();
+        let min_depth = _mm256_set1_ps(input.min_depth);
+        let max_depth = _mm256_set1_ps(input.max_depth);
+        let min_confidence = _mm256_set1_ps(input.min_confidence);
+        let mut count = 0;
+
+        for i in (0..end).step_by(LANES) {
+            let z = _mm256_loadu_ps(input.depth.as_ptr().add(i));
+            let confidence = _mm256_loadu_ps(input.confidence.as_ptr().add(i));
+            let x = _mm256_mul_ps(_mm256_loadu_ps(input.ray_x.as_ptr().add(i)), z);
+            let y = _mm256_mul_ps(_mm256_loadu_ps(input.ray_y.as_ptr().add(i)), z);
+
+            let in_range = _mm256_and_ps(
+                _mm256_cmp_ps::<_CMP_GE_OQ>(z, min_depth),
+                _mm256_cmp_ps::<_CMP_LE_OQ>(z, max_depth),
+            );
+            let valid = _mm256_and_ps(
+                _mm256_and_ps(_mm256_cmp_ps::<_CMP_GT_OQ>(z, zero), in_range),
+                _mm256_cmp_ps::<_CMP_GE_OQ>(confidence, min_confidence),
+            );
+            let lanes = _mm256_movemask_ps(valid) as usize;
+            let permute = _mm256_loadu_si256(COMPACT_PERMUTE_8[lanes].as_ptr() as *const __m256i);
+
+            // count <= i, so the whole vector stored at count stays within the frame
+            _mm256_storeu_ps(
+                out.x.as_mut_ptr().add(count),
+                _mm256_permutevar8x32_ps(x, permute),
+            );
+            _mm256_storeu_ps(
+                out.y.as_mut_ptr().add(count),
+                _mm256_permutevar8x32_ps(y, permute),
+            );
+            _mm256_storeu_ps(
+                out.z.as_mut_ptr().add(count),
+                _mm256_permutevar8x32_ps(z, permute),
+            );
+            _mm256_storeu_ps(
+                out.confidence.as_mut_ptr().add(count),
+                _mm256_permutevar8x32_ps(confidence, permute),
+            );
+            count += lanes.count_ones() as usize;
+        }
+
+        (end, count)
+    }
+
+    /// Move the lanes of `value` selected by `shuffle` to the front
+    #[target_feature(enable = "sse4.1")]
+    #[inline]
+    unsafe fn shuffle_sse41(value: __m128, shuffle: __m128i) -> __m128 {
+        _mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(value), shuffle))
+    }
+
+    /// Compact whole groups of 4 pixels, returning how many pixels were done and how many
+    /// points were written
+    #[target_feature(enable = "sse4.1")]
+    pub(super) unsafe fn compact_sse41(
+        input: &CompactInput,
+        out: &mut DensePoints,
+    ) -> (usize, usize) {
+        const LANES: usize = 4;
+        let end = input.depth.len() / LANES * LANES;
+        let zero = _mm_setzero_ps();
+        let min_depth = _mm_set1_ps(input.min_depth);
+        let max_depth = _mm_set1_ps(input.max_depth);
+        let min_confidence = _mm_set1_ps(input.min_confidence);
+        let mut count = 0;
+
+        for i in (0..end).step_by(LANES) {
+            let z = _mm_loadu_ps(input.depth.as_ptr().add(i));
+            let confidence = _mm_loadu_ps(input.confidence.as_ptr().add(i));
+            let x = _mm_mul_ps(_mm_loadu_ps(input.ray_x.as_ptr().add(i)), z);
+            let y = _mm_mul_ps(_mm_loadu_ps(input.ray_y.as_ptr().add(i)), z);
+
+            let in_range = _mm_and_ps(_mm_cmpge_ps(z, min_depth), _mm_cmple_ps(z, max_depth));
+            let valid = _mm_and_ps(
+                _mm_and_ps(_mm_cmpgt_ps(z, zero), in_range),
+                _mm_cmpge_ps(confidence, min_confidence),
+            );
+            let lanes = _mm_movemask_ps(valid) as usize;
+            let shuffle = _mm_loadu_si128(COMPACT_SHUFFLE_4[lanes].as_ptr() as *const __m128i);
+
+            // count <= i, so the whole vector stored at count stays within the frame
+            _mm_storeu_ps(out.x.as_mut_ptr().add(count), shuffle_sse41(x, shuffle));
+            _mm_storeu_ps(out.y.as_mut_ptr().add(count), shuffle_sse41(y, shuffle));
+            _mm_storeu_ps(out.z.as_mut_ptr().add(count), shuffle_sse41(z, shuffle));
+            _mm_storeu_ps(
+                out.confidence.as_mut_ptr().add(count),
+                shuffle_sse41(confidence, shuffle),
+            );
+            count += lanes.count_ones() as usize;
+        }
+
+        (end, count)
+    }
+
+    /// Load 8 `i16`s as `f32`s
+    #[target_feature(enable = "avx2")]
+    #[inline]
+    unsafe fn load_i16_avx2(data: &[i16], i: usize) -> __m256 {
+        let packed = _mm_loadu_si128(data.as_ptr().add(i) as *const __m128i);
+        _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(packed))
+    }
+
+    /// [super::atan2] for 8 lanes
+    #[target_feature(enable = "avx2")]
+    #[inline]
+    unsafe fn atan2_avx2(y: __m256, x: __m256) -> __m256 {
+        let sign = _mm256_set1_ps(-0.0);
+        let ax = _mm256_andnot_ps(sign, x);
+        let ay = _mm256_andnot_ps(sign, y);
+        let a = _mm256_div_ps(
+            _mm256_min_ps(ax, ay),
+            _mm256_max_ps(_mm256_max_ps(ax, ay), _mm256_set1_ps(f32::MIN_POSITIVE)),
+        );
+        let s = _mm256_mul_ps(a, a);
+
+        let mut r = _mm256_set1_ps(ATAN_COEFFICIENTS[0]);
+        for &c in &ATAN_COEFFICIENTS[1..] {
+            r = _mm256_add_ps(_mm256_mul_ps(r, s), _mm256_set1_ps(c));
+        }
+        r = _mm256_mul_ps(r, a);
+
+        let zero = _mm256_setzero_ps();
+        r = _mm256_blendv_ps(
+            r,
+            _mm256_sub_ps(_mm256_set1_ps(FRAC_PI_2), r),
+            _mm256_cmp_ps::<_CMP_GT_OQ>(ay, ax),
+        );
+        r = _mm256_blendv_ps(
+            r,
+            _mm256_sub_ps(_mm256_set1_ps(PI), r),
+            _mm256_cmp_ps::<_CMP_LT_OQ>(x, zero),
+        );
+        _mm256_blendv_ps(
+            r,
+            _mm256_xor_ps(r, sign),
+            _mm256_cmp_ps::<_CMP_LT_OQ>(y, zero),
+        )
+    }
+
+    /// Reconstruct whole groups of 8 pixels, returning how many pixels were done
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn reconstruct_avx2(
+        input: &PhaseInput,
+        depth: &mut [f32],
+        amplitude: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 8;
+        let end = depth.len() / LANES * LANES;
+        let zero = _mm256_setzero_ps();
+        let tau = _mm256_set1_ps(TAU);
+        let half = _mm256_set1_ps(0.5);
+        let depth_scale = _mm256_set1_ps(input.depth_scale);
+        let [phase0, phase1, phase2, phase3] = input.phases;
+
+        for i in (0..end).step_by(LANES) {
+            let in_phase = _mm256_sub_ps(load_i16_avx2(phase0, i), load_i16_avx2(phase2, i));
+            let quadrature = _mm256_sub_ps(load_i16_avx2(phase3, i), load_i16_avx2(phase1, i));
+
+            let angle = atan2_avx2(quadrature, in_phase);
+            let angle = _mm256_blendv_ps(
+                angle,
+                _mm256_add_ps(angle, tau),
+                _mm256_cmp_ps::<_CMP_LT_OQ>(angle, zero),
+            );
+            _mm256_storeu_ps(depth.as_mut_ptr().add(i), _mm256_mul_ps(angle, depth_scale));
+
+            let power = _mm256_add_ps(
+                _mm256_mul_ps(in_phase, in_phase),
+                _mm256_mul_ps(quadrature, quadrature),
+            );
+            _mm256_storeu_ps(
+                amplitude.as_mut_ptr().add(i),
+                _mm256_mul_ps(_mm256_sqrt_ps(power), half),
+            );
+        }
+
+        end
+    }
+
+    /// Load 4 `i16`s as `f32`s
+    #[target_feature(enable = "sse4.1")]
+    #[inline]
+    unsafe fn load_i16_sse41(data: &[i16], i: usize) -> __m128 {
+        let packed = _mm_loadl_epi64(data.as_ptr().add(i) as *const __m128i);
+        _mm_cvtepi32_ps(_mm_cvtepi16_epi32(packed))
+    }
+
+    /// [super::atan2] for 4 lanes
+    #[target_feature(enable = "sse4.1")]
+    #[inline]
+    unsafe fn atan2_sse41(y: __m128, x: __m128) -> __m128 {
+        let sign = _mm_set1_ps(-0.0);
+        let ax = _mm_andnot_ps(sign, x);
+        let ay = _mm_andnot_ps(sign, y);
+        let a = _mm_div_ps(
+            _mm_min_ps(ax, ay),
+            _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(f32::MIN_POSITIVE)),
+        );
+        let s = _mm_mul_ps(a, a);
+
+        let mut r = _mm_set1_ps(ATAN_COEFFICIENTS[0]);
+        for &c in &ATAN_COEFFICIENTS[1..] {
+            r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(c));
+        }
+        r = _mm_mul_ps(r, a);
+
+        let zero = _mm_setzero_ps();
+        r = _mm_blendv_ps(
+            r,
+            _mm_sub_ps(_mm_set1_ps(FRAC_PI_2), r),
+            _mm_cmpgt_ps(ay, ax),
+        );
+        r = _mm_blendv_ps(r, _mm_sub_ps(_mm_set1_ps(PI), r), _mm_cmplt_ps(x, zero));
+        _mm_blendv_ps(r, _mm_xor_ps(r, sign), _mm_cmplt_ps(y, zero))
+    }
+
+    /// Reconstruct whole groups of 4 pixels, returning how many pixels were done
+    #[target_feature(enable = "sse4.1")]
+    pub(super) unsafe fn reconstruct_sse41(
+        input: &PhaseInput,
+        depth: &mut [f32],
+        amplitude: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 4;
+        let end = depth.len() / LANES * LANES;
+        let zero = _mm_setzero_ps();
+        let tau = _mm_set1_ps(TAU);
+        let half = _mm_set1_ps(0.5);
+        let depth_scale = _mm_set1_ps(input.depth_scale);
+        let [phase0, phase1, phase2, phase3] = input.phases;
+
+        for i in (0..end).step_by(LANES) {
+            let in_phase = _mm_sub_ps(load_i16_sse41(phase0, i), load_i16_sse41(phase2, i));
+            let quadrature = _mm_sub_ps(load_i16_sse41(phase3, i), load_i16_sse41(phase1, i));
+
+            let angle = atan2_sse41(quadrature, in_phase);
+            let angle = _mm_blendv_ps(angle, _mm_add_ps(angle, tau), _mm_cmplt_ps(angle, zero));
+            _mm_storeu_ps(depth.as_mut_ptr().add(i), _mm_mul_ps(angle, depth_scale));
+
+            let power = _mm_add_ps(
+                _mm_mul_ps(in_phase, in_phase),
+                _mm_mul_ps(quadrature, quadrature),
+            );
+            _mm_storeu_ps(
+                amplitude.as_mut_ptr().add(i),
+                _mm_mul_ps(_mm_sqrt_ps(power), half),
+            );
+        }
+
+        end
+    }
+
+    /// Smooth whole groups of 8 pixels, returning how many pixels were done
+    #[target_feature(enable = "avx2")]
+    pub(super) unsafe fn smooth_avx2(
+        input: &TemporalInput,
+        state: &mut [f32],
+        out: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 8;
+        let end = state.len() / LANES * LANES;
+        let zero = _mm256_setzero_ps();
+        let one = _mm256_set1_ps(1.0);
+        let sign = _mm256_set1_ps(-0.0);
+        let alpha = _mm256_set1_ps(input.alpha);
+        let confidence_scale = _mm256_set1_ps(input.confidence_scale);
+        let jump_threshold = _mm256_set1_ps(input.jump_threshold);
+
+        for i in (0..end).step_by(LANES) {
+            let depth = _mm256_loadu_ps(input.depth.as_ptr().add(i));
+            let confidence = _mm256_loadu_ps(input.confidence.as_ptr().add(i));
+            let previous = _mm256_loadu_ps(state.as_ptr().add(i));
+
+            let weight = _mm256_min_ps(
+                _mm256_max_ps(_mm256_mul_ps(confidence, confidence_scale), zero),
+                one,
+            );
+            let weight = _mm256_mul_ps(weight, alpha);
+            let change = _mm256_sub_ps(depth, previous);
+            let next = _mm256_add_ps(previous, _mm256_mul_ps(change, weight));
+            let reset = _mm256_or_ps(
+                _mm256_cmp_ps::<_CMP_GT_OQ>(_mm256_andnot_ps(sign, change), jump_threshold),
+                _mm256_cmp_ps::<_CMP_LE_OQ>(previous, zero),
+            );
+            let next = _mm256_blendv_ps(next, depth, reset);
+
+            let valid = _mm256_cmp_ps::<_CMP_GT_OQ>(depth, zero);
+            _mm256_storeu_ps(
+                state.as_mut_ptr().add(i),
+                _mm256_blendv_ps(previous, next, valid),
+            );
+            _mm256_storeu_ps(out.as_mut_ptr().add(i), _mm256_and_ps(next, valid));
+        }
+
+        end
+    }
+
+    /// Smooth whole groups of 4 pixels, returning how many pixels were done
+    #[target_feature(enable = "sse4.1")]
+    pub(super) unsafe fn smooth_sse41(
+        input: &TemporalInput,
+        state: &mut [f32],
+        out: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 4;
+        let end = state.len() / LANES * LANES;
+        let zero = _mm_setzero_ps();
+        let one = _mm_set1_ps(1.0);
+        let sign = _mm_set1_ps(-0.0);
+        let alpha = _mm_set1_ps(input.alpha);
+        let confidence_scale = _mm_set1_ps(input.confidence_scale);
+        let jump_threshold = _mm_set1_ps(input.jump_threshold);
+
+        for i in (0..end).step_by(LANES) {
+            let depth = _mm_loadu_ps(input.depth.as_ptr().add(i));
+            let confidence = _mm_loadu_ps(input.confidence.as_ptr().add(i));
+            let previous = _mm_loadu_ps(state.as_ptr().add(i));
+
+            let weight = _mm_min_ps(
+                _mm_max_ps(_mm_mul_ps(confidence, confidence_scale), zero),
+                one,
+            );
+            let weight = _mm_mul_ps(weight, alpha);
+            let change = _mm_sub_ps(depth, previous);
+            let next = _mm_add_ps(previous, _mm_mul_ps(change, weight));
+            let reset = _mm_or_ps(
+                _mm_cmpgt_ps(_mm_andnot_ps(sign, change), jump_threshold),
+                _mm_cmple_ps(previous, zero),
+            );
+            let next = _mm_blendv_ps(next, depth, reset);
+
+            let valid = _mm_cmpgt_ps(depth, zero);
+            _mm_storeu_ps(
+                state.as_mut_ptr().add(i),
+                _mm_blendv_ps(previous, next, valid),
+            );
+            _mm_storeu_ps(out.as_mut_ptr().add(i), _mm_and_ps(next, valid));
+        }
+
+        end
+    }
+}
+
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use std::arch::aarch64::*;
+
+    use std::f32::consts::{FRAC_PI_2, PI, TAU};
+
+    use super::{
+        CompactInput, PhaseInput, ProjectionInput, TemporalInput, ThresholdInput,
+        ATAN_COEFFICIENTS, COMPACT_SHUFFLE_4, MASK_BITS,
+    };
+    use crate::projection::{DensePoints, ProjectedPoints};
+
+    /// Per-lane bit weights for collapsing a 4-lane comparison into 4 mask bits
+    const LANE_BITS: [u32; 4] = [1, 2, 4, 8];
+
+    #[target_feature(enable = "neon")]
+    pub(super) unsafe fn project_neon(
+        input: &ProjectionInput,
+        out: &mut ProjectedPoints,
+        blocks: usize,
+    ) {
+        const LANES: usize = 4;
+        let min_confidence = vdupq_n_f32(input.min_confidence);
+        let zero = vdupq_n_f32(0.0);
+        let lane_bits = vld1q_u32(LANE_BITS.as_ptr());
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let z = vld1q_f32(input.depth.as_ptr().add(i));
+                let confidence = vld1q_f32(input.confidence.as_ptr().add(i));
+                let ray_x = vld1q_f32(input.ray_x.as_ptr().add(i));
+                let ray_y = vld1q_f32(input.ray_y.as_ptr().add(i));
+
+                vst1q_f32(out.x.as_mut_ptr().add(i), vmulq_f32(ray_x, z));
+                vst1q_f32(out.y.as_mut_ptr().add(i), vmulq_f32(ray_y, z));
+                vst1q_f32(out.z.as_mut_ptr().add(i), z);
+
+                let valid = vandq_u32(vcgtq_f32(z, zero), vcgeq_f32(confidence, min_confidence));
+                let lane_mask = vaddvq_u32(vandq_u32(valid, lane_bits));
+                bits |= (lane_mask as u64) << (lane_group * LANES);
+            }
+
+            out.valid[block] = bits;
+        }
+    }
+
+    #[target_feature(enable = "neon")]
+    pub(super) unsafe fn threshold_neon(input: &ThresholdInput, words: &mut [u64], blocks: usize) {
+        const LANES: usize = 4;
+        let zero = vdupq_n_f32(0.0);
+        let min_depth = vdupq_n_f32(input.min_depth);
+        let max_depth = vdupq_n_f32(input.max_depth);
+        let min_confidence = vdupq_n_f32(input.min_confidence);
+        let lane_bits = vld1q_u32(LANE_BITS.as_ptr());
+
+        for block in 0..blocks {
+            let mut bits = 0;
+
+            for lane_group in 0..MASK_BITS / LANES {
+                let i = block * MASK_BITS + lane_group * LANES;
+
+                let depth = vld1q_f32(input.depth.as_ptr().add(i));
+                let confidence = vld1q_f32(input.confidence.as_ptr().add(i));
+
+                let in_range = vandq_u32(vcgeq_f32(depth, min_depth), vcleq_f32(depth, max_depth));
+                let valid = vandq_u32(
+                    vandq_u32(vcgtq_f32(depth, zero), in_range),
+                    vcgeq_f32(confidence, min_confidence),
+                );
+                let lane_mask = vaddvq_u32(vandq_u32(valid, lane_bits));
+                bits |= (lane_mask as u64) << (lane_group * LANES);
+            }
+
+            words[block] = bits;
+        }
+    }
+
+    /// Move the lanes of `value` selected by `shuffle` to the front
+    #[target_feature(enable = "neon")]
+    #[inline]
+    unsafe fn shuffle_neon(value: float32x4_t, shuffle: uint8x16_t) -> float32x4_t {
+        vreinterpretq_f32_u8(vqtbl1q_u8(vreinterpretq_u8_f32(value), shuffle))
+    }
+
+    /// Compact whole groups of 4 pixels, returning how many pixels were done and how many
+    /// points were written
+    #[target_feature(enable = "neon")]
+    pub(super) unsafe fn compact_neon(
+        input: &CompactInput,
+        out: &mut DensePoints,
+    ) -> (usize, usize) {
+        const LANES: usize = 4;
+        let end = input.depth.len() / LANES * LANES;
+        let zero = vdupq_n_f32(0.0);
+        let min_depth = vdupq_n_f32(input.min_depth);
+        let max_depth = vdupq_n_f32(input.max_depth);
+        let min_confidence = vdupq_n_f32(input.min_confidence);
+        let lane_bits = vld1q_u32(LANE_BITS.as_ptr());
+        let mut count = 0;
+
+        for i in (0..end).step_by(LANES) {
+            let z = vld1q_f32(input.depth.as_ptr().add(i));
+            let confidence = vld1q_f32(input.confidence.as_ptr().add(i));
+            let x = vmulq_f32(vld1q_f32(input.ray_x.as_ptr().add(i)), z);
+            let y = vmulq_f32(vld1q_f32(input.ray_y.as_ptr().add(i)), z);
+
+            let in_range = vandq_u32(vcgeq_f32(z, min_depth), vcleq_f32(z, max_depth));
+            let valid = vandq_u32(
+                vandq_u32(vcgtq_f32(z, zero), in_range),
+                vcgeq_f32(confidence, min_confidence),
+            );
+            let lanes = vaddvq_u32(vandq_u32(valid, lane_bits)) as usize;
+            let shuffle = vld1q_u8(COMPACT_SHUFFLE_4[lanes].as_ptr());
+
+            // count <= i, so the whole vector stored at count stays within the frame
+            vst1q_f32(out.x.as_mut_ptr().add(count), shuffle_neon(x, shuffle));
+            vst1q_f32(out.y.as_mut_ptr().add(count), shuffle_neon(y, shuffle));
+            vst1q_f32(out.z.as_mut_ptr().add(count), shuffle_neon(z, shuffle));
+            vst1q_f32(
+                out.confidence.as_mut_ptr().add(count),
+                shuffle_neon(confidence, shuffle),
+            );
+            count += lanes.count_ones() as usize;
+        }
+
+        (end, count)
+    }
+
+    /// Load 4 `i16`s as `f32`s
+    #[target_feature(enable = "neon")]
+    #[inline]
+    unsafe fn load_i16_neon(data: &[i16], i: usize) -> float32x4_t {
+        vcvtq_f32_s32(vmovl_s16(vld1_s16(data.as_ptr().add(i))))
+    }
+
+    /// [super::atan2] for 4 lanes
+    #[target_feature(enable = "neon")]
+    #[inline]
+    unsafe fn atan2_neon(y: float32x4_t, x: float32x4_t) -> float32x4_t {
+        let ax = vabsq_f32(x);
+        let ay = vabsq_f32(y);
+        let a = vdivq_f32(
+            vminq_f32(ax, ay),
+            vmaxq_f32(vmaxq_f32(ax, ay), vdupq_n_f32(f32::MIN_POSITIVE)),
+        );
+        let s = vmulq_f32(a, a);
+
+        let mut r = vdupq_n_f32(ATAN_COEFFICIENTS[0]);
+        for &c in &ATAN_COEFFICIENTS[1..] {
+            r = vaddq_f32(vmulq_f32(r, s), vdupq_n_f32(c));
+        }
+        r = vmulq_f32(r, a);
+
+        let zero = vdupq_n_f32(0.0);
+        r = vbslq_f32(vcgtq_f32(ay, ax), vsubq_f32(vdupq_n_f32(FRAC_PI_2), r), r);
+        r = vbslq_f32(vcltq_f32(x, zero), vsubq_f32(vdupq_n_f32(PI), r), r);
+        vbslq_f32(vcltq_f32(y, zero), vnegq_f32(r), r)
+    }
+
+    /// Reconstruct whole groups of 4 pixels, returning how many pixels were done
+    #[target_feature(enable = "neon")]
+    pub(super) unsafe fn reconstruct_neon(
+        input: &PhaseInput,
+        depth: &mut [f32],
+        amplitude: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 4;
+        let end = depth.len() / LANES * LANES;
+        let zero = vdupq_n_f32(0.0);
+        let tau = vdupq_n_f32(TAU);
+        let half = vdupq_n_f32(0.5);
+        let depth_scale = vdupq_n_f32(input.depth_scale);
+        let [phase0, phase1, phase2, phase3] = input.phases;
+
+        for i in (0..end).step_by(LANES) {
+            let in_phase = vsubq_f32(load_i16_neon(phase0, i), load_i16_neon(phase2, i));
+            let quadrature = vsubq_f32(load_i16_neon(phase3, i), load_i16_neon(phase1, i));
+
+            let angle = atan2_neon(quadrature, in_phase);
+            let angle = vbslq_f32(vcltq_f32(angle, zero), vaddq_f32(angle, tau), angle);
+            vst1q_f32(depth.as_mut_ptr().add(i), vmulq_f32(angle, depth_scale));
+
+            let power = vaddq_f32(
+                vmulq_f32(in_phase, in_phase),
+                vmulq_f32(quadrature, quadrature),
+            );
+            vst1q_f32(
+                amplitude.as_mut_ptr().add(i),
+                vmulq_f32(vsqrtq_f32(power), half),
+            );
+        }
+
+        end
+    }
+
+    /// Smooth whole groups of 4 pixels, returning how many pixels were done
+    #[target_feature(enable = "neon")]
+    pub(super) unsafe fn smooth_neon(
+        input: &TemporalInput,
+        state: &mut [f32],
+        out: &mut [f32],
+    ) -> usize {
+        const LANES: usize = 4;
+        let end = state.len() / LANES * LANES;
+        let zero = vdupq_n_f32(0.0);
+        let one = vdupq_n_f32(1.0);
+        let alpha = vdupq_n_f32(input.alpha);
+        let confidence_scale = vdupq_n_f32(input.confidence_scale);
+        let jump_threshold = vdupq_n_f32(input.jump_threshold);
+
+        for i in (0..end).step_by(LANES) {
+            let depth = vld1q_f32(input.depth.as_ptr().add(i));
+            let confidence = vld1q_f32(input.confidence.as_ptr().add(i));
+            let previous = vld1q_f32(state.as_ptr().add(i));
+
+            // vmaxnmq rather than vmaxq so a NaN confidence gives a weight of 0, like f32::max
+            let weight = vminq_f32(
+                vmaxnmq_f32(vmulq_f32(confidence, confidence_scale), zero),
+                one,
+            );
+            let weight = vmulq_f32(weight, alpha);
+            let change = vsubq_f32(depth, previous);
+            let next = vaddq_f32(previous, vmulq_f32(change, weight));
+            let reset = vorrq_u32(
+                vcgtq_f32(vabsq_f32(change), jump_threshold),
+                vcleq_f32(previous, zero),
+            );
+            let next = vbslq_f32(reset, depth, next);
+
+            let valid = vcgtq_f32(depth, zero);
+            vst1q_f32(state.as_mut_ptr().add(i), vbslq_f32(valid, next, previous));
+            vst1q_f32(out.as_mut_ptr().add(i), vbslq_f32(valid, next, zero));
+        }
+
+        end
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// Lengths around the block sizes of every kernel, so each one's scalar tail is exercised
+    const LENGTHS: [usize; 10] = [0, 1, 3, 7, 8, 63, 64, 65, 129, 1003];
+
+    /// Deterministic values in `low..high`, with a few exact zeros and values on `edges` mixed in
+    fn values(seed: u64, len: usize, low: f32, high: f32, edges: &[f32]) -> Vec<f32> {
+        let mut state = seed;
+        (0..len)
+            .map(|index| {
+                state = state
+                    .wrapping_mul(6_364_136_223_846_793_005)
+                    .wrapping_add(1_442_695_040_888_963_407);
+                let unit = (state >> 40) as f32 / (1u64 << 24) as f32;
+                match index % 11 {
+                    0 => 0.0,
+                    5 => edges[index % edges.len()],
+                    _ => low + unit * (high - low),
+                }
+            })
+            .collect()
+    }
+
+    fn bits(values: &[f32]) -> Vec<u32> {
+        values.iter().map(|value| value.to_bits()).collect()
+    }
+
+    /// Run `case` for every length with each supported vector kernel and with the scalar one
+    fn for_each_case(mut case: impl FnMut(Kernel, usize)) {
+        for kernel in Kernel::supported().filter(|&kernel| kernel != Kernel::Scalar) {
+            for len in LENGTHS {
+                case(kernel, len);
+            }
+        }
+    }
+
+    #[test]
+    fn project_matches_scalar() {
+        for_each_case(|kernel, len| {
+            let ray_x = values(1, len, -0.6, 0.6, &[0.0]);
+            let ray_y = values(2, len, -0.5, 0.5, &[0.0]);
+            let depth = values(3, len, -0.5, 4.0, &[-0.0, 1.0]);
+            let confidence = values(4, len, 0.0, 255.0, &[30.0]);
+            let input = ProjectionInput {
+                ray_x: &ray_x,
+                ray_y: &ray_y,
+                depth: &depth,
+                confidence: &confidence,
+                min_confidence: 30.0,
+            };
+
+            let run = |kernel| {
+                let mut out = ProjectedPoints::new();
+                out.x.resize(len, f32::NAN);
+                out.y.resize(len, f32::NAN);
+                out.z.resize(len, f32::NAN);
+                out.valid.resize(len.div_ceil(MASK_BITS), !0);
+                project(kernel, &input, &mut out);
+                out
+            };
+            let (expected, actual) = (run(Kernel::Scalar), run(kernel));
+            assert_eq!(bits(&actual.x), bits(&expected.x), "{kernel:?}, {len}");
+            assert_eq!(bits(&actual.y), bits(&expected.y), "{kernel:?}, {len}");
+            assert_eq!(bits(&actual.z), bits(&expected.z), "{kernel:?}, {len}");
+            assert_eq!(actual.valid, expected.valid, "{kernel:?}, {len}");
+        });
+    }
+
+    #[test]
+    fn threshold_matches_scalar() {
+        for_each_case(|kernel, len| {
+            let depth = values(5, len, -0.5, 4.0, &[0.5, 3.0, -0.0]);
+            let confidence = values(6, len, 0.0, 255.0, &[30.0]);
+            let input = ThresholdInput {
+                depth: &depth,
+                confidence: &confidence,
+                min_depth: 0.5,
+                max_depth: 3.0,
+                min_confidence: 30.0,
+            };
+
+            let run = |kernel| {
+                let mut words = vec![!0; len.div_ceil(MASK_BITS)];
+                threshold(kernel, &input, &mut words);
+                words
+            };
+            assert_eq!(run(kernel), run(Kernel::Scalar), "{kernel:?}, {len}");
+        });
+    }
+
+    #[test]
+    fn compact_matches_scalar() {
+        for_each_case(|kernel, len| {
+            let ray_x = values(7, len, -0.6, 0.6, &[0.0]);
+            let ray_y = values(8, len, -0.5, 0.5, &[0.0]);
+            let depth = values(9, len, -0.5, 4.0, &[0.5, 3.0, -0.0]);
+            let confidence = values(10, len, 0.0, 255.0, &[30.0]);
+            let input = CompactInput {
+                ray_x: &ray_x,
+                ray_y: &ray_y,
+                depth: &depth,
+                confidence: &confidence,
+                min_depth: 0.5,
+                max_depth: 3.0,
+                min_confidence: 30.0,
+            };
+
+            let run = |kernel| {
+                let mut out = DensePoints::new();
+                for plane in [&mut out.x, &mut out.y, &mut out.z, &mut out.confidence] {
+                    plane.resize(len, f32::NAN);
+                }
+                let count = compact(kernel, &input, &mut out);
+                let planes = [&out.x, &out.y, &out.z, &out.confidence];
+                (count, planes.map(|plane| bits(&plane[..count])))
+            };
+            assert_eq!(run(kernel), run(Kernel::Scalar), "{kernel:?}, {len}");
+        });
+    }
+
+    #[test]
+    fn reconstruct_matches_scalar() {
+        for_each_case(|kernel, len| {
+            let phases: [Vec<i16>; 4] = std::array::from_fn(|phase| {
+                values(11 + phase as u64, len, -2000.0, 2000.0, &[0.0])
+                    .into_iter()
+                    .map(|value| value as i16)
+                    .collect()
+            });
+            let input = PhaseInput {
+                phases: phases.each_ref().map(|phase| phase.as_slice()),
+                depth_scale: 4.0 / TAU,
+            };
+
+            let run = |kernel| {
+                let mut depth = vec![f32::NAN; len];
+                let mut amplitude = vec![f32::NAN; len];
+                reconstruct(kernel, &input, &mut depth, &mut amplitude);
+                (bits(&depth), bits(&amplitude))
+            };
+            assert_eq!(run(kernel), run(Kernel::Scalar), "{kernel:?}, {len}");
+        });
+    }
+
+    #[test]
+    fn smooth_matches_scalar() {
+        for_each_case(|kernel, len| {
+            let depth = values(15, len, -0.5, 4.0, &[-0.0]);
+            let confidence = values(16, len, -10.0, 300.0, &[0.0, 100.0]);
+            let previous = values(17, len, 0.0, 4.0, &[1.0]);
+            let input = TemporalInput {
+                depth: &depth,
+                confidence: &confidence,
+                alpha: 0.3,
+                confidence_scale: 0.01,
+                jump_threshold: 0.2,
+            };
+
+            let run = |kernel| {
+                let mut state = previous.clone();
+                let mut out = vec![f32::NAN; len];
+                smooth(kernel, &input, &mut state, &mut out);
+                (bits(&state), bits(&out))
+            };
+            assert_eq!(run(kernel), run(Kernel::Scalar), "{kernel:?}, {len}");
+        });
+    }
+}
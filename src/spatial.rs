@@ -0,0 +1,269 @@
+//! Denoising depth frames within a single frame.
+//!
+//! [MedianFilter] and [BilateralFilter] work directly on row-major depth planes, writing into a
+//! buffer owned by the caller, so no conversion or allocation is needed per frame. Pixels
+//! without a valid depth (0) are never used as neighbours and stay 0 in the output, so holes are
+//! not filled in and do not drag the edges of surfaces towards the camera.
+//!
+//! Frames are split into bands of rows that can be filtered in parallel, and each band is
+//! walked in tiles small enough that the rows a tile reads stay in L1 cache.
+
+use crate::{projection::FrameSizeMismatch, workers::Workers, FrameData};
+
+/// Width in pixels of the tiles a band of rows is processed in
+const TILE_WIDTH: usize = 64;
+/// Height in pixels of the tiles a band of rows is processed in
+const TILE_HEIGHT: usize = 16;
+
+/// Number of entries in the table of [BilateralFilter] depth weights
+const RANGE_TABLE_SIZE: usize = 256;
+/// Depth differences beyond this many standard deviations are given no weight
+const RANGE_CUTOFF: f32 = 3.0;
+
+/// The size of the square neighbourhood a [MedianFilter] takes the median of
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MedianSize {
+    /// 3x3 pixels
+    Three,
+    /// 5x5 pixels
+    Five,
+}
+
+impl MedianSize {
+    fn radius(self) -> usize {
+        match self {
+            MedianSize::Three => 1,
+            MedianSize::Five => 2,
+        }
+    }
+}
+
+/// Replaces each valid pixel with the median of the valid pixels around it, removing isolated
+/// spikes while keeping edges sharp
+pub struct MedianFilter {
+    width: u16,
+    height: u16,
+    radius: usize,
+    workers: Workers,
+}
+
+impl MedianFilter {
+    /// Build a filter for `width`x`height` frames
+    pub fn new(width: u16, height: u16, size: MedianSize) -> Self {
+        Self {
+            width,
+            height,
+            radius: size.radius(),
+            workers: Workers::new(1),
+        }
+    }
+
+    /// Split each frame into `threads` bands of rows filtered in parallel. The filter keeps
+    /// `threads - 1` threads of its own parked between frames, and the thread applying it
+    /// filters a band too.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        assert!(threads >= 1, "Median filter needs at least 1 thread");
+        self.workers = Workers::new(threads);
+        self
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    /// Filter `depth` into `out`, which must hold one value per pixel
+    pub fn apply(&self, depth: &FrameData<f32>, out: &mut [f32]) -> Result<(), FrameSizeMismatch> {
+        check_size(depth, self.width, self.height)?;
+
+        let depth = depth.as_slice();
+        let (width, height) = (self.width as usize, self.height as usize);
+        let radius = self.radius;
+        filter_bands(width, height, &self.workers, out, |x, y| {
+            if !(depth[y * width + x] > 0.0) {
+                return 0.0;
+            }
+
+            let mut window = [0.0; 25];
+            let mut count = 0;
+            let columns = x.saturating_sub(radius)..(x + radius + 1).min(width);
+            for row in y.saturating_sub(radius)..(y + radius + 1).min(height) {
+                let start = row * width;
+                for &value in &depth[start + columns.start..start + columns.end] {
+                    if value > 0.0 {
+                        window[count] = value;
+                        count += 1;
+                    }
+                }
+            }
+
+            let window = &mut window[..count];
+            *window.select_nth_unstable_by(count / 2, f32::total_cmp).1
+        });
+        Ok(())
+    }
+}
+
+/// Replaces each valid pixel with an average of the valid pixels around it, weighted both by
+/// distance in the image and by difference in depth, so noise on a surface is smoothed without
+/// blending it into surfaces in front of or behind it
+pub struct BilateralFilter {
+    width: u16,
+    height: u16,
+    radius: usize,
+    workers: Workers,
+    /// Weight of each offset in the (2 * radius + 1)² neighbourhood, row-major
+    spatial_weights: Vec<f32>,
+    /// Weight of a neighbour by its absolute difference in depth, in steps of 1 / range_scale
+    range_weights: [f32; RANGE_TABLE_SIZE],
+    range_scale: f32,
+}
+
+impl BilateralFilter {
+    /// Build a filter for `width`x`height` frames averaging over a neighbourhood of
+    /// (2 * `radius` + 1)² pixels, with gaussian weights whose standard deviations are
+    /// `sigma_space` pixels and `sigma_depth` metres.
+    pub fn new(width: u16, height: u16, radius: usize, sigma_space: f32, sigma_depth: f32) -> Self {
+        assert!(
+            sigma_space > 0.0 && sigma_depth > 0.0,
+            "Standard deviations must be positive"
+        );
+
+        let diameter = 2 * radius + 1;
+        let spatial_weights = (0..diameter * diameter)
+            .map(|i| {
+                let dx = (i % diameter) as f32 - radius as f32;
+                let dy = (i / diameter) as f32 - radius as f32;
+                (-(dx * dx + dy * dy) / (2.0 * sigma_space * sigma_space)).exp()
+            })
+            .collect();
+
+        let range_scale = (RANGE_TABLE_SIZE - 1) as f32 / (RANGE_CUTOFF * sigma_depth);
+        let range_weights = std::array::from_fn(|i| {
+            let difference = i as f32 / range_scale;
+            (-(difference * difference) / (2.0 * sigma_depth * sigma_depth)).exp()
+        });
+
+        Self {
+            width,
+            height,
+            radius,
+            workers: Workers::new(1),
+            spatial_weights,
+            range_weights,
+            range_scale,
+        }
+    }
+
+    /// Split each frame into `threads` bands of rows filtered in parallel. The filter keeps
+    /// `threads - 1` threads of its own parked between frames, and the thread applying it
+    /// filters a band too.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        assert!(threads >= 1, "Bilateral filter needs at least 1 thread");
+        self.workers = Workers::new(threads);
+        self
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    /// Filter `depth` into `out`, which must hold one value per pixel
+    pub fn apply(&self, depth: &FrameData<f32>, out: &mut [f32]) -> Result<(), FrameSizeMismatch> {
+        check_size(depth, self.width, self.height)?;
+
+        let depth = depth.as_slice();
+        let (width, height) = (self.width as usize, self.height as usize);
+        let radius = self.radius;
+        let diameter = 2 * radius + 1;
+        filter_bands(width, height, &self.workers, out, |x, y| {
+            let centre = depth[y * width + x];
+            if !(centre > 0.0) {
+                return 0.0;
+            }
+
+            let mut total = 0.0;
+            let mut total_weight = 0.0;
+            let columns = x.saturating_sub(radius)..(x + radius + 1).min(width);
+            for row in y.saturating_sub(radius)..(y + radius + 1).min(height) {
+                let start = row * width;
+                let weights_start = (row + radius - y) * diameter + columns.start + radius - x;
+                let values = &depth[start + columns.start..start + columns.end];
+                let spatial_weights = &self.spatial_weights[weights_start..];
+
+                for (&value, &spatial_weight) in values.iter().zip(spatial_weights) {
+                    let step = ((value - centre).abs() * self.range_scale) as usize;
+                    if value > 0.0 && step < RANGE_TABLE_SIZE {
+                        let weight = spatial_weight * self.range_weights[step];
+                        total += value * weight;
+                        total_weight += weight;
+                    }
+                }
+            }
+
+            // The centre pixel always contributes with a weight of 1
+            total / total_weight
+        });
+        Ok(())
+    }
+}
+
+fn check_size(frame: &FrameData<f32>, width: u16, height: u16) -> Result<(), FrameSizeMismatch> {
+    if frame.width() == width && frame.height() == height {
+        Ok(())
+    } else {
+        Err(FrameSizeMismatch {
+            width: frame.width(),
+            height: frame.height(),
+            expected_width: width,
+            expected_height: height,
+        })
+    }
+}
+
+/// Set every pixel of `out` to `filter(x, y)`, splitting the rows into a band per thread of
+/// `workers` filtered in parallel
+fn filter_bands<F>(width: usize, height: usize, workers: &Workers, out: &mut [f32], filter: F)
+where
+    F: Fn(usize, usize) -> f32 + Sync,
+{
+    assert!(
+        out.len() == width * height,
+        "Output buffer must hold one value per pixel"
+    );
+    if out.is_empty() {
+        return;
+    }
+
+    let band_rows = height.div_ceil(workers.threads());
+    let bands = out.chunks_mut(band_rows * width).enumerate();
+    workers.for_each(bands, |(index, band)| {
+        filter_band(width, index * band_rows, band, &filter)
+    });
+}
+
+/// Filter the rows starting at `first_row` into `band`, a tile at a time
+fn filter_band<F>(width: usize, first_row: usize, band: &mut [f32], filter: &F)
+where
+    F: Fn(usize, usize) -> f32,
+{
+    let rows = band.len() / width;
+    for tile_top in (0..rows).step_by(TILE_HEIGHT) {
+        for tile_left in (0..width).step_by(TILE_WIDTH) {
+            let columns = tile_left..(tile_left + TILE_WIDTH).min(width);
+            for row in tile_top..(tile_top + TILE_HEIGHT).min(rows) {
+                let out = &mut band[row * width + columns.start..row * width + columns.end];
+                for (x, out) in columns.clone().zip(out) {
+                    *out = filter(x, first_row + row);
+                }
+            }
+        }
+    }
+}
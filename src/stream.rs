@@ -0,0 +1,232 @@
+//! Frames as an async [Stream], for services built on an async runtime.
+//!
+//! [FrameStream] runs the blocking [ArducamDepthCamera::request_frame] loop on a dedicated
+//! thread, copies each frame into an [OwnedFrame] and hands it to the stream through a short
+//! bounded queue, waking the task polling the stream. Awaiting a frame never blocks a runtime
+//! thread, so any number of cameras can share one runtime.
+//!
+//! The sensor is never held up by a slow consumer: when the queue is full the oldest queued
+//! frame is dropped to make room for the new one.
+
+use std::{
+    collections::VecDeque,
+    pin::Pin,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc, Mutex,
+    },
+    task::{Context, Poll, Waker},
+    thread::JoinHandle,
+    time::Duration,
+};
+
+use futures_core::Stream;
+
+use crate::{
+    backend::CameraBackend, ArducamDepthCamera, FramePool, OwnedFrame, OwnedFrameError, SdkBackend,
+};
+
+/// How long the capture thread waits on the camera before checking whether it should stop
+const POLL_TIMEOUT: Duration = Duration::from_millis(200);
+
+pub struct FrameStream<B: CameraBackend + Send + 'static = SdkBackend> {
+    shared: Arc<Shared>,
+    thread: Option<JoinHandle<ArducamDepthCamera<B>>>,
+}
+
+struct Shared {
+    queue: Mutex<Queue>,
+    capacity: usize,
+    stop: AtomicBool,
+    captured: AtomicU64,
+    dropped: AtomicU64,
+    errors: AtomicU64,
+}
+
+struct Queue {
+    frames: VecDeque<OwnedFrame>,
+    /// The task waiting for a frame, if the queue was empty when it last polled
+    waker: Option<Waker>,
+    /// Set when the capture thread exits, after which no more frames will arrive
+    finished: bool,
+}
+
+/// Counters maintained by the capture thread of a [FrameStream]
+#[derive(Debug, Clone, Copy)]
+pub struct FrameStreamStats {
+    /// Frames queued for the stream
+    pub captured: u64,
+    /// Frames discarded, either queued frames dropped to make room for a newer one or frames
+    /// that could not be copied because every buffer in the pool was in use
+    pub dropped: u64,
+    /// Failed calls to [ArducamDepthCamera::request_frame], including timeouts, and frames too
+    /// large for the pool's buffers
+    pub errors: u64,
+}
+
+impl<B: CameraBackend + Send + 'static> FrameStream<B> {
+    /// Start capturing from `camera`, which should already be opened and started in
+    /// [FrameType::DepthFrame](crate::FrameType::DepthFrame) mode, copying frames into buffers
+    /// from `pool` and queueing at most `capacity` of them.
+    ///
+    /// Every queued frame and every frame the consumer holds onto takes a buffer from `pool`,
+    /// so it should have at least `capacity` + 1 more buffers than the frames consumers will
+    /// hold at once.
+    pub fn spawn(mut camera: ArducamDepthCamera<B>, pool: FramePool, capacity: usize) -> Self {
+        assert!(capacity >= 1, "Frame stream queue needs at least 1 entry");
+
+        let shared = Arc::new(Shared {
+            queue: Mutex::new(Queue {
+                frames: VecDeque::with_capacity(capacity),
+                waker: None,
+                finished: false,
+            }),
+            capacity,
+            stop: AtomicBool::new(false),
+            captured: AtomicU64::new(0),
+            dropped: AtomicU64::new(0),
+            errors: AtomicU64::new(0),
+        });
+
+        let thread_shared = shared.clone();
+        let thread = std::thread::Builder::new()
+            .name("arducam-stream".into())
+            .spawn(move || {
+                let _finish = FinishOnExit(&thread_shared);
+                capture_loop(&mut camera, &pool, &thread_shared);
+                camera
+            })
+            .expect("Failed to spawn capture thread");
+
+        Self {
+            shared,
+            thread: Some(thread),
+        }
+    }
+
+    pub fn stats(&self) -> FrameStreamStats {
+        FrameStreamStats {
+            captured: self.shared.captured.load(Ordering::Relaxed),
+            dropped: self.shared.dropped.load(Ordering::Relaxed),
+            errors: self.shared.errors.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Stop the capture thread and get the camera back.
+    ///
+    /// This blocks until the thread's current frame request returns, so from async code it
+    /// should be called from a blocking context. Dropping the stream instead stops the thread
+    /// without waiting for it.
+    pub fn stop(mut self) -> ArducamDepthCamera<B> {
+        self.shared.stop.store(true, Ordering::Relaxed);
+        let thread = self.thread.take().unwrap();
+        thread.join().expect("Capture thread panicked")
+    }
+}
+
+impl<B: CameraBackend + Send + 'static> Drop for FrameStream<B> {
+    fn drop(&mut self) {
+        // The thread is left to exit on its own, taking the camera with it
+        self.shared.stop.store(true, Ordering::Relaxed);
+    }
+}
+
+impl<B: CameraBackend + Send + 'static> Stream for FrameStream<B> {
+    type Item = OwnedFrame;
+
+    fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<OwnedFrame>> {
+        let mut queue = self.shared.queue.lock().unwrap();
+
+        if let Some(frame) = queue.frames.pop_front() {
+            return Poll::Ready(Some(frame));
+        }
+        if queue.finished {
+            return Poll::Ready(None);
+        }
+
+        // Registered under the same lock the capture thread queues frames under, so a frame
+        // can't arrive between the check above and this
+        match &mut queue.waker {
+            Some(waker) if waker.will_wake(cx.waker()) => (),
+            waker => *waker = Some(cx.waker().clone()),
+        }
+        Poll::Pending
+    }
+}
+
+impl Shared {
+    /// Queue `frame`, dropping the oldest queued frame if the queue is full, and wake the
+    /// consumer
+    fn push(&self, frame: OwnedFrame) {
+        let mut queue = self.queue.lock().unwrap();
+        let oldest = if queue.frames.len() >= self.capacity {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            metrics_count!(FRAMES_DROPPED);
+            queue.frames.pop_front()
+        } else {
+            None
+        };
+        queue.frames.push_back(frame);
+        let waker = queue.waker.take();
+        drop(queue);
+
+        // Return the dropped frame's buffer to the pool outside the lock
+        drop(oldest);
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+
+    fn finish(&self) {
+        let mut queue = self
+            .queue
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner());
+        queue.finished = true;
+        let waker = queue.waker.take();
+        drop(queue);
+
+        if let Some(waker) = waker {
+            waker.wake();
+        }
+    }
+}
+
+/// Ends the stream when the capture thread exits, even if it panics
+struct FinishOnExit<'a>(&'a Shared);
+
+impl Drop for FinishOnExit<'_> {
+    fn drop(&mut self) {
+        self.0.finish();
+    }
+}
+
+fn capture_loop<B: CameraBackend>(
+    camera: &mut ArducamDepthCamera<B>,
+    pool: &FramePool,
+    shared: &Shared,
+) {
+    while !shared.stop.load(Ordering::Relaxed) {
+        let frame = match camera.request_frame(Some(POLL_TIMEOUT)) {
+            Ok(frame) => frame,
+            Err(_) => {
+                shared.errors.fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+        };
+
+        match frame.into_owned(pool) {
+            Ok(frame) => {
+                shared.push(frame);
+                shared.captured.fetch_add(1, Ordering::Relaxed);
+            }
+            Err(OwnedFrameError::PoolExhausted) => {
+                shared.dropped.fetch_add(1, Ordering::Relaxed);
+                metrics_count!(FRAMES_DROPPED);
+            }
+            Err(_) => {
+                shared.errors.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+}
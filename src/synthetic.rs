@@ -0,0 +1,327 @@
+//! An in-process camera backend that needs no hardware.
+//!
+//! [SyntheticBackend] renders a deterministic scene (a tilted back wall, a floor and a box
+//! sliding across the view) with sensor-like noise and invalid pixels, paced to a configurable
+//! frame rate. The same frame is produced for the same sequence number on every run, so it is
+//! suitable for benchmarks and load tests.
+//!
+//! Started in [FrameType::RawFrame] mode it produces the four phase measurements of each frame
+//! of the scene in turn, as the sensor does, for testing [PhaseDecoder](crate::phase::PhaseDecoder).
+
+use std::{
+    cell::RefCell,
+    f32::consts::{FRAC_PI_2, TAU},
+    time::{Duration, Instant},
+};
+
+use crate::{
+    backend::CameraBackend, phase::PHASES, ArducamFrameFormat, CloseError, Connection, FrameData,
+    FrameType, InitError, OpenError, ReleaseFrameError, RequestFrameError, StartError, StopError,
+};
+
+/// Width of the frames produced by [SyntheticBackend] by default, matching the sensor
+pub const SYNTHETIC_WIDTH: u16 = 240;
+/// Height of the frames produced by [SyntheticBackend] by default, matching the sensor
+pub const SYNTHETIC_HEIGHT: u16 = 180;
+/// Frame rate of [SyntheticBackend] when created through [CameraBackend::create]
+pub const SYNTHETIC_FRAME_RATE: f32 = 30.0;
+/// Unambiguous range of the raw phase frames produced by [SyntheticBackend] in metres, matching
+/// the sensor's 4 m mode
+pub const SYNTHETIC_RANGE: f32 = 4.0;
+
+/// Raw value of a pixel receiving no signal
+const RAW_OFFSET: f32 = 256.0;
+/// Amplitude of the raw signal per unit of confidence
+const RAW_GAIN: f32 = 4.0;
+
+pub struct SyntheticBackend {
+    width: u16,
+    height: u16,
+    frame_period: Option<Duration>,
+    started_at: Option<Instant>,
+    frame_type: FrameType,
+    next_frame: Instant,
+    sequence: u64,
+    spare_planes: RefCell<Vec<Box<[f32]>>>,
+    spare_raw: RefCell<Vec<Box<[i16]>>>,
+}
+
+/// A frame rendered by [SyntheticBackend]
+pub struct SyntheticFrame {
+    width: u16,
+    height: u16,
+    timestamp: u64,
+    /// Depth plane followed by confidence plane
+    planes: Box<[f32]>,
+    /// Phase measurement, or empty if not started in [FrameType::RawFrame] mode
+    raw: Box<[i16]>,
+}
+
+impl SyntheticBackend {
+    /// Create a backend producing `width`x`height` frames. With `frame_rate` set,
+    /// [CameraBackend::request_frame] blocks to keep to that rate like a real sensor;
+    /// with `None` frames are produced as fast as they are requested.
+    ///
+    /// Panics if `frame_rate` is zero, negative, infinite or NaN. Use `None` rather than a rate
+    /// of 0 for no throttling.
+    pub fn new(width: u16, height: u16, frame_rate: Option<f32>) -> Self {
+        let frame_period = frame_rate.map(|rate| {
+            assert!(
+                rate > 0.0 && rate.is_finite(),
+                "Frame rate must be positive and finite, got {rate}"
+            );
+            Duration::try_from_secs_f32(1.0 / rate)
+                .unwrap_or_else(|_| panic!("Frame rate {rate} is too low"))
+        });
+
+        Self {
+            width,
+            height,
+            frame_period,
+            started_at: None,
+            frame_type: FrameType::DepthFrame,
+            next_frame: Instant::now(),
+            sequence: 0,
+            spare_planes: RefCell::new(Vec::new()),
+            spare_raw: RefCell::new(Vec::new()),
+        }
+    }
+
+    /// Create a sensor resolution backend running at `frame_rate`, or unthrottled if `None`.
+    ///
+    /// Panics if `frame_rate` is not positive and finite, as for [SyntheticBackend::new].
+    pub fn with_frame_rate(frame_rate: Option<f32>) -> Self {
+        Self::new(SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT, frame_rate)
+    }
+
+    fn pixel_count(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+}
+
+impl CameraBackend for SyntheticBackend {
+    type Frame = SyntheticFrame;
+
+    fn create() -> Result<Self, InitError> {
+        Ok(Self::with_frame_rate(Some(SYNTHETIC_FRAME_RATE)))
+    }
+
+    fn open(&mut self, _conn: Connection, _index: i32) -> Result<(), OpenError> {
+        Ok(())
+    }
+
+    fn close(&mut self) -> Result<(), CloseError> {
+        Ok(())
+    }
+
+    fn start(&mut self, frame_type: FrameType) -> Result<(), StartError> {
+        let now = Instant::now();
+        self.started_at = Some(now);
+        self.frame_type = frame_type;
+        self.next_frame = now;
+        Ok(())
+    }
+
+    fn stop(&mut self) -> Result<(), StopError> {
+        self.started_at = None;
+        Ok(())
+    }
+
+    fn request_frame(
+        &mut self,
+        timeout: Option<Duration>,
+    ) -> Result<SyntheticFrame, RequestFrameError> {
+        let started_at = self.started_at.ok_or(RequestFrameError)?;
+
+        if let Some(period) = self.frame_period {
+            let wait = self.next_frame.saturating_duration_since(Instant::now());
+            if timeout.is_some_and(|timeout| timeout < wait) {
+                std::thread::sleep(timeout.unwrap());
+                return Err(RequestFrameError);
+            }
+            std::thread::sleep(wait);
+            // A slow consumer gets the next frame straight away rather than a burst of stale ones
+            self.next_frame = (self.next_frame + period).max(Instant::now());
+        }
+
+        let pixel_count = self.pixel_count();
+        let mut planes = self
+            .spare_planes
+            .get_mut()
+            .pop()
+            .unwrap_or_else(|| vec![0.0; pixel_count * 2].into_boxed_slice());
+        let (depth, confidence) = planes.split_at_mut(pixel_count);
+
+        let raw = if self.frame_type == FrameType::RawFrame {
+            // Each frame of the scene is measured at every phase offset in turn
+            let scene = self.sequence / PHASES as u64;
+            let phase = (self.sequence % PHASES as u64) as usize;
+            render_frame(scene, self.width, self.height, depth, confidence);
+
+            let mut raw = self
+                .spare_raw
+                .get_mut()
+                .pop()
+                .unwrap_or_else(|| vec![0; pixel_count].into_boxed_slice());
+            render_raw_phase(depth, confidence, phase, SYNTHETIC_RANGE, &mut raw);
+            raw
+        } else {
+            render_frame(self.sequence, self.width, self.height, depth, confidence);
+            Box::default()
+        };
+        self.sequence += 1;
+
+        Ok(SyntheticFrame {
+            width: self.width,
+            height: self.height,
+            timestamp: started_at.elapsed().as_nanos() as u64,
+            planes,
+            raw,
+        })
+    }
+
+    fn release_frame(&self, frame: SyntheticFrame) -> Result<(), ReleaseFrameError> {
+        if frame.planes.len() == self.pixel_count() * 2 {
+            self.spare_planes.borrow_mut().push(frame.planes);
+        }
+        if frame.raw.len() == self.pixel_count() {
+            self.spare_raw.borrow_mut().push(frame.raw);
+        }
+        Ok(())
+    }
+
+    /// The timestamp is in nanoseconds since [CameraBackend::start]
+    fn get_format(&self, frame: &SyntheticFrame, frame_type: FrameType) -> ArducamFrameFormat {
+        ArducamFrameFormat {
+            width: frame.width,
+            height: frame.height,
+            frame_type,
+            timestamp: frame.timestamp,
+        }
+    }
+
+    fn get_depth_data<'a>(&'a self, frame: &'a SyntheticFrame) -> FrameData<'a, f32> {
+        let pixel_count = frame.planes.len() / 2;
+        FrameData {
+            width: frame.width,
+            height: frame.height,
+            data: &frame.planes[..pixel_count],
+        }
+    }
+
+    fn get_confidence_data<'a>(&'a self, frame: &'a SyntheticFrame) -> FrameData<'a, f32> {
+        let pixel_count = frame.planes.len() / 2;
+        FrameData {
+            width: frame.width,
+            height: frame.height,
+            data: &frame.planes[pixel_count..],
+        }
+    }
+
+    /// Panics if the backend was not started in [FrameType::RawFrame] mode
+    fn get_raw_data<'a>(&'a self, frame: &'a SyntheticFrame) -> FrameData<'a, i16> {
+        assert!(
+            !frame.raw.is_empty(),
+            "Frame was not captured in raw frame mode"
+        );
+        FrameData {
+            width: frame.width,
+            height: frame.height,
+            data: &frame.raw,
+        }
+    }
+}
+
+/// Render frame number `sequence` of the synthetic scene into row-major `depth` (metres) and
+/// `confidence` planes of `width`x`height` pixels.
+///
+/// Invalid pixels (the outer border and a sparse scattering of dropouts) have a depth and
+/// confidence of 0.
+pub fn render_frame(
+    sequence: u64,
+    width: u16,
+    height: u16,
+    depth: &mut [f32],
+    confidence: &mut [f32],
+) {
+    let width = width as usize;
+    let height = height as usize;
+    assert!(depth.len() == width * height);
+    assert!(confidence.len() == width * height);
+
+    // The box slides across the view and wraps, taking two seconds at 30 fps
+    let box_size = height / 3;
+    let box_left = (sequence as usize * (width + box_size) / 60) % (width + box_size);
+    let box_top = height / 3;
+    let floor_top = height * 3 / 4;
+
+    let rows = depth
+        .chunks_exact_mut(width)
+        .zip(confidence.chunks_exact_mut(width));
+
+    for (row, (depth_row, confidence_row)) in rows.enumerate() {
+        for (column, (d, c)) in depth_row.iter_mut().zip(confidence_row).enumerate() {
+            let index = (row * width + column) as u64;
+            let noise = splitmix64(sequence.wrapping_mul(0x9e37_79b9) ^ index);
+
+            let border = row < 2 || column < 2 || row + 2 >= height || column + 2 >= width;
+            // Roughly 1 in 128 pixels drop out
+            if border || noise & 0x7f == 0 {
+                *d = 0.0;
+                *c = 0.0;
+                continue;
+            }
+
+            let in_box = (box_top..box_top + box_size).contains(&row)
+                && (box_left..box_left + box_size).contains(&(column + box_size));
+
+            let true_depth = if in_box {
+                1.2
+            } else if row >= floor_top {
+                // The floor recedes towards the wall
+                1.5 + 1.5 * (height - row) as f32 / (height - floor_top) as f32
+            } else {
+                // Back wall, tilted away to the right
+                3.0 + 0.4 * (column as f32 / width as f32 - 0.5)
+            };
+
+            // Uniform noise of up to 1% of the depth
+            let jitter = ((noise >> 40) as f32 / (1u64 << 24) as f32 - 0.5) * 0.02;
+
+            *d = true_depth * (1.0 + jitter);
+            *c = (600.0 / (true_depth * true_depth)).min(255.0) * (1.0 + jitter * 10.0);
+        }
+    }
+}
+
+/// Render the raw measurement at phase offset `phase` * 90 degrees of a frame of `depth` and
+/// `confidence` planes, as produced by [render_frame], for a camera whose unambiguous range is
+/// `range` metres.
+///
+/// Decoding the four phases of a frame with [PhaseDecoder](crate::phase::PhaseDecoder) gives
+/// back its depth, to within the quantisation of the raw values, and an amplitude proportional
+/// to its confidence.
+pub fn render_raw_phase(
+    depth: &[f32],
+    confidence: &[f32],
+    phase: usize,
+    range: f32,
+    raw: &mut [i16],
+) {
+    assert!(phase < PHASES);
+    assert!(depth.len() == raw.len() && confidence.len() == raw.len());
+
+    let offset = phase as f32 * FRAC_PI_2;
+    for ((raw, &depth), &confidence) in raw.iter_mut().zip(depth).zip(confidence) {
+        let shift = TAU * depth / range;
+        let amplitude = RAW_GAIN * confidence;
+        *raw = (RAW_OFFSET + amplitude * (shift + offset).cos()).round() as i16;
+    }
+}
+
+fn splitmix64(mut x: u64) -> u64 {
+    x = x.wrapping_add(0x9e37_79b9_7f4a_7c15);
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31)
+}
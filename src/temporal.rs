@@ -0,0 +1,144 @@
+//! Smoothing depth over time.
+//!
+//! Depth from the sensor jitters by around a percent from frame to frame even when nothing in
+//! the scene moves. [TemporalFilter] keeps an exponentially smoothed depth for every pixel and
+//! blends each new frame into it, giving low confidence measurements less weight. When a pixel's
+//! depth jumps by more than a threshold, as it does at the edge of a moving object, its history
+//! is discarded so the object does not leave a trail behind it.
+
+use crate::{
+    aligned::AlignedBuffer,
+    projection::FrameSizeMismatch,
+    simd::{self, Kernel, TemporalInput},
+    FrameData,
+};
+
+/// Per-pixel exponential smoothing of depth frames of a fixed size
+pub struct TemporalFilter {
+    width: u16,
+    height: u16,
+    alpha: f32,
+    full_confidence: f32,
+    jump_threshold: f32,
+    kernel: Kernel,
+    /// Smoothed depth of each pixel, or 0 where there is no history
+    state: AlignedBuffer<f32>,
+    /// The frame returned by the last [TemporalFilter::apply]
+    output: AlignedBuffer<f32>,
+}
+
+impl TemporalFilter {
+    /// Build a filter for `width`x`height` frames.
+    ///
+    /// By default a new measurement with a confidence of at least 100 is given a weight of 0.25,
+    /// and pixels whose depth changes by more than 10 cm are reset.
+    pub fn new(width: u16, height: u16) -> Self {
+        let pixel_count = width as usize * height as usize;
+        Self {
+            width,
+            height,
+            alpha: 0.25,
+            full_confidence: 100.0,
+            jump_threshold: 0.1,
+            kernel: Kernel::detect(),
+            state: AlignedBuffer::new(pixel_count, 0.0),
+            output: AlignedBuffer::new(pixel_count, 0.0),
+        }
+    }
+
+    /// Give new measurements a weight of `alpha`, between 0 and 1, against the smoothed depth.
+    /// Smaller values smooth more but take longer to follow slow movement.
+    pub fn with_alpha(mut self, alpha: f32) -> Self {
+        assert!(
+            alpha > 0.0 && alpha <= 1.0,
+            "Smoothing weight must be in (0, 1]"
+        );
+        self.alpha = alpha;
+        self
+    }
+
+    /// Give measurements the full weight from [TemporalFilter::with_alpha] at a confidence of
+    /// `full_confidence` and above, and proportionally less below it.
+    pub fn with_full_confidence(mut self, full_confidence: f32) -> Self {
+        assert!(full_confidence > 0.0, "Full confidence must be positive");
+        self.full_confidence = full_confidence;
+        self
+    }
+
+    /// Discard a pixel's history when its depth changes by more than `jump_threshold` metres
+    pub fn with_jump_threshold(mut self, jump_threshold: f32) -> Self {
+        assert!(jump_threshold >= 0.0, "Jump threshold must not be negative");
+        self.jump_threshold = jump_threshold;
+        self
+    }
+
+    /// Use `kernel` instead of the fastest one the CPU supports, e.g. to compare them.
+    ///
+    /// Panics if the CPU does not support `kernel`.
+    pub fn with_kernel(mut self, kernel: Kernel) -> Self {
+        assert!(
+            kernel.is_supported(),
+            "{kernel:?} is not supported on this CPU"
+        );
+        self.kernel = kernel;
+        self
+    }
+
+    pub fn kernel(&self) -> Kernel {
+        self.kernel
+    }
+
+    pub fn width(&self) -> u16 {
+        self.width
+    }
+
+    pub fn height(&self) -> u16 {
+        self.height
+    }
+
+    fn check_size(&self, frame: &FrameData<f32>) -> Result<(), FrameSizeMismatch> {
+        if frame.width() == self.width && frame.height() == self.height {
+            Ok(())
+        } else {
+            Err(FrameSizeMismatch {
+                width: frame.width(),
+                height: frame.height(),
+                expected_width: self.width,
+                expected_height: self.height,
+            })
+        }
+    }
+
+    /// Blend a new frame into the smoothed depth and get the result.
+    ///
+    /// Pixels without a valid depth in `depth` are 0 in the result, but keep their history for
+    /// when they next have one.
+    pub fn apply(
+        &mut self,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> Result<FrameData<'_, f32>, FrameSizeMismatch> {
+        self.check_size(depth)?;
+        self.check_size(confidence)?;
+
+        let input = TemporalInput {
+            depth: depth.as_slice(),
+            confidence: confidence.as_slice(),
+            alpha: self.alpha,
+            confidence_scale: 1.0 / self.full_confidence,
+            jump_threshold: self.jump_threshold,
+        };
+        simd::smooth(self.kernel, &input, &mut self.state, &mut self.output);
+
+        Ok(FrameData {
+            width: self.width,
+            height: self.height,
+            data: &self.output,
+        })
+    }
+
+    /// Forget every pixel's history, e.g. after the camera has moved
+    pub fn reset(&mut self) {
+        self.state.fill(0.0);
+    }
+}
@@ -0,0 +1,169 @@
+//! Downsampling point clouds to one point per voxel.
+//!
+//! Consumers that build maps at centimetre resolution gain nothing from the tens of points the
+//! sensor returns per square centimetre up close. [VoxelGrid] divides space into cubes and
+//! replaces the points in each occupied cube with their centroid.
+//!
+//! Occupied voxels are found through an open-addressing hash table keyed on the packed voxel
+//! coordinates. Each slot records the pass that last wrote it, so starting a new frame is a
+//! single increment rather than a clear of the whole table, and once the table has grown to the
+//! largest frame seen no further allocations are made.
+
+use crate::DensePoints;
+
+/// Bits per voxel coordinate in a packed key. With 1 cm voxels this spans ±10 km.
+const COORDINATE_BITS: u32 = 21;
+const COORDINATE_MASK: u64 = (1 << COORDINATE_BITS) - 1;
+const COORDINATE_MIN: i64 = -(1 << (COORDINATE_BITS - 1));
+const COORDINATE_MAX: i64 = (1 << (COORDINATE_BITS - 1)) - 1;
+
+/// Slots per point the table is sized for, keeping it at most half full
+const SLOTS_PER_POINT: usize = 2;
+
+#[derive(Clone, Copy, Default)]
+struct Slot {
+    key: u64,
+    /// The pass that last wrote this slot. Slots from earlier passes are empty.
+    generation: u32,
+    count: u32,
+    sum: [f32; 3],
+}
+
+/// Reduces point clouds to the centroid of the points in each occupied voxel
+pub struct VoxelGrid {
+    voxel_size: f32,
+    inverse_voxel_size: f32,
+    slots: Vec<Slot>,
+    /// log2 of the number of slots
+    slot_bits: u32,
+    generation: u32,
+    /// Slots written in this pass, in the order their voxels were first seen
+    occupied: Vec<u32>,
+}
+
+impl VoxelGrid {
+    /// Build a grid of cubes `voxel_size` metres across, with room for frames of up to
+    /// `max_points` points without allocating. Larger frames grow the grid.
+    pub fn new(voxel_size: f32, max_points: usize) -> Self {
+        assert!(voxel_size > 0.0, "Voxel size must be positive");
+        let mut grid = Self {
+            voxel_size,
+            inverse_voxel_size: 1.0 / voxel_size,
+            slots: Vec::new(),
+            slot_bits: 0,
+            generation: 0,
+            occupied: Vec::new(),
+        };
+        grid.reserve(max_points);
+        grid
+    }
+
+    pub fn voxel_size(&self) -> f32 {
+        self.voxel_size
+    }
+
+    /// The number of occupied voxels found by the last call to downsample
+    pub fn occupied_voxels(&self) -> usize {
+        self.occupied.len()
+    }
+
+    /// Replace the contents of `out` with the centroid of each occupied voxel of `points`.
+    ///
+    /// Points without a positive Z are skipped, so the output of
+    /// [PointCloudProjector::project](crate::PointCloudProjector::project) can be passed in
+    /// directly.
+    pub fn downsample(&mut self, points: &[[f32; 3]], out: &mut Vec<[f32; 3]>) {
+        self.begin(points.len());
+        for &point in points {
+            self.add(point);
+        }
+        self.finish(out);
+    }
+
+    /// Like [VoxelGrid::downsample], for the points from
+    /// [PointCloudProjector::project_dense](crate::PointCloudProjector::project_dense)
+    pub fn downsample_dense(&mut self, points: &DensePoints, out: &mut Vec<[f32; 3]>) {
+        self.begin(points.len());
+        let coordinates = points.x().iter().zip(points.y()).zip(points.z());
+        for ((&x, &y), &z) in coordinates {
+            self.add([x, y, z]);
+        }
+        self.finish(out);
+    }
+
+    /// Make sure the table can take `points` distinct voxels while at most half full
+    fn reserve(&mut self, points: usize) {
+        let slots = (points * SLOTS_PER_POINT).next_power_of_two().max(16);
+        if slots > self.slots.len() {
+            // Every slot gets generation 0, which is never a live pass
+            self.slots = vec![Slot::default(); slots];
+            self.slot_bits = slots.trailing_zeros();
+            self.generation = 0;
+            self.occupied = Vec::with_capacity(slots / SLOTS_PER_POINT);
+        }
+    }
+
+    fn begin(&mut self, points: usize) {
+        self.reserve(points);
+        self.occupied.clear();
+
+        self.generation = self.generation.wrapping_add(1);
+        if self.generation == 0 {
+            // Slots last written 2^32 passes ago would look live again, so empty them all
+            self.slots.fill(Slot::default());
+            self.generation = 1;
+        }
+    }
+
+    /// Pack the coordinates of the voxel containing `point` into one key
+    fn key(&self, point: [f32; 3]) -> u64 {
+        point.iter().enumerate().fold(0, |key, (axis, &value)| {
+            // Float to int casts saturate, and NaN becomes 0
+            let coordinate = ((value * self.inverse_voxel_size).floor() as i64)
+                .clamp(COORDINATE_MIN, COORDINATE_MAX);
+            key | ((coordinate as u64 & COORDINATE_MASK) << (axis as u32 * COORDINATE_BITS))
+        })
+    }
+
+    fn add(&mut self, point: [f32; 3]) {
+        if !(point[2] > 0.0) {
+            return;
+        }
+
+        let key = self.key(point);
+        let mask = self.slots.len() - 1;
+        // Fibonacci hashing spreads neighbouring voxels, whose keys differ in few bits
+        let mut index = (key.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (64 - self.slot_bits)) as usize;
+
+        loop {
+            let slot = &mut self.slots[index];
+            if slot.generation != self.generation {
+                *slot = Slot {
+                    key,
+                    generation: self.generation,
+                    count: 1,
+                    sum: point,
+                };
+                self.occupied.push(index as u32);
+                return;
+            }
+            if slot.key == key {
+                slot.count += 1;
+                for (sum, value) in slot.sum.iter_mut().zip(point) {
+                    *sum += value;
+                }
+                return;
+            }
+            // The table is at most half full, so this always finds a free slot
+            index = (index + 1) & mask;
+        }
+    }
+
+    fn finish(&self, out: &mut Vec<[f32; 3]>) {
+        out.clear();
+        out.extend(self.occupied.iter().map(|&index| {
+            let slot = &self.slots[index as usize];
+            slot.sum.map(|sum| sum / slot.count as f32)
+        }));
+    }
+}
@@ -0,0 +1,786 @@
+//! A compact binary protocol for streaming frames over a byte stream such as TCP.
+//!
+//! Each frame is a fixed [FrameHeader] followed by the depth and confidence planes, quantised to
+//! little-endian `u16`s using the scales given in the header. The receiver reprojects the depth
+//! itself with a [PointCloudProjector](crate::PointCloudProjector), so only 4 bytes per pixel
+//! cross the wire instead of a full XYZ point.
+//!
+//! Frames sent with [FrameEncoder::encode_masked] carry a packed [ValidityMask] in front of the
+//! planes, and the planes hold only the pixels it marks valid.
+//!
+//! Frames sent with [FrameEncoder::encode_binned] give their [BinFactor] in the header, so the
+//! receiver can project them with
+//! [PointCloudProjector::binned](crate::PointCloudProjector::binned).
+
+use std::io::{Read, Write};
+
+use thiserror::Error;
+
+use crate::{
+    binning::{BinFactor, BinnedFrame},
+    mask::ValidityMask,
+    simd::MASK_BITS,
+    ArducamFrameFormat, FrameData,
+};
+
+/// The first bytes of every frame header
+pub const MAGIC: [u8; 4] = *b"ATOF";
+/// The protocol version written by [FrameEncoder]
+pub const VERSION: u8 = 1;
+
+/// Default depth resolution of 0.1 mm, giving a range of up to 6.5 m
+pub const DEFAULT_DEPTH_SCALE: f32 = 1e-4;
+/// Default confidence resolution of 0.01
+pub const DEFAULT_CONFIDENCE_SCALE: f32 = 1e-2;
+/// Largest frame a [FrameDecoder] accepts by default: the sensor's full 240x180 resolution
+pub const DEFAULT_MAX_PIXELS: usize = 240 * 180;
+
+#[derive(Debug, Error)]
+pub enum WireError {
+    #[error("I/O error: {0}")]
+    Io(#[from] std::io::Error),
+    #[error("Bad frame header magic: {0:?}")]
+    BadMagic([u8; 4]),
+    #[error("Unsupported protocol version: {0}")]
+    UnsupportedVersion(u8),
+    #[error("Unsupported encoding flags: {0:#06x}")]
+    UnsupportedEncoding(u16),
+    #[error("Unsupported bin size: {0}")]
+    UnsupportedBinning(u8),
+    #[error("Payload is {actual} bytes but a {width}x{height} frame needs {expected}")]
+    PayloadLength {
+        width: u16,
+        height: u16,
+        expected: u32,
+        actual: u32,
+    },
+    #[error("A {width}x{height} frame is larger than the {max_pixels} pixels allowed")]
+    FrameTooLarge {
+        width: u16,
+        height: u16,
+        max_pixels: usize,
+    },
+}
+
+/// Flags describing how a frame's payload is encoded
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct EncodingFlags(pub u16);
+
+impl EncodingFlags {
+    /// The payload has a depth plane of `u16`s in units of [FrameHeader::depth_scale]
+    pub const DEPTH_U16: Self = Self(1 << 0);
+    /// The payload has a confidence plane of `u16`s in units of
+    /// [FrameHeader::confidence_scale], following the depth plane
+    pub const CONFIDENCE_U16: Self = Self(1 << 1);
+    /// The payload starts with a [ValidityMask] of little-endian `u64` words, and the planes
+    /// only have values for the pixels it marks valid
+    pub const VALIDITY_MASK: Self = Self(1 << 2);
+
+    /// Every flag this version of the protocol understands
+    const SUPPORTED: Self =
+        Self(Self::DEPTH_U16.0 | Self::CONFIDENCE_U16.0 | Self::VALIDITY_MASK.0);
+
+    pub fn contains(self, other: Self) -> bool {
+        self.0 & other.0 == other.0
+    }
+}
+
+impl std::ops::BitOr for EncodingFlags {
+    type Output = Self;
+
+    fn bitor(self, rhs: Self) -> Self {
+        Self(self.0 | rhs.0)
+    }
+}
+
+/// The fixed size header in front of every frame
+#[derive(Debug, Clone, Copy)]
+pub struct FrameHeader {
+    /// Incremented by the sender for every frame, so receivers can spot gaps
+    pub sequence: u64,
+    /// [ArducamFrameFormat::timestamp] of the frame
+    pub timestamp: u64,
+    pub width: u16,
+    pub height: u16,
+    pub flags: EncodingFlags,
+    /// The factor the frame was binned by, or None if it is at full resolution
+    pub bin_factor: Option<BinFactor>,
+    /// Metres per unit of the depth plane
+    pub depth_scale: f32,
+    /// Confidence per unit of the confidence plane
+    pub confidence_scale: f32,
+    /// Number of bytes following the header
+    pub payload_len: u32,
+}
+
+impl FrameHeader {
+    /// Size of an encoded header in bytes
+    pub const SIZE: usize = 40;
+
+    pub fn pixel_count(&self) -> usize {
+        self.width as usize * self.height as usize
+    }
+
+    fn plane_count(&self) -> usize {
+        self.flags.contains(EncodingFlags::DEPTH_U16) as usize
+            + self.flags.contains(EncodingFlags::CONFIDENCE_U16) as usize
+    }
+
+    /// Bytes taken by the validity mask at the start of the payload
+    fn mask_len(&self) -> usize {
+        if self.flags.contains(EncodingFlags::VALIDITY_MASK) {
+            self.pixel_count().div_ceil(MASK_BITS) * size_of::<u64>()
+        } else {
+            0
+        }
+    }
+
+    /// The payload length implied by the dimensions and flags, when `plane_pixels` pixels are
+    /// in each plane
+    fn expected_payload_len(&self, plane_pixels: usize) -> usize {
+        self.mask_len() + self.plane_count() * plane_pixels * size_of::<u16>()
+    }
+
+    fn payload_length_error(&self, plane_pixels: usize) -> WireError {
+        WireError::PayloadLength {
+            width: self.width,
+            height: self.height,
+            expected: self.expected_payload_len(plane_pixels) as u32,
+            actual: self.payload_len,
+        }
+    }
+
+    pub fn to_bytes(&self) -> [u8; Self::SIZE] {
+        let mut bytes = [0; Self::SIZE];
+        bytes[0..4].copy_from_slice(&MAGIC);
+        bytes[4] = VERSION;
+        // Senders from before binning left this byte 0, which still means full resolution
+        bytes[5] = self.bin_factor.map_or(0, |factor| factor.size() as u8);
+        bytes[6..8].copy_from_slice(&self.flags.0.to_le_bytes());
+        bytes[8..16].copy_from_slice(&self.sequence.to_le_bytes());
+        bytes[16..24].copy_from_slice(&self.timestamp.to_le_bytes());
+        bytes[24..26].copy_from_slice(&self.width.to_le_bytes());
+        bytes[26..28].copy_from_slice(&self.height.to_le_bytes());
+        bytes[28..32].copy_from_slice(&self.depth_scale.to_le_bytes());
+        bytes[32..36].copy_from_slice(&self.confidence_scale.to_le_bytes());
+        bytes[36..40].copy_from_slice(&self.payload_len.to_le_bytes());
+        bytes
+    }
+
+    pub fn from_bytes(bytes: &[u8; Self::SIZE]) -> Result<Self, WireError> {
+        let magic = bytes[0..4].try_into().unwrap();
+        if magic != MAGIC {
+            return Err(WireError::BadMagic(magic));
+        }
+        if bytes[4] != VERSION {
+            return Err(WireError::UnsupportedVersion(bytes[4]));
+        }
+
+        let bin_factor = match bytes[5] {
+            0 => None,
+            size => match BinFactor::from_size(size as u16) {
+                Some(factor) => Some(factor),
+                None => return Err(WireError::UnsupportedBinning(size)),
+            },
+        };
+
+        let header = Self {
+            flags: EncodingFlags(u16::from_le_bytes(bytes[6..8].try_into().unwrap())),
+            sequence: u64::from_le_bytes(bytes[8..16].try_into().unwrap()),
+            timestamp: u64::from_le_bytes(bytes[16..24].try_into().unwrap()),
+            width: u16::from_le_bytes(bytes[24..26].try_into().unwrap()),
+            height: u16::from_le_bytes(bytes[26..28].try_into().unwrap()),
+            bin_factor,
+            depth_scale: f32::from_le_bytes(bytes[28..32].try_into().unwrap()),
+            confidence_scale: f32::from_le_bytes(bytes[32..36].try_into().unwrap()),
+            payload_len: u32::from_le_bytes(bytes[36..40].try_into().unwrap()),
+        };
+
+        if header.flags.0 & !EncodingFlags::SUPPORTED.0 != 0 {
+            return Err(WireError::UnsupportedEncoding(header.flags.0));
+        }
+
+        // With a mask the planes may hold anywhere up to every pixel, which is checked against
+        // the mask once it has been read
+        let payload_len = header.payload_len as usize;
+        let valid = if header.flags.contains(EncodingFlags::VALIDITY_MASK) {
+            let value_len = header.plane_count() * size_of::<u16>();
+            payload_len
+                .checked_sub(header.mask_len())
+                .is_some_and(|planes_len| match value_len {
+                    0 => planes_len == 0,
+                    _ => {
+                        planes_len % value_len == 0
+                            && planes_len / value_len <= header.pixel_count()
+                    }
+                })
+        } else {
+            payload_len == header.expected_payload_len(header.pixel_count())
+        };
+        if !valid {
+            return Err(header.payload_length_error(header.pixel_count()));
+        }
+
+        Ok(header)
+    }
+}
+
+/// Quantise `values` to multiples of `scale`, saturating at the ends of the `u16` range
+fn quantise(values: &[f32], scale: f32, out: &mut Vec<u8>) {
+    let inverse = 1.0 / scale;
+    out.extend(
+        values
+            .iter()
+            // Float to int casts saturate, and NaN becomes 0
+            .flat_map(|&value| ((value * inverse + 0.5) as u16).to_le_bytes()),
+    );
+}
+
+/// Quantise the values of the pixels valid in `mask`, like [quantise]
+fn quantise_masked(values: &[f32], mask: &ValidityMask, scale: f32, out: &mut Vec<u8>) {
+    let inverse = 1.0 / scale;
+    out.extend(
+        mask.iter_valid()
+            .flat_map(|index| ((values[index] * inverse + 0.5) as u16).to_le_bytes()),
+    );
+}
+
+/// Encodes frames for sending, reusing one buffer between frames
+pub struct FrameEncoder {
+    depth_scale: f32,
+    confidence_scale: f32,
+    sequence: u64,
+    buffer: Vec<u8>,
+}
+
+impl Default for FrameEncoder {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FrameEncoder {
+    /// An encoder using [DEFAULT_DEPTH_SCALE] and [DEFAULT_CONFIDENCE_SCALE]
+    pub fn new() -> Self {
+        Self::with_scales(DEFAULT_DEPTH_SCALE, DEFAULT_CONFIDENCE_SCALE)
+    }
+
+    /// An encoder quantising depth to multiples of `depth_scale` metres and confidence to
+    /// multiples of `confidence_scale`
+    pub fn with_scales(depth_scale: f32, confidence_scale: f32) -> Self {
+        Self {
+            depth_scale,
+            confidence_scale,
+            sequence: 0,
+            buffer: Vec::new(),
+        }
+    }
+
+    /// Encode a frame, returning the bytes to send
+    pub fn encode(
+        &mut self,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> &[u8] {
+        self.encode_with(format, depth, confidence, None, None)
+    }
+
+    /// Encode a frame with only the pixels valid in `mask`, returning the bytes to send. The
+    /// receiver gets the mask back from [DecodedFrame::validity_mask], and 0 in both planes for
+    /// the pixels left out.
+    pub fn encode_masked(
+        &mut self,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: &ValidityMask,
+    ) -> &[u8] {
+        self.encode_with(format, depth, confidence, Some(mask), None)
+    }
+
+    /// Encode a frame from [FrameData::bin], optionally with only the pixels valid in `mask`,
+    /// returning the bytes to send. The receiver gets the factor back from
+    /// [FrameHeader::bin_factor].
+    pub fn encode_binned(
+        &mut self,
+        format: &ArducamFrameFormat,
+        frame: &BinnedFrame,
+        mask: Option<&ValidityMask>,
+    ) -> &[u8] {
+        self.encode_with(
+            format,
+            &frame.depth(),
+            &frame.confidence(),
+            mask,
+            Some(frame.factor()),
+        )
+    }
+
+    fn encode_with(
+        &mut self,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: Option<&ValidityMask>,
+        bin_factor: Option<BinFactor>,
+    ) -> &[u8] {
+        instrument_span!(Serialisation);
+        assert!(depth.width() == confidence.width());
+        assert!(depth.height() == confidence.height());
+
+        let mut flags = EncodingFlags::DEPTH_U16 | EncodingFlags::CONFIDENCE_U16;
+        if let Some(mask) = mask {
+            assert!(
+                mask.check_size(depth).is_ok(),
+                "Mask is for a different frame size"
+            );
+            flags = flags | EncodingFlags::VALIDITY_MASK;
+        }
+
+        let mut header = FrameHeader {
+            sequence: self.sequence,
+            timestamp: format.timestamp,
+            width: depth.width(),
+            height: depth.height(),
+            flags,
+            bin_factor,
+            depth_scale: self.depth_scale,
+            confidence_scale: self.confidence_scale,
+            payload_len: 0,
+        };
+        let plane_pixels = mask.map_or(header.pixel_count(), ValidityMask::count_valid);
+        header.payload_len = header.expected_payload_len(plane_pixels) as u32;
+        self.sequence += 1;
+
+        self.buffer.clear();
+        self.buffer.extend_from_slice(&header.to_bytes());
+        match mask {
+            Some(mask) => {
+                for word in mask.words() {
+                    self.buffer.extend_from_slice(&word.to_le_bytes());
+                }
+                quantise_masked(depth.as_slice(), mask, self.depth_scale, &mut self.buffer);
+                quantise_masked(
+                    confidence.as_slice(),
+                    mask,
+                    self.confidence_scale,
+                    &mut self.buffer,
+                );
+            }
+            None => {
+                quantise(depth.as_slice(), self.depth_scale, &mut self.buffer);
+                quantise(
+                    confidence.as_slice(),
+                    self.confidence_scale,
+                    &mut self.buffer,
+                );
+            }
+        }
+        &self.buffer
+    }
+
+    /// Encode a frame and write it to `writer`
+    pub fn write_frame<W: Write>(
+        &mut self,
+        writer: &mut W,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+    ) -> std::io::Result<()> {
+        let bytes = self.encode(format, depth, confidence);
+        writer.write_all(bytes)
+    }
+
+    /// Encode a frame with only the pixels valid in `mask` and write it to `writer`
+    pub fn write_frame_masked<W: Write>(
+        &mut self,
+        writer: &mut W,
+        format: &ArducamFrameFormat,
+        depth: &FrameData<f32>,
+        confidence: &FrameData<f32>,
+        mask: &ValidityMask,
+    ) -> std::io::Result<()> {
+        let bytes = self.encode_masked(format, depth, confidence, mask);
+        writer.write_all(bytes)
+    }
+
+    /// Encode a frame from [FrameData::bin], optionally with only the pixels valid in `mask`,
+    /// and write it to `writer`
+    pub fn write_frame_binned<W: Write>(
+        &mut self,
+        writer: &mut W,
+        format: &ArducamFrameFormat,
+        frame: &BinnedFrame,
+        mask: Option<&ValidityMask>,
+    ) -> std::io::Result<()> {
+        let bytes = self.encode_binned(format, frame, mask);
+        writer.write_all(bytes)
+    }
+}
+
+/// A frame received by a [FrameDecoder].
+///
+/// The quantised planes are read from the stream directly into this frame's buffers and then
+/// expanded in place, so a `DecodedFrame` that is reused for every frame never reallocates once
+/// it has seen the largest frame size.
+#[derive(Default)]
+pub struct DecodedFrame {
+    header: Option<FrameHeader>,
+    depth_raw: Vec<u16>,
+    confidence_raw: Vec<u16>,
+    depth: Vec<f32>,
+    confidence: Vec<f32>,
+    mask: ValidityMask,
+}
+
+impl DecodedFrame {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// The header of the last frame decoded into this
+    pub fn header(&self) -> &FrameHeader {
+        self.header.as_ref().expect("No frame decoded yet")
+    }
+
+    pub fn get_depth_data(&self) -> FrameData<'_, f32> {
+        let header = self.header();
+        FrameData::new(header.width, header.height, &self.depth)
+    }
+
+    pub fn get_confidence_data(&self) -> FrameData<'_, f32> {
+        let header = self.header();
+        FrameData::new(header.width, header.height, &self.confidence)
+    }
+
+    /// The mask the frame was sent with, if it was encoded with [FrameEncoder::encode_masked]
+    pub fn validity_mask(&self) -> Option<&ValidityMask> {
+        let header = self.header();
+        header
+            .flags
+            .contains(EncodingFlags::VALIDITY_MASK)
+            .then_some(&self.mask)
+    }
+
+    /// The depth plane as received, in units of [FrameHeader::depth_scale]
+    pub fn get_raw_depth_data(&self) -> FrameData<'_, u16> {
+        let header = self.header();
+        FrameData::new(header.width, header.height, &self.depth_raw)
+    }
+
+    /// The confidence plane as received, in units of [FrameHeader::confidence_scale]
+    pub fn get_raw_confidence_data(&self) -> FrameData<'_, u16> {
+        let header = self.header();
+        FrameData::new(header.width, header.height, &self.confidence_raw)
+    }
+}
+
+/// Read a packed [ValidityMask] of little-endian `u64`s straight into `mask`
+fn read_mask<R: Read>(
+    reader: &mut R,
+    width: u16,
+    height: u16,
+    mask: &mut ValidityMask,
+) -> std::io::Result<()> {
+    mask.resize(width, height);
+    let words = mask.words_mut();
+
+    // Every bit pattern is a valid u64, so the mask can be read through a byte view of it
+    let bytes = unsafe {
+        std::slice::from_raw_parts_mut(
+            words.as_mut_ptr() as *mut u8,
+            words.len() * size_of::<u64>(),
+        )
+    };
+    reader.read_exact(bytes)?;
+
+    for word in words.iter_mut() {
+        *word = u64::from_le(*word);
+    }
+    // Keep the bits past the last pixel clear whatever the sender put there
+    let tail = (width as usize * height as usize) % MASK_BITS;
+    if let (Some(last), true) = (words.last_mut(), tail != 0) {
+        *last &= (1 << tail) - 1;
+    }
+
+    Ok(())
+}
+
+/// Read a plane of little-endian `u16`s straight into `raw`, then expand it into `out`. If the
+/// plane is not `present` both are zero filled.
+///
+/// With a `mask` the plane only holds the valid pixels, which are spread out to their place in
+/// `raw` with the rest set to 0.
+fn read_plane<R: Read>(
+    reader: &mut R,
+    present: bool,
+    pixel_count: usize,
+    mask: Option<&ValidityMask>,
+    scale: f32,
+    raw: &mut Vec<u16>,
+    out: &mut Vec<f32>,
+) -> std::io::Result<()> {
+    raw.resize(pixel_count, 0);
+    out.resize(pixel_count, 0.0);
+
+    if !present {
+        raw.fill(0);
+        out.fill(0.0);
+        return Ok(());
+    }
+
+    let received = mask.map_or(pixel_count, ValidityMask::count_valid);
+    // Every bit pattern is a valid u16, so the plane can be read through a byte view of it
+    let bytes = unsafe {
+        std::slice::from_raw_parts_mut(raw.as_mut_ptr() as *mut u8, received * size_of::<u16>())
+    };
+    reader.read_exact(bytes)?;
+
+    if let Some(mask) = mask {
+        // Working backwards, each value moves to a pixel at or after its position in the packed
+        // plane, so none is overwritten before it has been moved
+        let mut remaining = received;
+        for index in (0..pixel_count).rev() {
+            if mask.is_valid(index) {
+                remaining -= 1;
+                raw[index] = raw[remaining];
+            } else {
+                raw[index] = 0;
+            }
+        }
+    }
+
+    for (value, out) in raw.iter_mut().zip(out.iter_mut()) {
+        // A no-op on little-endian targets
+        *value = u16::from_le(*value);
+        *out = *value as f32 * scale;
+    }
+
+    Ok(())
+}
+
+/// Decodes frames from a byte stream
+pub struct FrameDecoder {
+    max_pixels: usize,
+    next_sequence: Option<u64>,
+    missed_frames: u64,
+}
+
+impl Default for FrameDecoder {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FrameDecoder {
+    /// A decoder accepting frames of up to [DEFAULT_MAX_PIXELS]
+    pub fn new() -> Self {
+        Self {
+            max_pixels: DEFAULT_MAX_PIXELS,
+            next_sequence: None,
+            missed_frames: 0,
+        }
+    }
+
+    /// Accept frames of up to `max_pixels` rather than [DEFAULT_MAX_PIXELS].
+    ///
+    /// Buffers are sized from the header before the payload arrives, so this bounds the memory
+    /// a sender can make the decoder allocate.
+    pub fn with_max_pixels(mut self, max_pixels: usize) -> Self {
+        self.max_pixels = max_pixels;
+        self
+    }
+
+    /// The number of frames the sender numbered but this decoder never saw, judging by gaps
+    /// in [FrameHeader::sequence]
+    pub fn missed_frames(&self) -> u64 {
+        self.missed_frames
+    }
+
+    /// Read the next frame from `reader` into `frame`, reusing its buffers.
+    ///
+    /// Frames larger than the decoder's maximum are rejected with [WireError::FrameTooLarge]
+    /// before anything is allocated for them. If reading fails in the header, `frame` keeps the
+    /// frame it held. If it fails after that, `frame` holds no frame until it is next read into
+    /// successfully.
+    pub fn read_frame<R: Read>(
+        &mut self,
+        reader: &mut R,
+        frame: &mut DecodedFrame,
+    ) -> Result<(), WireError> {
+        let mut header = [0; FrameHeader::SIZE];
+        reader.read_exact(&mut header)?;
+        let header = FrameHeader::from_bytes(&header)?;
+        if header.pixel_count() > self.max_pixels {
+            return Err(WireError::FrameTooLarge {
+                width: header.width,
+                height: header.height,
+                max_pixels: self.max_pixels,
+            });
+        }
+        // The buffers stop matching the old header as soon as they are resized
+        frame.header = None;
+
+        let mask = if header.flags.contains(EncodingFlags::VALIDITY_MASK) {
+            read_mask(reader, header.width, header.height, &mut frame.mask)?;
+            let valid = frame.mask.count_valid();
+            if header.payload_len as usize != header.expected_payload_len(valid) {
+                return Err(header.payload_length_error(valid));
+            }
+            Some(&frame.mask)
+        } else {
+            None
+        };
+
+        read_plane(
+            reader,
+            header.flags.contains(EncodingFlags::DEPTH_U16),
+            header.pixel_count(),
+            mask,
+            header.depth_scale,
+            &mut frame.depth_raw,
+            &mut frame.depth,
+        )?;
+        read_plane(
+            reader,
+            header.flags.contains(EncodingFlags::CONFIDENCE_U16),
+            header.pixel_count(),
+            mask,
+            header.confidence_scale,
+            &mut frame.confidence_raw,
+            &mut frame.confidence,
+        )?;
+
+        // Sequence numbers wrap, so a gap of more than half their range means a frame older than
+        // expected rather than a huge number of missed ones
+        if let Some(expected) = self.next_sequence {
+            let gap = header.sequence.wrapping_sub(expected);
+            if gap <= u64::MAX / 2 {
+                self.missed_frames = self.missed_frames.saturating_add(gap);
+            }
+        }
+        self.next_sequence = Some(header.sequence.wrapping_add(1));
+
+        frame.header = Some(header);
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::FrameType;
+
+    /// A header for a `width`x`height` frame with `flags`, claiming the payload that size needs
+    fn header(flags: EncodingFlags, width: u16, height: u16) -> FrameHeader {
+        let mut header = FrameHeader {
+            sequence: 0,
+            timestamp: 0,
+            width,
+            height,
+            flags,
+            bin_factor: None,
+            depth_scale: DEFAULT_DEPTH_SCALE,
+            confidence_scale: DEFAULT_CONFIDENCE_SCALE,
+            payload_len: 0,
+        };
+        header.payload_len = header.expected_payload_len(header.pixel_count()) as u32;
+        header
+    }
+
+    /// An encoded 3x2 frame numbered `sequence`
+    fn small_frame(sequence: u64) -> Vec<u8> {
+        let format = ArducamFrameFormat {
+            width: 3,
+            height: 2,
+            frame_type: FrameType::DepthFrame,
+            timestamp: 0,
+        };
+        let plane = [1.0; 6];
+        let plane = FrameData::new(3, 2, &plane);
+        let mut bytes = FrameEncoder::new().encode(&format, &plane, &plane).to_vec();
+        bytes[8..16].copy_from_slice(&sequence.to_le_bytes());
+        bytes
+    }
+
+    #[test]
+    fn rejects_oversized_headers_before_allocating() {
+        let headers = [
+            header(EncodingFlags::DEPTH_U16, u16::MAX, u16::MAX / 2),
+            header(EncodingFlags::VALIDITY_MASK, u16::MAX, u16::MAX),
+        ];
+        for header in headers {
+            // The header passes its own checks, and no payload follows it
+            FrameHeader::from_bytes(&header.to_bytes()).unwrap();
+
+            let mut frame = DecodedFrame::new();
+            let result = FrameDecoder::new().read_frame(&mut &header.to_bytes()[..], &mut frame);
+            assert!(
+                matches!(
+                    result,
+                    Err(WireError::FrameTooLarge {
+                        max_pixels: DEFAULT_MAX_PIXELS,
+                        ..
+                    })
+                ),
+                "{result:?}"
+            );
+            assert_eq!(frame.depth.capacity(), 0);
+            assert_eq!(frame.confidence.capacity(), 0);
+            assert!(frame.mask.words().is_empty());
+        }
+
+        let header = header(EncodingFlags::DEPTH_U16, 4, 4);
+        let mut bytes = header.to_bytes().to_vec();
+        bytes.resize(bytes.len() + header.payload_len as usize, 0);
+        let mut decoder = FrameDecoder::new().with_max_pixels(15);
+        let mut frame = DecodedFrame::new();
+        let result = decoder.read_frame(&mut &bytes[..], &mut frame);
+        assert!(matches!(result, Err(WireError::FrameTooLarge { .. })));
+        let mut decoder = FrameDecoder::new().with_max_pixels(16);
+        decoder.read_frame(&mut &bytes[..], &mut frame).unwrap();
+        assert_eq!(frame.get_depth_data().width(), 4);
+    }
+
+    #[test]
+    fn failed_payload_read_leaves_no_frame() {
+        let mut decoder = FrameDecoder::new();
+        let mut frame = DecodedFrame::new();
+        decoder
+            .read_frame(&mut &small_frame(0)[..], &mut frame)
+            .unwrap();
+        assert!(frame.header.is_some());
+
+        // Failing in the header leaves the frame alone
+        let oversized = header(EncodingFlags::DEPTH_U16, u16::MAX, u16::MAX / 2);
+        let result = decoder.read_frame(&mut &oversized.to_bytes()[..], &mut frame);
+        assert!(matches!(result, Err(WireError::FrameTooLarge { .. })));
+        assert!(decoder.read_frame(&mut &[][..], &mut frame).is_err());
+        assert_eq!(frame.get_depth_data().as_slice().len(), 6);
+
+        // A bigger frame cut short after its buffers have been resized
+        let header = header(EncodingFlags::DEPTH_U16, 8, 8);
+        let result = decoder.read_frame(&mut &header.to_bytes()[..], &mut frame);
+        assert!(matches!(result, Err(WireError::Io(_))), "{result:?}");
+        assert!(frame.header.is_none());
+
+        decoder
+            .read_frame(&mut &small_frame(1)[..], &mut frame)
+            .unwrap();
+        assert_eq!(frame.get_depth_data().as_slice().len(), 6);
+    }
+
+    #[test]
+    fn sequence_numbers_wrap() {
+        let mut decoder = FrameDecoder::new();
+        let mut frame = DecodedFrame::new();
+        for sequence in [u64::MAX - 1, u64::MAX, 0, 3, 1] {
+            decoder
+                .read_frame(&mut &small_frame(sequence)[..], &mut frame)
+                .unwrap();
+        }
+        // 1 and 2 were skipped, and going back to 1 is not a gap
+        assert_eq!(decoder.missed_frames(), 2);
+    }
+}
@@ -0,0 +1,179 @@
+//! A small pool of persistent threads for splitting the work on one frame.
+//!
+//! [Workers] keeps its threads parked between frames, so handing out the parts of a frame costs
+//! a wake-up per thread rather than a thread spawned per part. The thread calling
+//! [Workers::for_each] works on parts too, and it returns once every part is done, so the parts
+//! can borrow from the caller just as with [std::thread::scope].
+
+use std::{
+    panic::{catch_unwind, resume_unwind, AssertUnwindSafe},
+    sync::{Arc, Condvar, Mutex, MutexGuard},
+    thread::JoinHandle,
+};
+
+pub(crate) struct Workers {
+    threads: usize,
+    shared: Arc<Shared>,
+    handles: Vec<JoinHandle<()>>,
+    /// Held for the whole of [Workers::for_each], as the pool runs one job at a time
+    running: Mutex<()>,
+}
+
+struct Shared {
+    state: Mutex<State>,
+    /// Signalled when a job is posted or the pool is stopping
+    posted: Condvar,
+    /// Signalled when the last part of a job is finished
+    finished: Condvar,
+}
+
+#[derive(Default)]
+struct State {
+    job: Option<Job>,
+    /// Index of the next part to hand out
+    next: usize,
+    /// Parts finished so far
+    done: usize,
+    /// The payload of the first part to panic
+    panic: Option<Box<dyn std::any::Any + Send>>,
+    stop: bool,
+}
+
+/// A posted job. `run` points to a closure on the stack of the thread in [Workers::for_each],
+/// which does not return until every part is done, so it outlives every call.
+#[derive(Clone, Copy)]
+struct Job {
+    run: *const (dyn Fn(usize) + Sync + 'static),
+    parts: usize,
+}
+
+// The closure is Sync, so it can be called from any thread
+unsafe impl Send for Job {}
+
+impl Workers {
+    /// A pool running jobs on `threads` threads, counting the one calling [Workers::for_each],
+    /// so `threads - 1` are spawned
+    pub(crate) fn new(threads: usize) -> Self {
+        assert!(threads >= 1, "Worker pool needs at least 1 thread");
+        let shared = Arc::new(Shared {
+            state: Mutex::new(State::default()),
+            posted: Condvar::new(),
+            finished: Condvar::new(),
+        });
+        let handles = (1..threads)
+            .map(|_| {
+                let shared = shared.clone();
+                std::thread::Builder::new()
+                    .name("arducam-tof-worker".into())
+                    .spawn(move || worker(&shared))
+                    .expect("Failed to spawn worker thread")
+            })
+            .collect();
+
+        Self {
+            threads,
+            shared,
+            handles,
+            running: Mutex::new(()),
+        }
+    }
+
+    pub(crate) fn threads(&self) -> usize {
+        self.threads
+    }
+
+    /// Call `f` on every item, spread over the pool's threads, and return once all are done.
+    /// If any call panics, the panic is resumed here after the rest have finished.
+    pub(crate) fn for_each<T, F>(&self, items: impl IntoIterator<Item = T>, f: F)
+    where
+        T: Send,
+        F: Fn(T) + Sync,
+    {
+        if self.handles.is_empty() {
+            items.into_iter().for_each(f);
+            return;
+        }
+
+        let items: Vec<Mutex<Option<T>>> = items
+            .into_iter()
+            .map(|item| Mutex::new(Some(item)))
+            .collect();
+        let run = |index: usize| f(items[index].lock().unwrap().take().unwrap());
+        let run: &(dyn Fn(usize) + Sync) = &run;
+        let job = Job {
+            // Only the lifetime is erased, see Job
+            run: unsafe { std::mem::transmute(run as *const (dyn Fn(usize) + Sync)) },
+            parts: items.len(),
+        };
+
+        let _running = self
+            .running
+            .lock()
+            .unwrap_or_else(|poisoned| poisoned.into_inner());
+        let mut state = self.shared.lock();
+        *state = State {
+            job: Some(job),
+            ..State::default()
+        };
+        self.shared.posted.notify_all();
+
+        state = work(&self.shared, state);
+        while state.done < job.parts {
+            state = self.shared.finished.wait(state).unwrap();
+        }
+        state.job = None;
+        if let Some(payload) = state.panic.take() {
+            drop(state);
+            resume_unwind(payload);
+        }
+    }
+}
+
+impl Drop for Workers {
+    fn drop(&mut self) {
+        self.shared.lock().stop = true;
+        self.shared.posted.notify_all();
+        for handle in self.handles.drain(..) {
+            let _ = handle.join();
+        }
+    }
+}
+
+impl Shared {
+    fn lock(&self) -> MutexGuard<'_, State> {
+        // Parts never panic while holding the lock
+        self.state.lock().unwrap()
+    }
+}
+
+/// Run parts of the posted job until there are none left to hand out
+fn work<'a>(shared: &'a Shared, mut state: MutexGuard<'a, State>) -> MutexGuard<'a, State> {
+    while let Some(job) = state.job.filter(|job| state.next < job.parts) {
+        let index = state.next;
+        state.next += 1;
+        drop(state);
+
+        let result = catch_unwind(AssertUnwindSafe(|| unsafe { (*job.run)(index) }));
+
+        state = shared.lock();
+        if let Err(payload) = result {
+            state.panic.get_or_insert(payload);
+        }
+        state.done += 1;
+        if state.done == job.parts {
+            shared.finished.notify_all();
+        }
+    }
+    state
+}
+
+fn worker(shared: &Shared) {
+    let mut state = shared.lock();
+    loop {
+        state = work(shared, state);
+        if state.stop {
+            return;
+        }
+        state = shared.posted.wait(state).unwrap();
+    }
+}